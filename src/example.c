@@ -1,5 +1,10 @@
 #define _DEFAULT_SOURCE
 
+// the session extension (see example_session_start) is only declared by
+// sqlite3.h with these; the sqlite3 library has to be built with them too.
+#define SQLITE_ENABLE_SESSION
+#define SQLITE_ENABLE_PREUPDATE_HOOK
+
 #include <stddef.h>
 #include <syslog.h>
 #include <string.h>
@@ -12,596 +17,9799 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+
+#ifdef EXAMPLE_WITH_LZ4
+#include <lz4.h>
+#endif
 
 #define EXAMPLE_SENTINEL 8090
 #define EXAMPLE_AGG_F_SENTINEL 8091
+#define EXAMPLE_POOL_SENTINEL 8092
+
+#define EXAMPLE_WRITER_SENTINEL 8093
+#define EXAMPLE_SESSION_SENTINEL 8094
+#define EXAMPLE_QUERY_SENTINEL 8095
+#define EXAMPLE_ASYNC_SENTINEL 8096
+#define EXAMPLE_COMPACTOR_SENTINEL 8097
+
+// upper bound on the number of read-only connections in a struct example_pool_s
+#define EXAMPLE_POOL_READERS_MAX 16
+
+// number of slots in the write pipeline ring; must be a power of two
+#define EXAMPLE_WRITER_RING_LEN 4096
+
+// max number of measurements the writer thread applies in one transaction,
+// and the size of the hash table used to coalesce them (a power of two, at
+// least twice the batch size to keep the probe sequences short)
+#define EXAMPLE_WRITER_BATCH_MAX 512
+#define EXAMPLE_WRITER_COALESCE_LEN 1024
+
+// flags for example_restore; without EXAMPLE_RESTORE_READONLY the image is
+// copied into a resizeable in-memory database which can be written to.
+#define EXAMPLE_RESTORE_READONLY 0x01
+
+// the part of the database header example_restore looks at, up to and
+// including the application_id at offset 68
+#define EXAMPLE_RESTORE_HEADER_LEN 72
+
+// default number of pages per chunk handed to the snapshot compressor
+#define EXAMPLE_SNAPSHOT_CHUNK_PAGES 64
+
+// pragma application_id of a database created with config->deviceid_packed;
+// 0 is text deviceids. "XPKD"
+#define EXAMPLE_APPLICATION_ID_PACKED 0x58504b44
+
+// values per row of an example_hash table, i.e. columns besides the key
+#define EXAMPLE_HASH_VALUES_MAX 3
+#define EXAMPLE_HASH_SLOT_EMPTY 0
+#define EXAMPLE_HASH_SLOT_USED 1
+#define EXAMPLE_HASH_SLOT_TOMBSTONE 2
+// upper bound on the rows one example_hash_evict call deletes
+#define EXAMPLE_HASH_EVICT_MAX 256
+
+// returned by example_measured_upsert for a key state.measured can't hold
+#define EXAMPLE_MEASURED_BAD_KEY -2
+
+// rows example_measured_upsert evicts to make room when the state schema
+// has run out of memory, see example_measured_evict
+#define EXAMPLE_MEASURED_EVICT_ROWS 64
+
+// buckets of a struct example_histogram_s; bucket i counts latencies below
+// 2^i ns, so the last one is everything from 2^30 ns (~1s) up
+#define EXAMPLE_HISTOGRAM_BUCKETS 32
+
+// size classes of the thread caching allocator, see example_alloc_malloc:
+// powers of two from EXAMPLE_ALLOC_CLASS_MIN to EXAMPLE_ALLOC_CLASS_MAX bytes
+#define EXAMPLE_ALLOC_CLASS_MIN 32
+#define EXAMPLE_ALLOC_CLASS_MAX 8192
+#define EXAMPLE_ALLOC_CLASSES 9
+#define EXAMPLE_ALLOC_CACHE_LEN 64
+#define EXAMPLE_ALLOC_FLUSH_OPS 4096
+// keeps the blocks 16 byte aligned
+#define EXAMPLE_ALLOC_HEADER 16
+
+// upper bound on the number of worker threads of a struct example_async_s,
+// and the number of virtual machine instructions between calls to an async
+// request's progress callback (and checks for its cancellation)
+#define EXAMPLE_ASYNC_WORKERS_MAX 16
+#define EXAMPLE_ASYNC_PROGRESS_OPS 1000
+
+// upper bound on the number of result columns a struct example_row_s holds
+#define EXAMPLE_QUERY_COLUMNS_MAX 16
+
+
+// Statements which are prepared once in example_init and then reused for the
+// lifetime of the connection; see example_stmts for the sql text. Each one is
+// X(NAME, name), and has lists EXAMPLE_STMT_<NAME>_PARAMS(P) and
+// EXAMPLE_STMT_<NAME>_COLUMNS(C) of P(type, name) and C(type, name) for its
+// parameters and result columns, in the order of the statement. The types are
+// a character each:
+//   d  deviceid: bound from const char * name, uint32_t name_len (see
+//      example_bind_deviceid), read into a char[12]
+//   i  int32_t
+//   I  int64_t
+//   b  bool, read into a uint8_t
+//   n  nullable int32_t: bound from a const int32_t * (NULL for null), read
+//      into an int32_t * and a uint8_t * name_null which is set for a null
+//   N  nullable int64_t, the same with int64_t
+//   t  text: bound from a nul terminated const char * (SQLITE_STATIC), read
+//      into a const unsigned char *, valid until the next step
+// From these come example_stmt_<name>_bind, _step and _run, see
+// EXAMPLE_STMT_WRAPPERS, and the types example_init_stmts checks against what
+// sqlite makes of the sql, so a statement which no longer fits the schema
+// fails at startup rather than at its first use.
+#define EXAMPLE_STMTS(X) \
+    X(DEVICE_NEW, device_new) \
+    X(OUTPUT_NEW, output_new) \
+    X(GROUP_NEW, group_new) \
+    X(MEASURED_UPSERT, measured_upsert) \
+    X(MEASURED_UPSERT_CHANGED, measured_upsert_changed) \
+    X(CUSTOM_AGGREGATE_QUERY, custom_aggregate_query) \
+    X(CUSTOM_AGGREGATE_SHARD, custom_aggregate_shard) \
+    X(GROUPS_GROUPID_RANGE, groups_groupid_range) \
+    X(MEASURED_SCAN, measured_scan) \
+    X(MEASURED_EXPIRE, measured_expire) \
+    X(MEASURED_EVICT, measured_evict) \
+    X(MEASURED_COUNT, measured_count) \
+    X(DRIFT_LIST, drift_list) \
+    X(DRIFT_SEQ, drift_seq) \
+    X(DRIFT_POLL, drift_poll) \
+    X(DRIFT_TRIM, drift_trim) \
+    X(FOREIGN_KEY_CHECK_OUTPUTS, foreign_key_check_outputs) \
+    X(FOREIGN_KEY_CHECK_GROUPS, foreign_key_check_groups) \
+    X(BEGIN, begin) \
+    X(BEGIN_READ, begin_read) \
+    X(COMMIT, commit) \
+    X(ROLLBACK, rollback)
+
+#define EXAMPLE_STMT_DEVICE_NEW_PARAMS(P) P(d, deviceid)
+#define EXAMPLE_STMT_DEVICE_NEW_COLUMNS(C)
+#define EXAMPLE_STMT_OUTPUT_NEW_PARAMS(P) P(d, deviceid) P(i, outputid)
+#define EXAMPLE_STMT_OUTPUT_NEW_COLUMNS(C)
+#define EXAMPLE_STMT_GROUP_NEW_PARAMS(P) P(d, deviceid) P(i, outputid) P(i, groupid)
+#define EXAMPLE_STMT_GROUP_NEW_COLUMNS(C)
+#define EXAMPLE_STMT_MEASURED_UPSERT_PARAMS(P) \
+    P(d, deviceid) P(i, outputid) P(I, timestamp) P(b, state) P(n, level)
+#define EXAMPLE_STMT_MEASURED_UPSERT_COLUMNS(C)
+#define EXAMPLE_STMT_MEASURED_UPSERT_CHANGED_PARAMS(P) \
+    EXAMPLE_STMT_MEASURED_UPSERT_PARAMS(P) P(N, heartbeat)
+#define EXAMPLE_STMT_MEASURED_UPSERT_CHANGED_COLUMNS(C)
+#define EXAMPLE_STMT_CUSTOM_AGGREGATE_QUERY_PARAMS(P)
+#define EXAMPLE_STMT_CUSTOM_AGGREGATE_QUERY_COLUMNS(C) C(I, aggregate)
+#define EXAMPLE_STMT_CUSTOM_AGGREGATE_SHARD_PARAMS(P) P(I, groupid_lo) P(I, groupid_hi)
+#define EXAMPLE_STMT_CUSTOM_AGGREGATE_SHARD_COLUMNS(C) C(I, groupid) C(I, aggregate)
+#define EXAMPLE_STMT_GROUPS_GROUPID_RANGE_PARAMS(P)
+#define EXAMPLE_STMT_GROUPS_GROUPID_RANGE_COLUMNS(C) C(N, groupid_min) C(N, groupid_max)
+#define EXAMPLE_STMT_MEASURED_SCAN_PARAMS(P) P(d, deviceid) P(i, outputid) P(I, limit)
+#define EXAMPLE_STMT_MEASURED_SCAN_COLUMNS(C) \
+    C(d, deviceid) C(i, outputid) C(b, state) C(n, level) C(I, timestamp)
+#define EXAMPLE_STMT_MEASURED_EXPIRE_PARAMS(P) P(I, cutoff) P(I, limit)
+#define EXAMPLE_STMT_MEASURED_EXPIRE_COLUMNS(C)
+#define EXAMPLE_STMT_MEASURED_EVICT_PARAMS(P) P(I, limit)
+#define EXAMPLE_STMT_MEASURED_EVICT_COLUMNS(C)
+#define EXAMPLE_STMT_MEASURED_COUNT_PARAMS(P)
+#define EXAMPLE_STMT_MEASURED_COUNT_COLUMNS(C) C(I, rows)
+#define EXAMPLE_STMT_DRIFT_LIST_PARAMS(P)
+#define EXAMPLE_STMT_DRIFT_LIST_COLUMNS(C) C(d, deviceid) C(i, outputid)
+#define EXAMPLE_STMT_DRIFT_SEQ_PARAMS(P)
+#define EXAMPLE_STMT_DRIFT_SEQ_COLUMNS(C) C(I, seq)
+#define EXAMPLE_STMT_DRIFT_POLL_PARAMS(P) P(I, seq) P(I, limit)
+#define EXAMPLE_STMT_DRIFT_POLL_COLUMNS(C) C(I, seq) C(d, deviceid) C(i, outputid) C(b, drifted)
+#define EXAMPLE_STMT_DRIFT_TRIM_PARAMS(P) P(I, seq)
+#define EXAMPLE_STMT_DRIFT_TRIM_COLUMNS(C)
+#define EXAMPLE_STMT_FOREIGN_KEY_CHECK_OUTPUTS_PARAMS(P)
+#define EXAMPLE_STMT_FOREIGN_KEY_CHECK_OUTPUTS_COLUMNS(C) \
+    C(t, table) C(N, rowid) C(t, parent) C(i, fkid)
+#define EXAMPLE_STMT_FOREIGN_KEY_CHECK_GROUPS_PARAMS(P)
+#define EXAMPLE_STMT_FOREIGN_KEY_CHECK_GROUPS_COLUMNS(C) \
+    EXAMPLE_STMT_FOREIGN_KEY_CHECK_OUTPUTS_COLUMNS(C)
+#define EXAMPLE_STMT_BEGIN_PARAMS(P)
+#define EXAMPLE_STMT_BEGIN_COLUMNS(C)
+#define EXAMPLE_STMT_BEGIN_READ_PARAMS(P)
+#define EXAMPLE_STMT_BEGIN_READ_COLUMNS(C)
+#define EXAMPLE_STMT_COMMIT_PARAMS(P)
+#define EXAMPLE_STMT_COMMIT_COLUMNS(C)
+#define EXAMPLE_STMT_ROLLBACK_PARAMS(P)
+#define EXAMPLE_STMT_ROLLBACK_COLUMNS(C)
+
+#define EXAMPLE_STMT_ENUM(NAME, name) EXAMPLE_STMT_##NAME,
+
+enum example_stmt_e {
+    EXAMPLE_STMTS(EXAMPLE_STMT_ENUM)
+    EXAMPLE_STMT_MAX
+};
+
+
+// Options for example_init. There's no way to tell whether a pragma took
+// effect other than reading it back, so use example_settings_get to check what
+// the database actually ended up with.
+struct example_config_s {
+    // passed straight to sqlite3_open_v2
+    const char * path;
+    int open_flags;
+
+    // pragma journal_mode, e.g. "wal"; NULL leaves the default
+    const char * journal_mode;
+
+    // pragma synchronous, e.g. "normal"; NULL leaves the default
+    const char * synchronous;
+
+    // pragma mmap_size in bytes; sqlite silently caps this at the compile
+    // time SQLITE_MAX_MMAP_SIZE. -1 leaves the default.
+    int64_t mmap_size;
+
+    // pragma cache_size; positive values are pages, negative values are KiB.
+    // 0 leaves the default.
+    int64_t cache_size;
+
+    // pragma page_size; only has an effect before the database is first
+    // written to. 0 leaves the default.
+    int page_size;
+
+    // pragma auto_vacuum, e.g. "incremental"; like page_size only for a new
+    // database. With "incremental", free pages stay in the file until
+    // example_incremental_vacuum hands them back a few at a time, instead of
+    // needing a full, blocking vacuum. NULL leaves the default.
+    const char * auto_vacuum;
+
+    // SQLITE_FCNTL_CHUNK_SIZE: grow (and truncate) the database file in
+    // chunks of this many bytes instead of a page at a time, for fewer and
+    // larger extensions; best a multiple of page_size. 0 leaves the default.
+    int chunk_size;
+
+    // SQLITE_FCNTL_SIZE_HINT: extend the database file to this many bytes
+    // up front, e.g. the size it's expected to reach. 0 for no hint. Both of
+    // these are ignored by vfses which don't implement them, like memdb.
+    int64_t size_hint;
+
+    // milliseconds to wait on a locked database before giving up with
+    // SQLITE_BUSY; 0 disables the busy handler.
+    int busy_timeout_ms;
+
+    // what to attach as the state schema. An in-memory database is private to
+    // the connection that attached it, so to share the state between
+    // connections this should be a named memdb, i.e. "file:/name?vfs=memdb";
+    // that in turn needs SQLITE_OPEN_URI in open_flags.
+    const char * state_path;
+
+    // memory budget of the state schema. state_size_limit caps a memdb at
+    // this many bytes (SQLITE_FCNTL_SIZE_LIMIT); a write which would grow it
+    // beyond fails with SQLITE_FULL, and example_measured_upsert then evicts
+    // the least recently updated rows to make room. 0 leaves memdb's default
+    // of 1GiB. Above state_trim_size bytes of pages in use, the compactor
+    // evicts ahead of that, see example_measured_trim; 0 for none.
+    // measured_rows_max caps state.measured at that many rows, checked by
+    // example_measured_upsert; 0 for no cap. Pages freed by eviction are
+    // reused for new rows rather than handed back, so these bound the growth
+    // of the state schema rather than shrink it.
+    int64_t state_size_limit;
+    int64_t state_trim_size;
+    uint32_t measured_rows_max;
+
+    // read now_monotonic() and friends from CLOCK_MONOTONIC_COARSE instead of
+    // CLOCK_MONOTONIC. The coarse clock only ticks with the scheduler (1-4ms
+    // depending on CONFIG_HZ) but is cheaper to read; fine for timestamps
+    // which are only used for expiry and ordering.
+    bool coarse_clock;
+
+    // with skip_unchanged (see example_measured_upsert), still write the
+    // timestamp of an unchanged row once it is this many seconds old, so that
+    // a device which keeps reporting the same state isn't expired by
+    // example_measured_expire. Keep it well below the ttl. 0 never does.
+    uint32_t measured_heartbeat_s;
+
+    // keep state.measured and state.setpoint in example_hash tables of this
+    // many rows each instead of b-tree tables in the state database; see
+    // struct example_hash_s. 0 keeps the b-tree tables.
+    uint32_t state_hash_capacity;
+
+    // store deviceids as the 48 bit integer of their 12 lowercase hex digits
+    // instead of as text; the API still takes and hands out the 12 characters,
+    // see example_bind_deviceid. Only has an effect when the database is
+    // created, after that pragma application_id says which it is. Doesn't go
+    // together with state_hash_capacity.
+    bool deviceid_packed;
+
+    // lookaside for this connection (SQLITE_DBCONFIG_LOOKASIDE): slots of
+    // slot_size bytes for its small, short lived allocations. 0 slots leaves
+    // the default, see example_global_config_s.
+    int lookaside_slot_size;
+    int lookaside_slots;
+
+    // open the database through the "example" vfs on top of the default one,
+    // which counts the I/O (see example_stats_s.io) and, with readahead > 0,
+    // turns sequential reads of the main database into reads of readahead
+    // bytes. Pages within mmap_size are read through the mapping, not read
+    // calls, so readahead only pays off for (the rest of) a database larger
+    // than that. A vfs= in a URI path wins over this. The vfs is registered
+    // once per process; the readahead of the first example_init sticks.
+    bool vfs;
+    int readahead;
+
+    // time every statement from SQLITE_TRACE_STMT to SQLITE_TRACE_PROFILE
+    // into the histograms of example_stats_get
+    bool instrument;
+
+    // open as a reader: skip schema migration and the creation of the state
+    // tables, and don't touch pragmas that need to write to the database.
+    // Used by example_pool_init for the reader connections.
+    bool readonly;
+};
+
+
+// The settings the database actually runs with, see example_settings_get.
+struct example_settings_s {
+    char journal_mode[16];
+    int synchronous;
+    int64_t mmap_size;
+    int64_t cache_size;
+    int page_size;
+    int foreign_keys;
+    int auto_vacuum;
+};
+
+
+// Statement latencies in power of two buckets, see EXAMPLE_HISTOGRAM_BUCKETS.
+struct example_histogram_s {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[EXAMPLE_HISTOGRAM_BUCKETS];
+};
+
+
+// What example_stats_get reports for one statement; the counters are
+// sqlite3_stmt_status, so they are per statement since it was prepared (or
+// last reset) and they don't include statements run by triggers.
+struct example_stmt_stats_s {
+    struct example_histogram_s latency;
+    int fullscan_steps;
+    int sorts;
+    int autoindexes;
+    int vm_steps;
+    int reprepares;
+    int runs;
+    int memused;
+};
+
+
+// I/O counters of the "example" vfs, by kind of file; see struct
+// example_io_stats_s.
+enum example_io_kind_e {
+    EXAMPLE_IO_MAIN_DB,
+    EXAMPLE_IO_WAL,
+    EXAMPLE_IO_JOURNAL,
+    EXAMPLE_IO_OTHER,
+    EXAMPLE_IO_MAX
+};
+
+
+// The schemas of a connection, for example_stats_s.dbs.
+enum example_db_e {
+    EXAMPLE_DB_MAIN,
+    EXAMPLE_DB_STATE,
+    EXAMPLE_DB_MAX
+};
+
+
+// What a schema takes: bytes is its pages, on disk or, for memdb, in memory,
+// free_bytes is the part of that on the freelist, and size_limit the
+// SQLITE_FCNTL_SIZE_LIMIT of a memdb (0 for other vfses). With
+// config->state_hash_capacity, the state bytes are the hash tables.
+struct example_db_stats_s {
+    int64_t bytes;
+    int64_t free_bytes;
+    int64_t size_limit;
+};
+
 
-// just want to have an upper bound on the sqlite3_step for loop to avoid
-// infinite loops; set this to a value which is absolutely going to be higher
-// then any realistic max number of results on a select query
-#define EXAMPLE_MAX_QUERY_LOOP_STEPS 1048576
+struct example_io_stats_s {
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t readahead_hits;
+    uint64_t writes;
+    uint64_t bytes_written;
+    uint64_t syncs;
+};
+
+
+// A snapshot of the instrumentation of a connection, see example_stats_get.
+// stmts is indexed by enum example_stmt_e; the last entry has the latencies
+// of all statements which aren't cached ones, e.g. example_query_open_sql.
+// The cache counters are sqlite3_db_status, over all attached databases.
+struct example_stats_s {
+    struct example_stmt_stats_s stmts[EXAMPLE_STMT_MAX + 1];
+    int cache_hit;
+    int cache_miss;
+    int cache_write;
+    int cache_spill;
+    int cache_used;
+    int lookaside_used;
+    int schema_used;
+    int stmt_used;
+
+    // sqlite3_db_status lookaside counters of the connection
+    int lookaside_hit;
+    int lookaside_miss_size;
+    int lookaside_miss_full;
+
+    // process wide: sqlite3_status, and the thread caching allocator; see
+    // example_global_config_s
+    int64_t memory_used;
+    int64_t pagecache_used;
+    int64_t pagecache_overflow;
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+
+    // process wide, by enum example_io_kind_e: I/O through the "example"
+    // vfs, see example_config_s.vfs. readahead_hits are reads served from the
+    // buffer, bytes_read is what actually got read from the files.
+    struct example_io_stats_s io[EXAMPLE_IO_MAX];
+
+    // by enum example_db_e, and the memory budget: the rows in state.measured,
+    // and the process wide sqlite3_soft_heap_limit64 and
+    // sqlite3_hard_heap_limit64 (0 for none) to compare memory_used with
+    struct example_db_stats_s dbs[EXAMPLE_DB_MAX];
+    int64_t measured_rows;
+    int64_t soft_heap_limit;
+    int64_t hard_heap_limit;
+};
 
 
 struct example_s {
     int sentinel;
     sqlite3 * db;
+    sqlite3_stmt * stmts[EXAMPLE_STMT_MAX];
+
+    // clock for the time functions, and the reading now_monotonic_stable()
+    // hands out for the statement currently running; see example_trace.
+    clockid_t clock_id;
+    bool clock_stable_valid;
+    uint64_t clock_stable;
+
+    // config->measured_heartbeat_s as a timestamp difference, 0 for none
+    uint64_t measured_heartbeat;
+    int64_t state_trim_size;
+    uint32_t measured_rows_max;
+
+    // set while example_measured_evict and example_measured_expire delete,
+    // which keeps the drift triggers quiet, see example_evicting
+    bool evicting;
+
+    // where the next example_measured_expire continues its sweep of
+    // state_measured
+    uint32_t measured_expire_cursor;
+
+    // snapshot file mapped by example_restore_file; unmapped after the
+    // database is closed
+    void * restore_map;
+    size_t restore_map_len;
+
+    // version of the online migration step whose sql has already run on this
+    // connection, see example_schema_migrate
+    int migration_online_started;
+
+    // deviceids are stored packed, see config->deviceid_packed
+    bool deviceid_packed;
+
+    // filled in by example_trace with config->instrument; the last entry is
+    // for statements which aren't in stmts. latency_start is the
+    // CLOCK_MONOTONIC reading in ns when each one started running.
+    bool instrument;
+    struct example_histogram_s latency[EXAMPLE_STMT_MAX + 1];
+    uint64_t latency_start[EXAMPLE_STMT_MAX + 1];
+
+    // with config->state_hash_capacity, the tables behind state.measured and
+    // state.setpoint; NULL otherwise
+    struct example_hash_s * state_measured;
+    struct example_hash_s * state_setpoint;
 };
 
+// Running state of example_agg_f; lives in sqlite3_aggregate_context and
+// never leaves the aggregate, which returns the aggregate as an integer.
 struct example_agg_f_s {
     int sentinel;
-    int aggregate;
+    int64_t aggregate;
 };
 
 
+// A row of an example_hash table: the (deviceid, outputid) key inline and up
+// to EXAMPLE_HASH_VALUES_MAX integer columns after it, 48 bytes in all.
+struct example_hash_slot_s {
+    uint8_t used;
+    // bit i set: values[i] is null
+    uint8_t nulls;
+    char deviceid[12];
+    int32_t outputid;
+    int64_t values[EXAMPLE_HASH_VALUES_MAX];
+};
 
-// Basic database schema for the persistent database
-static const char example_schema_full[] =
-    "begin;"
+// Column layout of an example_hash table; columns are deviceid, outputid and
+// then one per value.
+struct example_hash_table_s {
+    const char * name;
+    const char * schema;
+    int values_len;
+    // bit i set: values[i] may be null
+    uint8_t nullable;
+    // bit i set: values[i] defaults to now_monotonic() on insert
+    uint8_t now_default;
+};
+
+// An open-addressing hash table with linear probing, keyed by
+// (deviceid, outputid), for the hot key/value tables of the state database.
+// The capacity is fixed when the table is created; the slot array is twice
+// that, rounded up to a power of two, so probes stay short. Slots never move,
+// so the slot index doubles as the rowid. Deleted rows leave a tombstone
+// which the next insert that probes past it reuses.
+//
+// Every connection with the same state database attaches the same table: they
+// are looked up by database file name and table name in a process wide
+// registry and reference counted, the way named memdb databases are.
+//
+// Writes through the virtual table are visible to other connections right
+// away, there's no isolation; but each connection keeps an undo log of its
+// own writes, so a statement that fails and a rollback (to a savepoint) put
+// back the rows it changed as they were before, even if another connection
+// has written them since. The C functions below don't go through sqlite and
+// aren't undone. The virtual table sees an omitted column as null, so the
+// now_monotonic() default of state.measured.timestamp is applied to a null
+// timestamp on insert; the check constraints are the not null, length and
+// range checks on the key and the value columns.
+struct example_hash_s {
+    struct example_hash_s * next;
+    char name[256];
+    int refs;
+    const struct example_hash_table_s * table;
+
+    pthread_rwlock_t lock;
+    uint32_t capacity;
+    uint32_t mask;
+    uint32_t used;
+    uint32_t tombstones;
+    struct example_hash_slot_s * slots;
+};
+
+
+// One writer connection and up to EXAMPLE_POOL_READERS_MAX read-only
+// connections on the same database. For the readers to see the same data as
+// the writer, both the main database and the state schema have to be
+// something every connection can open: a file, or a named memdb (see
+// example_config_default). A private ':memory:' or SQLITE_OPEN_MEMORY
+// database will not work.
+//
+// The readers are opened with SQLITE_OPEN_NOMUTEX, so a checked out reader
+// must only be used by one thread at a time; the pool hands each reader to one
+// thread until it is checked back in.
+struct example_pool_s {
+    int sentinel;
+
+    struct example_s writer;
+    pthread_mutex_t writer_lock;
+
+    struct example_s readers[EXAMPLE_POOL_READERS_MAX];
+    bool readers_busy[EXAMPLE_POOL_READERS_MAX];
+    uint32_t readers_len;
+    pthread_mutex_t readers_lock;
+    pthread_cond_t readers_cond;
+};
+
+
+// A fixed-size measurement record for the write pipeline; deviceid is not
+// nul-terminated. A timestamp of 0 is replaced by a clock reading taken once
+// per batch by the writer thread.
+struct example_measurement_s {
+    char deviceid[12];
+    int32_t outputid;
+    int32_t level;
+    bool level_null;
+    bool state;
+    uint64_t timestamp;
+};
+
+
+// state.measured as a structure of arrays, filled by
+// example_measured_fetch_columns. The caller points the arrays at cap entries
+// each (level_null may be NULL, level is then 0 for null levels) and zeroes
+// the rest; deviceid is not nul-terminated. last_* is where the next batch
+// picks up.
+struct example_measured_columns_s {
+    size_t cap;
+    size_t len;
+    char (*deviceid)[12];
+    int32_t * outputid;
+    uint8_t * state;
+    int32_t * level;
+    uint8_t * level_null;
+    uint64_t * timestamp;
+
+    char last_deviceid[12];
+    int last_deviceid_len;
+    int32_t last_outputid;
+    // with the example_hash tables, the next slot to look at instead
+    uint64_t next_slot;
+};
+
+
+// A compressor for example_snapshot. compress compresses src into dst, which
+// has room for at least bound(src_len) bytes, and sets dst_len to the number
+// of bytes used; returns -1 on error.
+struct example_compressor_s {
+    const char * name;
+    size_t (*bound)(size_t src_len);
+    int (*compress)(void * user_data, const uint8_t * src, size_t src_len,
+            uint8_t * dst, size_t dst_cap, size_t * dst_len);
+    void * user_data;
+};
+
+
+// With a compressor, each chunk is given to the sink as one frame: this
+// header (little endian) followed by out_len bytes of compressed data.
+// Without a compressor the sink just gets the database image, chunk by chunk.
+struct example_snapshot_frame_s {
+    uint32_t raw_len;
+    uint32_t out_len;
+};
+
+
+struct example_snapshot_s {
+    // NULL writes the pages as they are
+    const struct example_compressor_s * compressor;
+
+    // called with every chunk of output, in order; returns -1 to abort
+    int (*sink)(void * user_data, const uint8_t * buf, size_t len);
+    void * user_data;
+
+    // pages per chunk, 0 for EXAMPLE_SNAPSHOT_CHUNK_PAGES
+    uint32_t chunk_pages;
+
+    // set by example_snapshot: size of the database image, and the number of
+    // bytes given to the sink
+    uint64_t raw_len;
+    uint64_t out_len;
+};
+
+
+// Handoff between the thread reading pages and the thread compressing
+// them; two slots, so the next chunk is read while the previous one is
+// being compressed.
+struct example_snapshot_stage_s {
+    struct example_snapshot_s * snapshot;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t * chunk[2];
+    size_t chunk_len[2];
+    bool full[2];
+    bool done;
+    bool failed;
+    uint8_t * out;
+    size_t out_cap;
+};
+
+
+// Incremental replication of the persistent tables: a sqlite3_session
+// records every change to devices, outputs and groups on the connection, and
+// example_session_poll hands the accumulated changes to the sink as a
+// changeset (or a patchset, which leaves out the old values and can't detect
+// as many conflicts on the replica) whenever it grows past size_threshold
+// bytes or interval has passed since the last one.
+struct example_session_s {
+    int sentinel;
+    struct example_s * example;
+    sqlite3_session * session;
 
-    "create table devices ("
-        "deviceid text not null check (length(deviceid)==12),"
-        "primary key (deviceid)"
+    bool patchset;
+    int64_t size_threshold;
+    // in the example_monotonic_now format, i.e. seconds << 32
+    uint64_t interval;
+    uint64_t last_flush;
+
+    int (*sink)(void * user_data, const void * changeset, int changeset_len);
+    void * user_data;
+};
+
+
+// What example_changeset_apply did with each kind of conflict.
+struct example_changeset_apply_s {
+    uint32_t replaced;
+    uint32_t omitted;
+    uint32_t aborted;
+};
+
+
+// One result column. text and blob point into sqlite's own buffers, see
+// struct example_row_s.
+struct example_column_s {
+    int type;
+    int64_t value_int;
+    double value_double;
+    const void * data;
+    int data_len;
+};
+
+// The current row of a struct example_query_s. Nothing is copied: text and
+// blob columns point straight at sqlite's buffers, so they're only valid until
+// the next example_query_next or example_query_close. example_query_fetch
+// copies them into a caller buffer instead.
+struct example_row_s {
+    int columns_len;
+    struct example_column_s columns[EXAMPLE_QUERY_COLUMNS_MAX];
+};
+
+// Cursor over the results of a statement, either one of the cached
+// statements in example->stmts (which is reset and left prepared on close) or
+// one prepared by example_query_open_sql (which is finalized on close).
+// Parameters are bound on query->stmt between open and the first next.
+struct example_query_s {
+    int sentinel;
+    struct example_s * example;
+    sqlite3_stmt * stmt;
+    bool cached;
+    bool done;
+
+    // example_query_fetch stepped onto a row it had no room for; the next
+    // call hands it out first.
+    bool pending;
+
+    uint64_t rows;
+    struct example_row_s row;
+};
+
+
+// A query for struct example_async_s to run; see example_async_submit. The
+// request and everything it points to belong to the caller, and have to stay
+// put until it has completed.
+struct example_async_req_s {
+    // a cached statement, or sql when that's not NULL
+    enum example_stmt_e id;
+    const char * sql;
+
+    // run on the pool's writer instead of a reader
+    bool write;
+
+    // bound to the statement's parameters in order, see example_query_bind
+    const struct example_column_s * params;
+    int params_len;
+
+    // called on the worker thread: row for each result row (0 to keep going,
+    // 1 to stop, -1 to fail), progress every EXAMPLE_ASYNC_PROGRESS_OPS
+    // instructions with the total so far (nonzero cancels), and done once the
+    // request has completed. Any of them may be NULL; without done the
+    // request is completed through the eventfd, see example_async_reap.
+    int (*row)(void * user_data, const struct example_row_s * row);
+    int (*progress)(void * user_data, uint64_t ops);
+    void (*done)(void * user_data, struct example_async_req_s * req);
+    void * user_data;
+
+    // results, valid once completed: ret is 0 or -1, and cancelled tells
+    // whether the -1 was example_async_cancel (or progress)
+    int ret;
+    bool cancelled;
+    uint64_t rows;
+
+    // used by struct example_async_s; example is the connection running the
+    // request, guarded by the async lock
+    struct example_async_req_s * next;
+    struct example_s * example;
+    atomic_bool cancel;
+    uint64_t progress_ops;
+};
+
+
+// Worker threads running queries on a pool's connections, for callers that
+// can't block on sqlite3_step, e.g. an epoll loop: example_async_submit
+// queues a request without blocking, and completion comes either as a
+// callback on the worker thread or through an eventfd. The queue is bounded;
+// submit fails instead of waiting when it's full.
+struct example_async_s {
+    int sentinel;
+    struct example_pool_s * pool;
+    pthread_t workers[EXAMPLE_ASYNC_WORKERS_MAX];
+    uint32_t workers_len;
+    uint32_t workers_started;
+    int eventfd;
+
+    // everything below is guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    struct example_async_req_s * queue_head;
+    struct example_async_req_s * queue_tail;
+    uint32_t queue_len;
+    uint32_t queue_cap;
+    struct example_async_req_s * done_head;
+    struct example_async_req_s * done_tail;
+    struct example_async_req_s * current[EXAMPLE_ASYNC_WORKERS_MAX];
+};
+
+
+struct example_writer_cell_s {
+    _Atomic uint64_t seq;
+    struct example_measurement_s measurement;
+};
+
+
+// Write pipeline for state.measured: producers on any thread push
+// measurements into a bounded lock-free ring (a Vyukov-style multi-producer
+// queue with a sequence number per cell), and a single writer thread drains
+// it, coalesces updates to the same (deviceid, outputid), and applies each
+// batch in one transaction on the pool's writer connection.
+//
+// Pushing never blocks; if the writer falls behind and the ring fills up the
+// measurement is dropped and counted in dropped.
+struct example_writer_s {
+    int sentinel;
+    struct example_pool_s * pool;
+    pthread_t thread;
+    atomic_bool running;
+    uint32_t poll_interval_us;
+    bool skip_unchanged;
+
+    // producers and the consumer on separate cache lines
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) uint64_t tail;
+
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t applied;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t failed;
+
+    struct example_writer_cell_s ring[EXAMPLE_WRITER_RING_LEN];
+
+    // writer thread scratch space
+    struct example_measurement_s batch[EXAMPLE_WRITER_BATCH_MAX];
+    uint32_t batch_len;
+    uint16_t coalesce[EXAMPLE_WRITER_COALESCE_LEN];
+};
+
+
+// Background expiry of state.measured: every interval_us, a thread deletes
+// the rows not written to for ttl_s seconds with example_measured_expire,
+// and then evicts what's over the memory budget with example_measured_trim,
+// batch_rows at a time on the pool's writer connection. The writer is
+// checked in between batches, so other writes (e.g. struct example_writer_s)
+// only ever wait for one batch. Before that, each sweep carries on with an
+// online schema migration left pending by example_init_schema_migration,
+// batch_rows rows per chunk.
+struct example_compactor_s {
+    int sentinel;
+    struct example_pool_s * pool;
+    pthread_t thread;
+    atomic_bool running;
+    uint32_t ttl_s;
+    uint32_t interval_us;
+    uint32_t batch_rows;
+
+    _Atomic uint64_t sweeps;
+    _Atomic uint64_t expired;
+    _Atomic uint64_t evicted;
+    _Atomic uint64_t failed;
+};
+
+
+// Rows for the batch insert functions. The deviceid is bound with
+// SQLITE_STATIC, so it only has to live for the duration of the call.
+struct example_device_s {
+    const char * deviceid;
+    uint32_t deviceid_len;
+};
+
+struct example_output_s {
+    const char * deviceid;
+    uint32_t deviceid_len;
+    int outputid;
+};
+
+struct example_group_s {
+    const char * deviceid;
+    uint32_t deviceid_len;
+    int outputid;
+    int groupid;
+};
+
+
+// A row rejected by one of the batch insert functions; errcode is the
+// extended sqlite3 error code, e.g. SQLITE_CONSTRAINT_CHECK for a deviceid
+// which is not 12 characters long, or SQLITE_CONSTRAINT_FOREIGNKEY. With
+// packed deviceids such a deviceid doesn't get as far as sqlite, it's
+// SQLITE_MISMATCH from example_bind_deviceid.
+struct example_batch_reject_s {
+    uint32_t row;
+    int errcode;
+};
+
+
+// A foreign key violation found after a load with fk_deferred, as reported
+// by pragma foreign_key_check. The tables are without rowid, so rowid is -1
+// and the violation can only be pinned down to the table and foreign key;
+// loading the rows again without fk_deferred reports them one by one.
+struct example_fk_violation_s {
+    char table[32];
+    char parent[32];
+    int64_t rowid;
+    int fkid;
+};
+
+
+struct example_batch_s {
+    // number of rows per transaction; 0 puts all rows in a single transaction
+    uint32_t batch_size;
+
+    // turn off foreign key enforcement for the load and instead check the
+    // table as a whole, once per transaction, right before commit; a batch
+    // with violations is rolled back like one with rejected rows. Saves the
+    // parent key lookup on each row, but the check is over the whole table,
+    // so this only pays off with large batches (e.g. batch_size 0).
+    bool fk_deferred;
+
+    // caller-provided storage for violations with fk_deferred; violations_len
+    // is the total number, which may be larger than violations_cap.
+    struct example_fk_violation_s * violations;
+    uint32_t violations_cap;
+    uint32_t violations_len;
+
+    // caller-provided storage for rejected rows
+    struct example_batch_reject_s * rejects;
+    uint32_t rejects_cap;
+
+    // set by the batch insert functions: the total number of rejected rows
+    // (which may be larger than rejects_cap), and the number of rows, counted
+    // from the start of the input, which have been committed.
+    uint32_t rejects_len;
+    uint32_t committed;
+};
+
+
+
+// Basic database schema for the persistent database; that's version 1. The
+// migration steps below don't do their own transaction or user_version, see
+// example_schema_migrate. deviceid is declared as text or, with packed
+// deviceids, as int; the check goes on the devices table, everywhere else it's
+// implied by the foreign key.
+#define EXAMPLE_SCHEMA_FULL(deviceid_type, deviceid_check) \
+    "create table devices (" \
+        "deviceid " deviceid_type " not null check (" deviceid_check ")," \
+        "primary key (deviceid)" \
+    ") without rowid;" \
+    \
+    "create table outputs (" \
+        "deviceid " deviceid_type " not null," \
+        "outputid int not null check (0 <= outputid)," \
+        "foreign key (deviceid) references devices(deviceid)," \
+        "primary key (deviceid, outputid)" \
+    ") without rowid;" \
+    \
+    "create table groups (" \
+        "deviceid " deviceid_type " not null," \
+        "outputid int not null," \
+        "groupid int not null," \
+        "foreign key (deviceid, outputid) references outputs(deviceid, outputid)," \
+        "primary key (deviceid, outputid, groupid)" \
     ") without rowid;"
 
-    // not adding the length constraint here since it's implied by the foreign key
-    "create table outputs ("
-        "deviceid text not null,"
-        "outputid int not null check (0 <= outputid),"
-        "foreign key (deviceid) references devices(deviceid),"
+#define EXAMPLE_DEVICEID_TEXT "text", "length(deviceid)==12"
+#define EXAMPLE_DEVICEID_PACKED "int", "deviceid between 0 and 0xffffffffffff"
+
+// the extra level of expansion splits EXAMPLE_DEVICEID_* into the arguments
+#define EXAMPLE_SCHEMA_EXPAND(macro, ...) macro(__VA_ARGS__)
+#define EXAMPLE_SCHEMA_STRINGIFY_(x) #x
+#define EXAMPLE_SCHEMA_STRINGIFY(x) EXAMPLE_SCHEMA_STRINGIFY_(x)
+
+static const char example_schema_full[] =
+    EXAMPLE_SCHEMA_EXPAND(EXAMPLE_SCHEMA_FULL, EXAMPLE_DEVICEID_TEXT);
+
+static const char example_schema_full_packed[] =
+    EXAMPLE_SCHEMA_EXPAND(EXAMPLE_SCHEMA_FULL, EXAMPLE_DEVICEID_PACKED)
+    "pragma application_id = " EXAMPLE_SCHEMA_STRINGIFY(EXAMPLE_APPLICATION_ID_PACKED) ";";
+
+
+// version 1 -> 2: covering index for grouping and looking up by groupid.
+// groups is without rowid with primary key (deviceid, outputid, groupid), so
+// "group by groupid" needed a temp b-tree sort and "which outputs are in group
+// G" was a full scan. On a without rowid table every index carries the
+// primary key columns anyway, so this covers both.
+//
+// create index on a big groups would hold the write lock for the whole build,
+// so this is an online step: groups_v2 gets the index up front and the rows
+// through example_schema_migration_2_chunk, a slice of the primary key per
+// chunk; groups_v2_cursor has the last key copied. Until then the triggers
+// mirror writes to groups. The last chunk swaps the tables, see there.
+#define EXAMPLE_SCHEMA_MIGRATION_2(deviceid_type, deviceid_check) \
+    "create table if not exists groups_v2 (" \
+        "deviceid " deviceid_type " not null," \
+        "outputid int not null," \
+        "groupid int not null," \
+        "foreign key (deviceid, outputid) references outputs(deviceid, outputid)," \
+        "primary key (deviceid, outputid, groupid)" \
+    ") without rowid;" \
+    \
+    "create index if not exists groups_groupid on groups_v2(groupid, deviceid, outputid);" \
+    \
+    "create table if not exists groups_v2_cursor (" \
+        "deviceid " deviceid_type " not null," \
+        "outputid int not null," \
+        "groupid int not null" \
+    ");" \
+    \
+    "create trigger if not exists groups_v2_insert after insert on groups begin " \
+        "insert or ignore into groups_v2 (deviceid, outputid, groupid) " \
+            "values (new.deviceid, new.outputid, new.groupid);" \
+    "end;" \
+    \
+    "create trigger if not exists groups_v2_delete after delete on groups begin " \
+        "delete from groups_v2 " \
+            "where deviceid = old.deviceid and outputid = old.outputid and groupid = old.groupid;" \
+    "end;" \
+    \
+    "create trigger if not exists groups_v2_update after update on groups begin " \
+        "delete from groups_v2 " \
+            "where deviceid = old.deviceid and outputid = old.outputid and groupid = old.groupid;" \
+        "insert or ignore into groups_v2 (deviceid, outputid, groupid) " \
+            "values (new.deviceid, new.outputid, new.groupid);" \
+    "end;"
+
+static const char example_schema_migration_2[] =
+    EXAMPLE_SCHEMA_EXPAND(EXAMPLE_SCHEMA_MIGRATION_2, EXAMPLE_DEVICEID_TEXT);
+
+static const char example_schema_migration_2_packed[] =
+    EXAMPLE_SCHEMA_EXPAND(EXAMPLE_SCHEMA_MIGRATION_2, EXAMPLE_DEVICEID_PACKED);
+
+// the swap at the end of migration 2; groups_v2 already has groups_groupid,
+// alter table takes it along.
+static const char example_schema_migration_2_done[] =
+    "drop trigger groups_v2_insert;"
+    "drop trigger groups_v2_delete;"
+    "drop trigger groups_v2_update;"
+    "drop table groups;"
+    "alter table groups_v2 rename to groups;"
+    "drop table groups_v2_cursor;";
+
+
+// The drift set: outputs with both a setpoint and a measurement, where the
+// measured state or level isn't the setpoint. state.drift is the current set;
+// every change to it is appended to state.drift_feed, drifted = 1 for a pair
+// which just diverged and 0 for one which was just reconciled. Consumers keep
+// the last seq they've seen, see example_drift_poll. autoincrement, so that
+// seq keeps counting up after example_drift_trim has emptied the feed.
+//
+// Maintained by triggers on state.measured and state.setpoint, which virtual
+// tables don't have; with config->state_hash_capacity the tables are there
+// but stay empty.
+//
+// deviceid has no type, so it keeps whatever the state tables hold: text, or
+// the integer of packed deviceids.
+static const char example_memory_schema_drift[] =
+    "create table if not exists state.drift ("
+        "deviceid not null,"
+        "outputid int not null,"
         "primary key (deviceid, outputid)"
     ") without rowid;"
-    
-    "create table groups ("
-        "deviceid text not null,"
+
+    "create table if not exists state.drift_feed ("
+        "seq integer primary key autoincrement,"
+        "deviceid not null,"
         "outputid int not null,"
-        "groupid int not null,"
-        "foreign key (deviceid, outputid) references outputs(deviceid, outputid),"
-        "primary key (deviceid, outputid, groupid)"
+        "drifted bool not null"
+    ");";
+
+// Trigger body which brings state.drift and state.drift_feed up to date for
+// the key of row, "new" or "old". Tables in a trigger body are unqualified and
+// resolve to the state database the trigger lives in. No "or ignore" on the
+// insert: the conflict clause of the statement firing the trigger (e.g. the
+// upsert) overrides the one in the trigger.
+#define EXAMPLE_DRIFT_DRIFTED(row) \
+    "exists (select 1 from measured m join setpoint s using (deviceid, outputid) " \
+        "where m.deviceid = " row ".deviceid and m.outputid = " row ".outputid " \
+        "and (m.state is not s.setstate or m.level is not s.setlevel))"
+#define EXAMPLE_DRIFT_LISTED(row) \
+    "exists (select 1 from drift where deviceid = " row ".deviceid and outputid = " row ".outputid)"
+#define EXAMPLE_DRIFT_UPDATE(row) \
+    "insert into drift_feed(deviceid, outputid, drifted) " \
+        "select " row ".deviceid, " row ".outputid, 1 " \
+        "where " EXAMPLE_DRIFT_DRIFTED(row) " and not " EXAMPLE_DRIFT_LISTED(row) ";" \
+    "insert into drift_feed(deviceid, outputid, drifted) " \
+        "select " row ".deviceid, " row ".outputid, 0 " \
+        "where not " EXAMPLE_DRIFT_DRIFTED(row) " and " EXAMPLE_DRIFT_LISTED(row) ";" \
+    "insert into drift(deviceid, outputid) " \
+        "select " row ".deviceid, " row ".outputid " \
+        "where " EXAMPLE_DRIFT_DRIFTED(row) " and not " EXAMPLE_DRIFT_LISTED(row) ";" \
+    "delete from drift where deviceid = " row ".deviceid and outputid = " row ".outputid " \
+        "and not " EXAMPLE_DRIFT_DRIFTED(row) ";"
+
+
+// Layouts of the state tables for the example_hash module, same columns as
+// example_memory_schema below.
+static const struct example_hash_table_s example_hash_tables[] = {
+    {
+        .name = "measured",
+        .schema = "create table x(deviceid text not null, outputid int not null, "
+            "timestamp int not null, state bool not null, level int)",
+        .values_len = 3,
+        .nullable = 1 << 2,
+        .now_default = 1 << 0
+    },
+    {
+        .name = "setpoint",
+        .schema = "create table x(deviceid text not null, outputid int not null, "
+            "setstate bool not null, setlevel int)",
+        .values_len = 2,
+        .nullable = 1 << 1,
+        .now_default = 0
+    },
+};
+
+// values[] of state.measured in an example_hash table
+#define EXAMPLE_MEASURED_TIMESTAMP 0
+#define EXAMPLE_MEASURED_STATE 1
+#define EXAMPLE_MEASURED_LEVEL 2
+
+
+// example_memory_schema with config->state_hash_capacity; the argument is the
+// capacity.
+static const char example_memory_schema_hash[] =
+    "create virtual table if not exists state.measured using example_hash(%u);"
+    "create virtual table if not exists state.setpoint using example_hash(%u);";
+
+
+// The state tables; deviceid as in EXAMPLE_SCHEMA_FULL. drawback: it's not
+// possible to add cross-database foreign keys - so it's not possible to add a
+// foreign key to the persistent database.
+#define EXAMPLE_MEMORY_TABLES(deviceid_type, deviceid_check) \
+    "create table if not exists state.measured (" \
+        "deviceid " deviceid_type " not null check (" deviceid_check ")," \
+        "outputid int not null check (0 <= outputid)," \
+        "timestamp int not null default (now_monotonic())," \
+        "state bool not null," \
+        "level int," \
+        "primary key (deviceid, outputid)" \
+    ") without rowid;" \
+    \
+    /* for example_measured_expire, so a sweep only visits expired rows */ \
+    "create index if not exists state.measured_timestamp on measured (timestamp);" \
+    \
+    /* the rows in state.measured, kept by the triggers below, so that */ \
+    /* example_measured_rows doesn't have to count them */ \
+    "create table if not exists state.measured_rows (rows int not null);" \
+    "insert into state.measured_rows(rows) select count(*) from state.measured " \
+        "where not exists (select 1 from state.measured_rows);" \
+    \
+    "create table if not exists state.setpoint (" \
+        "deviceid " deviceid_type " not null check (" deviceid_check ")," \
+        "outputid int not null check (0 <= outputid)," \
+        "setstate bool not null," \
+        "setlevel int," \
+        "primary key (deviceid, outputid)" \
     ") without rowid;"
 
-    "pragma user_version = 1;"
+// keep state.drift up to date on every write to either table; updates that
+// only touch the timestamp don't need to. Rows example_measured_evict and
+// example_measured_expire delete leave state.drift as it is: losing the
+// measurement to make room or to age isn't the output coming back to its
+// setpoint, and writing that to state.drift_feed would grow the state schema
+// while evicting to shrink it. The next measurement of the output sorts it
+// out. state.measured_rows counts every
+// insert and delete; "insert or replace" doesn't fire delete triggers (with
+// recursive_triggers off), so nothing writes state.measured that way.
+#define EXAMPLE_MEMORY_TRIGGERS \
+    "create trigger if not exists state.measured_drift_insert after insert on measured begin " \
+        EXAMPLE_DRIFT_UPDATE("new") \
+    "end;" \
+    "create trigger if not exists state.measured_drift_update after update of deviceid, outputid, state, level on measured begin " \
+        EXAMPLE_DRIFT_UPDATE("old") \
+        EXAMPLE_DRIFT_UPDATE("new") \
+    "end;" \
+    "create trigger if not exists state.measured_drift_delete after delete on measured " \
+        "when not example_evicting() begin " \
+        EXAMPLE_DRIFT_UPDATE("old") \
+    "end;" \
+    "create trigger if not exists state.measured_rows_insert after insert on measured begin " \
+        "update measured_rows set rows = rows + 1;" \
+    "end;" \
+    "create trigger if not exists state.measured_rows_delete after delete on measured begin " \
+        "update measured_rows set rows = rows - 1;" \
+    "end;" \
+    "create trigger if not exists state.setpoint_drift_insert after insert on setpoint begin " \
+        EXAMPLE_DRIFT_UPDATE("new") \
+    "end;" \
+    "create trigger if not exists state.setpoint_drift_update after update on setpoint begin " \
+        EXAMPLE_DRIFT_UPDATE("old") \
+        EXAMPLE_DRIFT_UPDATE("new") \
+    "end;" \
+    "create trigger if not exists state.setpoint_drift_delete after delete on setpoint begin " \
+        EXAMPLE_DRIFT_UPDATE("old") \
+    "end;"
 
+static const char example_memory_schema[] =
+    "begin;"
+    EXAMPLE_SCHEMA_EXPAND(EXAMPLE_MEMORY_TABLES, EXAMPLE_DEVICEID_TEXT)
+    EXAMPLE_MEMORY_TRIGGERS
     "commit;";
 
-
-static const char example_memory_schema[] =
+static const char example_memory_schema_packed[] =
     "begin;"
+    EXAMPLE_SCHEMA_EXPAND(EXAMPLE_MEMORY_TABLES, EXAMPLE_DEVICEID_PACKED)
+    EXAMPLE_MEMORY_TRIGGERS
+    "commit;";
 
-    // drawback: it's not possible to add cross-database foreign keys - so it's
-    // not possible to add a foreign key to the persistent database.
-    "create table state.measured ("
-        "deviceid text not null check (length(deviceid)==12),"
-        "outputid int not null check (0 <= outputid),"
-        "timestamp int not null default (now_monotonic()),"
-        "state bool not null,"
-        "level int,"
-        "primary key (deviceid, outputid)"
-    ") without rowid;"
 
-    "create table state.setpoint ("
-        "deviceid text not null check (length(deviceid)==12),"
-        "outputid int not null check (0 <= outputid),"
-        "setstate bool not null,"
-        "setlevel int,"
-        "primary key (deviceid, outputid)"
-    ") without rowid;"
+// The default config keeps everything in memory, as named memdb databases so
+// that the connections in a struct example_pool_s can share them. An
+// in-memory database never touches the disk, and journal_mode will read back
+// as "memory" no matter what is asked for here; point path at a file to get
+// wal.
+static const struct example_config_s example_config_default = {
+    .path = "file:/db.sqlite?vfs=memdb",
+    .open_flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI,
+    .journal_mode = "wal",
+    .synchronous = "normal",
+    .mmap_size = 64 * 1024 * 1024,
+    .cache_size = -8 * 1024,
+    .page_size = 4096,
+    .auto_vacuum = "incremental",
+    .chunk_size = 0,
+    .size_hint = 0,
+    .busy_timeout_ms = 5000,
+    .state_path = "file:/state?vfs=memdb",
+    .state_size_limit = 0,
+    .state_trim_size = 0,
+    .measured_rows_max = 0,
+    .coarse_clock = false,
+    .measured_heartbeat_s = 0,
+    .state_hash_capacity = 0,
+    .deviceid_packed = false,
+    .lookaside_slot_size = 0,
+    .lookaside_slots = 0,
+    .vfs = false,
+    .readahead = 0,
+    .instrument = false,
+    .readonly = false
+};
 
-    "commit;";
 
+// A cached statement: its sql, with the length taken from the literal at
+// compile time, and the types of its parameters and result columns from the
+// lists of NAME (see EXAMPLE_STMTS), e.g. "di" for a deviceid and an int.
+struct example_stmt_desc_s {
+    const char * sql;
+    int sql_len;
+    const char * params;
+    const char * columns;
+};
 
+#define EXAMPLE_STMT_TYPE(type, name) #type
 
+#define EXAMPLE_STMT_DESC(NAME, sql_) { \
+        .sql = sql_, \
+        .sql_len = sizeof(sql_) - 1, \
+        .params = "" EXAMPLE_STMT_##NAME##_PARAMS(EXAMPLE_STMT_TYPE), \
+        .columns = "" EXAMPLE_STMT_##NAME##_COLUMNS(EXAMPLE_STMT_TYPE) \
+    }
 
-// custom aggregate function example
-void example_agg_f_step (
-    sqlite3_context * ctx,
-    int argc,
-    sqlite3_value ** argv
+
+static const struct example_stmt_desc_s example_stmts[EXAMPLE_STMT_MAX] = {
+    [EXAMPLE_STMT_DEVICE_NEW] = EXAMPLE_STMT_DESC(DEVICE_NEW,
+        "insert into devices(deviceid) values (?);"),
+    [EXAMPLE_STMT_OUTPUT_NEW] = EXAMPLE_STMT_DESC(OUTPUT_NEW,
+        "insert into outputs(deviceid, outputid) values (?, ?);"),
+    [EXAMPLE_STMT_GROUP_NEW] = EXAMPLE_STMT_DESC(GROUP_NEW,
+        "insert into groups(deviceid, outputid, groupid) values (?, ?, ?);"),
+    [EXAMPLE_STMT_MEASURED_UPSERT] = EXAMPLE_STMT_DESC(MEASURED_UPSERT,
+        "insert into state.measured(deviceid, outputid, timestamp, state, level) values (?, ?, ?, ?, ?) "
+        "on conflict(deviceid, outputid) do update set "
+            "timestamp=excluded.timestamp, state=excluded.state, level=excluded.level;"),
+    // same as above, but leaves the row alone (no b-tree write) if neither
+    // state nor level changed, unless the timestamp is older than the
+    // heartbeat in ?6 (null for none)
+    [EXAMPLE_STMT_MEASURED_UPSERT_CHANGED] = EXAMPLE_STMT_DESC(MEASURED_UPSERT_CHANGED,
+        "insert into state.measured(deviceid, outputid, timestamp, state, level) values (?, ?, ?, ?, ?) "
+        "on conflict(deviceid, outputid) do update set "
+            "timestamp=excluded.timestamp, state=excluded.state, level=excluded.level "
+        "where state is not excluded.state or level is not excluded.level "
+            "or excluded.timestamp - timestamp >= ?6;"),
+    [EXAMPLE_STMT_CUSTOM_AGGREGATE_QUERY] = EXAMPLE_STMT_DESC(CUSTOM_AGGREGATE_QUERY,
+        "select example_agg_f(deviceid, outputid, groupid) from groups group by groups.groupid"),
+    // one shard of example_custom_aggregate_query_parallel, and its range
+    [EXAMPLE_STMT_CUSTOM_AGGREGATE_SHARD] = EXAMPLE_STMT_DESC(CUSTOM_AGGREGATE_SHARD,
+        "select groupid, example_agg_f(deviceid, outputid, groupid) from groups "
+        "where groupid between ? and ? group by groupid;"),
+    [EXAMPLE_STMT_GROUPS_GROUPID_RANGE] = EXAMPLE_STMT_DESC(GROUPS_GROUPID_RANGE,
+        "select min(groupid), max(groupid) from groups;"),
+    // keyset pagination over the primary key, see example_measured_fetch_columns
+    [EXAMPLE_STMT_MEASURED_SCAN] = EXAMPLE_STMT_DESC(MEASURED_SCAN,
+        "select deviceid, outputid, state, level, timestamp from state.measured "
+        "where (deviceid, outputid) > (?, ?) order by deviceid, outputid limit ?;"),
+    // one batch of example_measured_expire: the oldest rows before a cutoff,
+    // through the timestamp index
+    [EXAMPLE_STMT_MEASURED_EXPIRE] = EXAMPLE_STMT_DESC(MEASURED_EXPIRE,
+        "delete from state.measured where (deviceid, outputid) in ("
+            "select deviceid, outputid from state.measured where timestamp < ? order by timestamp limit ?"
+        ");"),
+    // example_measured_evict, the same without the cutoff
+    [EXAMPLE_STMT_MEASURED_EVICT] = EXAMPLE_STMT_DESC(MEASURED_EVICT,
+        "delete from state.measured where (deviceid, outputid) in ("
+            "select deviceid, outputid from state.measured order by timestamp limit ?"
+        ");"),
+    [EXAMPLE_STMT_MEASURED_COUNT] = EXAMPLE_STMT_DESC(MEASURED_COUNT,
+        "select rows from state.measured_rows;"),
+    [EXAMPLE_STMT_DRIFT_LIST] = EXAMPLE_STMT_DESC(DRIFT_LIST,
+        "select deviceid, outputid from state.drift;"),
+    [EXAMPLE_STMT_DRIFT_SEQ] = EXAMPLE_STMT_DESC(DRIFT_SEQ,
+        "select coalesce(max(seq), 0) from state.drift_feed;"),
+    [EXAMPLE_STMT_DRIFT_POLL] = EXAMPLE_STMT_DESC(DRIFT_POLL,
+        "select seq, deviceid, outputid, drifted from state.drift_feed where seq > ? order by seq limit ?;"),
+    [EXAMPLE_STMT_DRIFT_TRIM] = EXAMPLE_STMT_DESC(DRIFT_TRIM,
+        "delete from state.drift_feed where seq <= ?;"),
+    // for example_batch_s.fk_deferred; the rowid is null for a without
+    // rowid table
+    [EXAMPLE_STMT_FOREIGN_KEY_CHECK_OUTPUTS] = EXAMPLE_STMT_DESC(FOREIGN_KEY_CHECK_OUTPUTS,
+        "pragma foreign_key_check(outputs);"),
+    [EXAMPLE_STMT_FOREIGN_KEY_CHECK_GROUPS] = EXAMPLE_STMT_DESC(FOREIGN_KEY_CHECK_GROUPS,
+        "pragma foreign_key_check(groups);"),
+    [EXAMPLE_STMT_BEGIN] = EXAMPLE_STMT_DESC(BEGIN,
+        "begin immediate;"),
+    [EXAMPLE_STMT_BEGIN_READ] = EXAMPLE_STMT_DESC(BEGIN_READ,
+        "begin deferred;"),
+    [EXAMPLE_STMT_COMMIT] = EXAMPLE_STMT_DESC(COMMIT,
+        "commit;"),
+    [EXAMPLE_STMT_ROLLBACK] = EXAMPLE_STMT_DESC(ROLLBACK,
+        "rollback;"),
+};
+
+
+
+
+// Replacements for example_stmts with config->state_hash_capacity; virtual
+// tables don't do upsert, but they do "insert or replace". example_measured_upsert
+// doesn't use these, it goes to the hash table directly.
+static const struct example_stmt_desc_s example_stmts_hash[EXAMPLE_STMT_MAX] = {
+    [EXAMPLE_STMT_MEASURED_UPSERT] = EXAMPLE_STMT_DESC(MEASURED_UPSERT,
+        "insert or replace into state.measured(deviceid, outputid, timestamp, state, level) values (?, ?, ?, ?, ?);"),
+    // without the heartbeat, so the types of EXAMPLE_STMT_MEASURED_UPSERT;
+    // example_stmt_measured_upsert_changed_bind doesn't fit it
+    [EXAMPLE_STMT_MEASURED_UPSERT_CHANGED] = EXAMPLE_STMT_DESC(MEASURED_UPSERT,
+        "insert or replace into state.measured(deviceid, outputid, timestamp, state, level) values (?, ?, ?, ?, ?);"),
+    // there's no state.measured_rows; example_measured_rows asks the hash
+    // table
+    [EXAMPLE_STMT_MEASURED_COUNT] = EXAMPLE_STMT_DESC(MEASURED_COUNT,
+        "select count(*) from state.measured;"),
+};
+
+
+
+
+// Logging. EXAMPLE_LOG(priority, fmt, ...) is syslog with the call site in
+// front of the message, and anything less important than EXAMPLE_LOG_LEVEL
+// compiled out: without DEBUG, EXAMPLE_LOG(LOG_DEBUG, ...) costs nothing, not
+// even evaluating its arguments.
+//
+// Until example_log_start is called, messages go straight to syslog. After
+// it, each thread formats its messages into a ring of its own, and a logger
+// thread hands them to syslog, so a slow syslog socket doesn't hold up the
+// threads doing the work. A full ring drops the message (counted, and
+// reported by the logger thread). Either way, a call site which logs more than
+// EXAMPLE_LOG_BURST messages within a second has the rest suppressed; how
+// many is logged along with the next message from there.
+#ifndef EXAMPLE_LOG_LEVEL
+#ifdef DEBUG
+#define EXAMPLE_LOG_LEVEL LOG_DEBUG
+#else
+#define EXAMPLE_LOG_LEVEL LOG_INFO
+#endif
+#endif
+
+#define EXAMPLE_LOG(priority, ...) \
+    do { \
+        if ((priority) <= EXAMPLE_LOG_LEVEL) { \
+            example_log_write((priority), __FILE__, __LINE__, __func__, __VA_ARGS__); \
+        } \
+    } while (0)
+
+// messages per thread ring (a power of two), and the length a message is
+// truncated to
+#define EXAMPLE_LOG_RING_LEN 128
+#define EXAMPLE_LOG_MSG_LEN 480
+
+// rate limit per call site: EXAMPLE_LOG_BURST messages per second, tracked
+// in a direct mapped table of EXAMPLE_LOG_SITES_LEN sites per thread
+#define EXAMPLE_LOG_BURST 10
+#define EXAMPLE_LOG_SITES_LEN 64
+
+
+struct example_log_entry_s {
+    int priority;
+    int line;
+    const char * file;
+    const char * func;
+    char msg[EXAMPLE_LOG_MSG_LEN];
+};
+
+
+// single producer (the thread it belongs to), single consumer (the logger
+// thread) ring. dead is set when the thread exits; the logger thread frees the
+// ring once it has been drained.
+struct example_log_ring_s {
+    struct example_log_ring_s * next;
+    atomic_bool dead;
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+    struct example_log_entry_s entries[EXAMPLE_LOG_RING_LEN];
+};
+
+
+struct example_log_site_s {
+    const char * file;
+    int line;
+    uint32_t count;
+    uint32_t suppressed;
+    time_t window;
+};
+
+
+struct example_log_s {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    pthread_t thread;
+    atomic_bool started;
+    atomic_bool running;
+    uint32_t poll_interval_us;
+    struct example_log_ring_s * rings;
+    _Atomic uint64_t dropped;
+};
+
+
+static struct example_log_s example_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static _Thread_local struct example_log_ring_s * example_log_ring = NULL;
+static _Thread_local bool example_log_ring_detached = false;
+static _Thread_local struct example_log_site_s example_log_sites[EXAMPLE_LOG_SITES_LEN];
+
+
+// pthread key destructor, runs when a thread with a ring exits. The logger
+// thread may free the ring as soon as it's marked dead, so the thread lets go
+// of it first; whatever it logs from here on (in other destructors, say) goes
+// straight to syslog.
+void example_log_ring_exit (
+    void * arg
+)
+{
+    struct example_log_ring_s * ring = arg;
+    example_log_ring = NULL;
+    example_log_ring_detached = true;
+    atomic_store_explicit(&ring->dead, true, memory_order_release);
+}
+
+
+void example_log_key_create (
+    void
 )
 {
     int ret = 0;
 
-    if (argc != 3) {
-        syslog(LOG_ERR, "%s:%d:%s: example_agg_f_step takes 3 arguments, but given %d",
-                __FILE__, __LINE__, __func__, argc);
-        sqlite3_result_error(ctx, "wrong number of arguments", strlen("wrong number of arguments"));
-        return;
+    ret = pthread_key_create(&example_log.key, example_log_ring_exit);
+    if (0 != ret) {
+        syslog(LOG_ERR, "%s:%d:%s: pthread_key_create returned %d", __FILE__, __LINE__, __func__, ret);
     }
-
-    // fetch the values from the database
-    const int nodeid = sqlite3_value_int(argv[0]);
-    const int outputid = sqlite3_value_int(argv[1]);
-    const int groupid = sqlite3_value_int(argv[2]);
+}
 
 
-    // fetch the result struct
-    struct example_agg_f_s * agg_f = sqlite3_aggregate_context(ctx, sizeof(struct example_agg_f_s));
+// The calling thread's ring, registered with the logger on first use; NULL
+// if it can't be allocated or the thread is exiting, in which case the caller
+// logs synchronously.
+struct example_log_ring_s * example_log_ring_get (
+    void
+)
+{
 
-    // if the sentinel isn't set, then we called it the first time; use this to
-    // set initial values on the aggregate.
-    if (0 == agg_f->sentinel) {
-        agg_f->aggregate = 80;
-        agg_f->sentinel = EXAMPLE_AGG_F_SENTINEL;
+    if (NULL != example_log_ring || example_log_ring_detached) {
+        return example_log_ring;
     }
 
-    // if sentinel is other than EXAMPLE_AGG_F_SENTINEL, then something bad happened.
-    if (EXAMPLE_AGG_F_SENTINEL != agg_f->sentinel) {
-        syslog(LOG_ERR, "%s:%d:%s: aggregate structure sentinel is wrong! memory corrupt?", __FILE__, __LINE__, __func__);
-        sqlite3_result_error(ctx, "sentinel value is wrong", strlen("sentinel value is wrong"));
-        return;
+    // calloc only aligns to max_align_t, not the 64 of head and tail
+    const size_t size = (sizeof(struct example_log_ring_s) + 63) & ~(size_t)63;
+    struct example_log_ring_s * ring = aligned_alloc(64, size);
+    if (NULL == ring) {
+        return NULL;
     }
+    memset(ring, 0, size);
+    atomic_init(&ring->dead, false);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
 
+    pthread_once(&example_log.once, example_log_key_create);
+    pthread_setspecific(example_log.key, ring);
 
-    // aggregate logic
-    agg_f->aggregate += groupid;
-    return;
+    pthread_mutex_lock(&example_log.lock);
+    ring->next = example_log.rings;
+    example_log.rings = ring;
+    pthread_mutex_unlock(&example_log.lock);
 
+    example_log_ring = ring;
+    return ring;
 }
 
 
-void example_agg_f_final (
-    sqlite3_context * ctx
+// Rate limit per call site. Returns false if the message should be
+// suppressed; *suppressed is set to the number of messages suppressed in the
+// previous window for the caller to report, if any.
+bool example_log_site_allow (
+    const char * file,
+    const int line,
+    uint32_t * suppressed
 )
 {
-    struct example_agg_f_s * agg = sqlite3_aggregate_context(ctx, sizeof(struct example_agg_f_s));
-    sqlite3_result_blob(ctx, agg, sizeof(struct example_agg_f_s), SQLITE_TRANSIENT);
-    return;
+
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    const uintptr_t hash = ((uintptr_t)file >> 4) ^ ((uintptr_t)line * 0x9e3779b1u);
+    struct example_log_site_s * site = &example_log_sites[hash & (EXAMPLE_LOG_SITES_LEN - 1)];
+
+    if (site->file != file || site->line != line || site->window != now.tv_sec) {
+        *suppressed = site->file == file && site->line == line ? site->suppressed : 0;
+        site->file = file;
+        site->line = line;
+        site->window = now.tv_sec;
+        site->count = 0;
+        site->suppressed = 0;
+    }
+
+    if (EXAMPLE_LOG_BURST <= site->count) {
+        site->suppressed++;
+        return false;
+    }
+
+    site->count++;
+    return true;
 }
 
 
-// custom ordinary function
-void example_now_monotonic (
-    sqlite3_context * ctx,
-    int argc,
-    sqlite3_value ** argv
+void example_log_entry_write (
+    const struct example_log_entry_s * entry
 )
 {
+    syslog(entry->priority, "%s:%d:%s: %s", entry->file, entry->line, entry->func, entry->msg);
+}
 
-    int ret = 0;
 
-    struct timespec tp = {0};
+void example_log_push (
+    const int priority,
+    const char * file,
+    const int line,
+    const char * func,
+    const char * fmt,
+    va_list ap
+)
+{
 
-    ret = clock_gettime(CLOCK_MONOTONIC, &tp);
-    if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: clock_gettime: %s", __FILE__, __LINE__, __func__, strerror(errno));
-        sqlite3_result_error(ctx, "clock_gettime returned -1", strlen("clock_gettime returned -1"));
-        return;
+    struct example_log_entry_s local = {0};
+    struct example_log_entry_s * entry = &local;
+    struct example_log_ring_s * ring = NULL;
+    uint32_t head = 0;
+
+    if (atomic_load_explicit(&example_log.started, memory_order_acquire)) {
+        ring = example_log_ring_get();
     }
 
-    // This value contains 16 bits of second precision (rolls over every 65535
-    // seconds), and 16 bits of sub-second precision (more then millisecond
-    // precision, less then microsecond).
-    uint64_t time = (tp.tv_sec & 0xffffffff);
-    time <<= 32;
-    time |= (tp.tv_nsec & 0xffffffff);
+    // format in place; only a full ring or no logger thread needs the copy on
+    // the stack
+    if (NULL != ring) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (EXAMPLE_LOG_RING_LEN == head - tail) {
+            atomic_fetch_add_explicit(&example_log.dropped, 1, memory_order_relaxed);
+            return;
+        }
+        entry = &ring->entries[head & (EXAMPLE_LOG_RING_LEN - 1)];
+    }
 
-    sqlite3_result_int64(
-        /* context = */ ctx,
-        /* int = */ time
-    );
+    entry->priority = priority;
+    entry->file = file;
+    entry->line = line;
+    entry->func = func;
+    vsnprintf(entry->msg, sizeof(entry->msg), fmt, ap);
 
-    return;
-    (void)argc;
-    (void)argv;
+    if (NULL == ring) {
+        example_log_entry_write(entry);
+        return;
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
 
+void example_log_pushf (
+    const int priority,
+    const char * file,
+    const int line,
+    const char * func,
+    const char * fmt,
+    ...
+)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    example_log_push(priority, file, line, func, fmt, ap);
+    va_end(ap);
+}
 
 
-int example_init_schema_migration_full (
-    struct example_s * example
+// Called by EXAMPLE_LOG; don't call directly.
+__attribute__((format(printf, 5, 6)))
+void example_log_write (
+    const int priority,
+    const char * file,
+    const int line,
+    const char * func,
+    const char * fmt,
+    ...
 )
 {
 
-    int ret = 0;
-    char * err = NULL;
+    uint32_t suppressed = 0;
+    const bool allow = example_log_site_allow(file, line, &suppressed);
 
-    ret = sqlite3_exec(
-        /* db = */ example->db,
-        /* sql = */ example_schema_full,
-        /* cb = */ NULL,
-        /* user_data = */ NULL,
-        /* err = */ &err
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_exec returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, err);
-        return -1;
+    if (0 < suppressed) {
+        example_log_pushf(priority, file, line, func, "%u more messages from here suppressed", suppressed);
     }
 
+    if (!allow) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    example_log_push(priority, file, line, func, fmt, ap);
+    va_end(ap);
+}
+
+
+// Hand everything in the rings to syslog, and free the rings of threads which
+// have exited.
+void example_log_drain (
+    void
+)
+{
+
+    pthread_mutex_lock(&example_log.lock);
+
+    struct example_log_ring_s ** link = &example_log.rings;
+    while (NULL != *link) {
+        struct example_log_ring_s * ring = *link;
+
+        // read dead first: the thread may log once more before it exits
+        const bool dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            example_log_entry_write(&ring->entries[tail & (EXAMPLE_LOG_RING_LEN - 1)]);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (dead) {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+
+    pthread_mutex_unlock(&example_log.lock);
+
+    const uint64_t dropped = atomic_exchange_explicit(&example_log.dropped, 0, memory_order_relaxed);
+    if (0 < dropped) {
+        syslog(LOG_WARNING, "%s:%d:%s: dropped %llu log messages, rings were full",
+                __FILE__, __LINE__, __func__, (unsigned long long)dropped);
+    }
+}
+
+
+void * example_log_thread (
+    void * arg
+)
+{
+
+    const struct timespec poll_interval = {
+        .tv_sec = example_log.poll_interval_us / 1000000,
+        .tv_nsec = (example_log.poll_interval_us % 1000000) * 1000
+    };
+
+    while (atomic_load_explicit(&example_log.running, memory_order_acquire)) {
+        example_log_drain();
+        nanosleep(&poll_interval, NULL);
+    }
+
+    return NULL;
+    (void)arg;
+}
+
+
+// Start the logger thread; from here on EXAMPLE_LOG doesn't block on syslog.
+// Messages reach syslog up to poll_interval_us late.
+int example_log_start (
+    const uint32_t poll_interval_us
+)
+{
+
+    int ret = 0;
+
+    if (atomic_load_explicit(&example_log.started, memory_order_acquire)) {
+        syslog(LOG_ERR, "%s:%d:%s: logger is already running", __FILE__, __LINE__, __func__);
+        return -1;
+    }
+
+    example_log.poll_interval_us = poll_interval_us;
+    atomic_store_explicit(&example_log.running, true, memory_order_release);
+
+    ret = pthread_create(&example_log.thread, NULL, example_log_thread, NULL);
+    if (0 != ret) {
+        syslog(LOG_ERR, "%s:%d:%s: pthread_create returned %d", __FILE__, __LINE__, __func__, ret);
+        return -1;
+    }
+
+    atomic_store_explicit(&example_log.started, true, memory_order_release);
+
+    return 0;
+}
+
+
+// Stop the logger thread and flush what's left in the rings; afterwards
+// EXAMPLE_LOG goes straight to syslog again. Nothing may log concurrently with
+// this call. It can be passed to atexit, so messages logged on the way out of
+// the process aren't lost.
+void example_log_stop (
+    void
+)
+{
+
+    if (!atomic_load_explicit(&example_log.started, memory_order_acquire)) {
+        return;
+    }
+
+    atomic_store_explicit(&example_log.started, false, memory_order_release);
+    atomic_store_explicit(&example_log.running, false, memory_order_release);
+    pthread_join(example_log.thread, NULL);
+
+    example_log_drain();
+}
+
+
+
+
+// custom aggregate function example
+void example_agg_f_step (
+    sqlite3_context * ctx,
+    int argc,
+    sqlite3_value ** argv
+)
+{
+    int ret = 0;
+
+    if (argc != 3) {
+        EXAMPLE_LOG(LOG_ERR, "example_agg_f_step takes 3 arguments, but given %d",
+                argc);
+        sqlite3_result_error(ctx, "wrong number of arguments", strlen("wrong number of arguments"));
+        return;
+    }
+
+    // fetch the values from the database
+    const int nodeid = sqlite3_value_int(argv[0]);
+    const int outputid = sqlite3_value_int(argv[1]);
+    const int groupid = sqlite3_value_int(argv[2]);
+
+
+    // fetch the result struct
+    struct example_agg_f_s * agg_f = sqlite3_aggregate_context(ctx, sizeof(struct example_agg_f_s));
+
+    // if the sentinel isn't set, then we called it the first time; use this to
+    // set initial values on the aggregate.
+    if (0 == agg_f->sentinel) {
+        agg_f->aggregate = 80;
+        agg_f->sentinel = EXAMPLE_AGG_F_SENTINEL;
+    }
+
+    // if sentinel is other than EXAMPLE_AGG_F_SENTINEL, then something bad happened.
+    if (EXAMPLE_AGG_F_SENTINEL != agg_f->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "aggregate structure sentinel is wrong! memory corrupt?");
+        sqlite3_result_error(ctx, "sentinel value is wrong", strlen("sentinel value is wrong"));
+        return;
+    }
+
+
+    // aggregate logic
+    agg_f->aggregate += groupid;
+    return;
+
+}
+
+
+// Undo example_agg_f_step for a row that leaves the window frame, so that
+// sliding windows cost O(1) per row instead of recomputing every frame.
+void example_agg_f_inverse (
+    sqlite3_context * ctx,
+    int argc,
+    sqlite3_value ** argv
+)
+{
+
+    if (argc != 3) {
+        sqlite3_result_error(ctx, "wrong number of arguments", strlen("wrong number of arguments"));
+        return;
+    }
+
+    const int groupid = sqlite3_value_int(argv[2]);
+
+    // xInverse is only ever called after xStep, so the context exists
+    struct example_agg_f_s * agg_f = sqlite3_aggregate_context(ctx, 0);
+    if (NULL == agg_f || EXAMPLE_AGG_F_SENTINEL != agg_f->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "aggregate structure sentinel is wrong! memory corrupt?");
+        sqlite3_result_error(ctx, "sentinel value is wrong", strlen("sentinel value is wrong"));
+        return;
+    }
+
+    agg_f->aggregate -= groupid;
+    return;
+}
+
+
+// Current value of the aggregate; used both for the window function's
+// xValue, and as xFinal. Asking for a context of size 0 doesn't allocate, and
+// returns NULL if xStep was never called, i.e. for an empty set of rows.
+void example_agg_f_value (
+    sqlite3_context * ctx
+)
+{
+    const struct example_agg_f_s * agg = sqlite3_aggregate_context(ctx, 0);
+
+    if (NULL == agg || 0 == agg->sentinel) {
+        sqlite3_result_int64(ctx, 80);
+        return;
+    }
+
+    if (EXAMPLE_AGG_F_SENTINEL != agg->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "aggregate structure sentinel is wrong! memory corrupt?");
+        sqlite3_result_error(ctx, "sentinel value is wrong", strlen("sentinel value is wrong"));
+        return;
+    }
+
+    sqlite3_result_int64(ctx, agg->aggregate);
+    return;
+}
+
+
+void example_agg_f_final (
+    sqlite3_context * ctx
+)
+{
+    example_agg_f_value(ctx);
+    return;
+}
+
+
+// Combine two partial states of the same group over disjoint sets of rows
+// into a; both start out at 80, so that's counted once.
+void example_agg_f_merge (
+    struct example_agg_f_s * a,
+    const struct example_agg_f_s * b
+)
+{
+    a->aggregate += b->aggregate - 80;
+}
+
+
+// The monotonic clock in the format stored in state.measured.timestamp; shared
+// by the time functions and the C code that supplies timestamps itself.
+//
+// The format is stable and may be relied on: the upper 32 bits hold whole
+// seconds since the clock's epoch (for the monotonic clocks that's boot), the
+// lower 32 bits hold nanoseconds. Since nanoseconds never exceed 999999999 <
+// 2^30, packed values compare, and therefore sort, the same way the times they
+// represent do; a duration of n seconds is just n << 32. sqlite stores the
+// value as a signed 64-bit integer, which stays positive for 2^31 seconds
+// (68 years) of uptime.
+int example_monotonic_now (
+    const clockid_t clock_id,
+    uint64_t * now
+)
+{
+
+    int ret = 0;
+
+    struct timespec tp = {0};
+
+    // both CLOCK_MONOTONIC and CLOCK_MONOTONIC_COARSE are served from the
+    // vDSO, so there's no syscall here.
+    ret = clock_gettime(clock_id, &tp);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "clock_gettime: %s", strerror(errno));
+        return -1;
+    }
+
+    uint64_t time = (tp.tv_sec & 0xffffffff);
+    time <<= 32;
+    time |= (tp.tv_nsec & 0xffffffff);
+
+    *now = time;
+
+    return 0;
+}
+
+
+// custom ordinary function; now_monotonic() reads the clock every time it's
+// called, so every row of a statement gets its own reading.
+void example_now_monotonic (
+    sqlite3_context * ctx,
+    int argc,
+    sqlite3_value ** argv
+)
+{
+
+    int ret = 0;
+    uint64_t time = 0;
+    const struct example_s * example = sqlite3_user_data(ctx);
+
+    ret = example_monotonic_now(example->clock_id, &time);
+    if (-1 == ret) {
+        sqlite3_result_error(ctx, "clock_gettime returned -1", strlen("clock_gettime returned -1"));
+        return;
+    }
+
+    sqlite3_result_int64(
+        /* context = */ ctx,
+        /* int = */ time
+    );
+
+    return;
+    (void)argc;
+    (void)argv;
+}
+
+
+// now_monotonic_stable() reads the clock once per statement and returns that
+// same reading for every row, like current_timestamp does; use it to give a
+// multi-row insert or update one timestamp. The reading is dropped by
+// example_trace when the next statement starts.
+void example_now_monotonic_stable (
+    sqlite3_context * ctx,
+    int argc,
+    sqlite3_value ** argv
+)
+{
+
+    int ret = 0;
+    struct example_s * example = sqlite3_user_data(ctx);
+
+    if (!example->clock_stable_valid) {
+        ret = example_monotonic_now(example->clock_id, &example->clock_stable);
+        if (-1 == ret) {
+            sqlite3_result_error(ctx, "clock_gettime returned -1", strlen("clock_gettime returned -1"));
+            return;
+        }
+        example->clock_stable_valid = true;
+    }
+
+    sqlite3_result_int64(
+        /* context = */ ctx,
+        /* int = */ example->clock_stable
+    );
+
+    return;
+    (void)argc;
+    (void)argv;
+}
+
+
+// example_evicting() is 1 while example_measured_evict or
+// example_measured_expire is deleting rows on this connection, for the drift
+// triggers to skip those; see
+// EXAMPLE_MEMORY_TRIGGERS.
+void example_evicting (
+    sqlite3_context * ctx,
+    int argc,
+    sqlite3_value ** argv
+)
+{
+
+    const struct example_s * example = sqlite3_user_data(ctx);
+
+    sqlite3_result_int(
+        /* context = */ ctx,
+        /* int = */ example->evicting
+    );
+
+    return;
+    (void)argc;
+    (void)argv;
+}
+
+
+// trace callback, see sqlite3_trace_v2
+int example_trace (
+    unsigned int type,
+    void * user_data,
+    void * p,
+    void * x
+)
+{
+
+    struct example_s * example = user_data;
+    struct timespec now = {0};
+    int id = 0;
+
+    // a new statement starts running; for SQLITE_TRACE_STMT x is the sql
+    // text, or a "-- ..." comment when a trigger fires, which is still part of
+    // the same statement.
+    if (SQLITE_TRACE_STMT == type) {
+        const char * sql = x;
+        if ('-' == sql[0] && '-' == sql[1]) {
+            return 0;
+        }
+        example->clock_stable_valid = false;
+        if (!example->instrument) {
+            return 0;
+        }
+    }
+
+    // A linear scan over the cached statements is cheaper than anything
+    // sqlite would do to look them up for us.
+    while (id < EXAMPLE_STMT_MAX && example->stmts[id] != p) {
+        id++;
+    }
+
+    // The time a statement ran for is measured here rather than taken from
+    // SQLITE_TRACE_PROFILE, whose x comes from the vfs xCurrentTimeInt64 and
+    // with the unix vfs only has millisecond resolution, so the fast
+    // statements would all land in bucket 0. Statements which aren't cached
+    // share one start time, so interleaving two of those mixes them up.
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    const uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    if (SQLITE_TRACE_STMT == type) {
+        example->latency_start[id] = now_ns;
+    }
+
+    // a statement is done; p is the statement
+    if (SQLITE_TRACE_PROFILE == type) {
+        const uint64_t ns = now_ns - example->latency_start[id];
+
+        struct example_histogram_s * histogram = &example->latency[id];
+        int bucket = 0;
+        while (bucket < EXAMPLE_HISTOGRAM_BUCKETS - 1 && (UINT64_C(1) << bucket) <= ns) {
+            bucket++;
+        }
+        histogram->buckets[bucket]++;
+        histogram->count++;
+        histogram->sum_ns += ns;
+        if (histogram->max_ns < ns) {
+            histogram->max_ns = ns;
+        }
+    }
+
+    return 0;
+}
+
+
+
+
+// Run a pragma query and read the first column of its first row; if
+// value_text is not NULL the column is copied into it as text, otherwise it
+// is read as an integer into value_int.
+int example_pragma_get (
+    struct example_s * example,
+    const char * const pragma,
+    int64_t * value_int,
+    char * value_text,
+    const size_t value_text_len
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = NULL;
+    char sql[64];
+
+    const int sql_len = snprintf(sql, sizeof(sql), "pragma %s;", pragma);
+    if (sql_len < 0 || (int)sizeof(sql) <= sql_len) {
+        EXAMPLE_LOG(LOG_ERR, "pragma %s is too long", pragma);
+        return -1;
+    }
+
+    ret = sqlite3_prepare_v3(
+        /* db = */ example->db,
+        /* sql = */ sql,
+        /* sql_len = */ sql_len,
+        /* flags = */ 0,
+        /* &stmt = */ &stmt,
+        /* &sql_end = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v3 returned %d on \"%s\": %s",
+            ret, sql, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    ret = sqlite3_step(stmt);
+    if (SQLITE_DONE == ret) {
+        // pragmas which don't apply to this database return no rows at all,
+        // e.g. mmap_size on an in-memory database; report those as 0.
+        if (NULL != value_text && 0 < value_text_len) {
+            value_text[0] = '\0';
+        } else {
+            *value_int = 0;
+        }
+    }
+    else if (SQLITE_ROW != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d on \"%s\": %s",
+                ret, sql, sqlite3_errmsg(example->db));
+        sqlite3_finalize(stmt);
+        return -1;
+    }
+    else if (NULL != value_text) {
+        const unsigned char * text = sqlite3_column_text(stmt, 0);
+        snprintf(value_text, value_text_len, "%s", NULL == text ? "" : (const char *)text);
+    } else {
+        *value_int = sqlite3_column_int64(stmt, 0);
+    }
+
+    ret = sqlite3_finalize(stmt);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_finalize returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Prepare sql for example_schema_migration_2_chunk.
+int example_schema_migration_2_prepare (
+    struct example_s * example,
+    const char * sql,
+    sqlite3_stmt ** stmt
+)
+{
+
+    int ret = 0;
+
+    ret = sqlite3_prepare_v3(
+        /* db = */ example->db,
+        /* sql = */ sql,
+        /* sql_len = */ strlen(sql),
+        /* flags = */ 0,
+        /* &stmt = */ stmt,
+        /* &sql_end = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v3 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Bind the key past which example_schema_migration_2_chunk copies to
+// parameters 1 to 3 of stmt: the current row of from, on groups_v2_cursor, or
+// with from NULL before the first chunk, a key below the lowest deviceid;
+// that's '' for text and -1 for packed ones.
+void example_schema_migration_2_bind_from (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    sqlite3_stmt * from
+)
+{
+
+    if (NULL != from) {
+        for (int i = 0; i < 3; i++) {
+            sqlite3_bind_value(stmt, i + 1, sqlite3_column_value(from, i));
+        }
+        return;
+    }
+
+    if (example->deviceid_packed) {
+        sqlite3_bind_int64(stmt, 1, -1);
+    } else {
+        sqlite3_bind_text(stmt, 1, "", 0, SQLITE_STATIC);
+    }
+    sqlite3_bind_int64(stmt, 2, 0);
+    sqlite3_bind_int64(stmt, 3, 0);
+}
+
+
+// One chunk of migration 2: copy the next budget rows of groups past
+// groups_v2_cursor into groups_v2, in primary key order, and move the cursor
+// on. "or ignore", as the triggers may have copied a row already. When fewer
+// than budget rows are left, it copies the rest and swaps the tables. Returns
+// 1 while there's more to do, 0 after the swap, -1 on error.
+int example_schema_migration_2_chunk (
+    struct example_s * example,
+    uint32_t budget
+)
+{
+
+    int ret = 0;
+    int more = -1;
+    char * err = NULL;
+    sqlite3_stmt * cursor = NULL;
+    sqlite3_stmt * end = NULL;
+    sqlite3_stmt * copy = NULL;
+    sqlite3_stmt * cursor_set = NULL;
+    sqlite3_stmt * from = NULL;
+    bool last = false;
+
+    ret = example_schema_migration_2_prepare(example,
+        "select deviceid, outputid, groupid from groups_v2_cursor;", &cursor);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_migration_2_prepare returned -1");
+        goto finalize;
+    }
+
+    ret = example_schema_migration_2_prepare(example,
+        "select deviceid, outputid, groupid from groups "
+        "where (deviceid, outputid, groupid) > (?1, ?2, ?3) "
+        "order by deviceid, outputid, groupid limit 1 offset ?4;", &end);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_migration_2_prepare returned -1");
+        goto finalize;
+    }
+
+    ret = sqlite3_step(cursor);
+    if (SQLITE_ROW != ret && SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        goto finalize;
+    }
+    from = SQLITE_ROW == ret ? cursor : NULL;
+
+    example_schema_migration_2_bind_from(example, end, from);
+    sqlite3_bind_int64(end, 4, (int64_t)budget - 1);
+
+    ret = sqlite3_step(end);
+    if (SQLITE_ROW != ret && SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        goto finalize;
+    }
+    last = SQLITE_DONE == ret;
+
+    ret = example_schema_migration_2_prepare(example, last
+        ? "insert or ignore into groups_v2 (deviceid, outputid, groupid) "
+          "select deviceid, outputid, groupid from groups "
+          "where (deviceid, outputid, groupid) > (?1, ?2, ?3);"
+        : "insert or ignore into groups_v2 (deviceid, outputid, groupid) "
+          "select deviceid, outputid, groupid from groups "
+          "where (deviceid, outputid, groupid) > (?1, ?2, ?3) "
+          "and (deviceid, outputid, groupid) <= (?4, ?5, ?6);", &copy);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_migration_2_prepare returned -1");
+        goto finalize;
+    }
+
+    example_schema_migration_2_bind_from(example, copy, from);
+    if (!last) {
+        for (int i = 0; i < 3; i++) {
+            sqlite3_bind_value(copy, i + 4, sqlite3_column_value(end, i));
+        }
+    }
+
+    ret = sqlite3_step(copy);
+    if (SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        goto finalize;
+    }
+
+    if (last) {
+        // a statement still reading the tables keeps them from being dropped
+        sqlite3_reset(cursor);
+        ret = sqlite3_exec(example->db, example_schema_migration_2_done, NULL, NULL, &err);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+                ret, err);
+            sqlite3_free(err);
+            goto finalize;
+        }
+
+        more = 0;
+        goto finalize;
+    }
+
+    ret = sqlite3_exec(example->db, "delete from groups_v2_cursor;", NULL, NULL, &err);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        sqlite3_free(err);
+        goto finalize;
+    }
+
+    ret = example_schema_migration_2_prepare(example,
+        "insert into groups_v2_cursor (deviceid, outputid, groupid) values (?1, ?2, ?3);",
+        &cursor_set);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_migration_2_prepare returned -1");
+        goto finalize;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        sqlite3_bind_value(cursor_set, i + 1, sqlite3_column_value(end, i));
+    }
+
+    ret = sqlite3_step(cursor_set);
+    if (SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        goto finalize;
+    }
+
+    more = 1;
+
+finalize:
+    sqlite3_finalize(cursor_set);
+    sqlite3_finalize(copy);
+    sqlite3_finalize(end);
+    sqlite3_finalize(cursor);
+    return more;
+}
+
+
+// One schema migration step, from version - 1 to version.
+//
+// Without a chunk function, sql runs in one transaction together with the
+// user_version bump, so a step is either done or not there at all.
+//
+// With a chunk function the step runs online: sql runs first in a transaction
+// of its own (and again if we get restarted before the step is done, so it has
+// to be idempotent, e.g. "if not exists"), then chunk is called in a fresh
+// transaction each time, doing at most budget units of work; it returns 1
+// while there's more to do, 0 when it's done, -1 on error. The transaction of
+// the last chunk bumps user_version. This is for backfills and the like: the
+// writer lock is only held for one chunk at a time, so the service keeps going
+// while the step runs. chunk has to find where it left off from the database
+// itself.
+//
+// sql_packed, if set, replaces sql on a database with packed deviceids.
+struct example_migration_s {
+    int version;
+    const char * sql;
+    const char * sql_packed;
+    int (*chunk)(struct example_s * example, uint32_t budget);
+};
+
+// ordered by version, no gaps; the last entry is the current schema version.
+static const struct example_migration_s example_migrations[] = {
+    { .version = 1, .sql = example_schema_full, .sql_packed = example_schema_full_packed, .chunk = NULL },
+    { .version = 2, .sql = example_schema_migration_2, .sql_packed = example_schema_migration_2_packed, .chunk = example_schema_migration_2_chunk },
+};
+
+
+int example_schema_version_get (
+    struct example_s * example,
+    int * version
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = NULL;
+
+    ret = sqlite3_prepare_v3(
+        /* db = */ example->db,
+        /* sql = */ "pragma user_version;",
+        /* sql_len = */ sizeof("pragma user_version;") - 1,
+        /* flags = */ SQLITE_PREPARE_NORMALIZE,
+        /* &stmt = */ &stmt,
+        /* &sql_end = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v3 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    ret = sqlite3_step(stmt);
+    if (SQLITE_ROW != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+        sqlite3_finalize(stmt);
+        return -1;
+    }
+
+    *version = sqlite3_column_int(stmt, 0);
+
+    ret = sqlite3_finalize(stmt);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_finalize returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Run one transaction of a migration step: sql if it's not NULL, then chunk
+// if it's not NULL, then the user_version bump unless chunk says there's more
+// to do. Returns what chunk returned, or 0, or -1 after rolling back.
+int example_schema_migrate_txn (
+    struct example_s * example,
+    const struct example_migration_s * migration,
+    const char * sql,
+    int (*chunk)(struct example_s * example, uint32_t budget),
+    uint32_t budget,
+    bool bump
+)
+{
+
+    int ret = 0;
+    int more = 0;
+    char * err = NULL;
+    char version_sql[64];
+
+    ret = sqlite3_exec(example->db, "begin immediate;", NULL, NULL, &err);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        sqlite3_free(err);
+        return -1;
+    }
+
+    if (NULL != sql) {
+        ret = sqlite3_exec(example->db, sql, NULL, NULL, &err);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d on version %d: %s",
+                ret, migration->version, err);
+            sqlite3_free(err);
+            goto rollback;
+        }
+    }
+
+    if (NULL != chunk) {
+        more = chunk(example, budget);
+        if (-1 == more) {
+            EXAMPLE_LOG(LOG_ERR, "chunk returned -1 on version %d",
+                migration->version);
+            goto rollback;
+        }
+    }
+
+    if (bump && 0 == more) {
+        snprintf(version_sql, sizeof(version_sql), "pragma user_version = %d;", migration->version);
+        ret = sqlite3_exec(example->db, version_sql, NULL, NULL, &err);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+                ret, err);
+            sqlite3_free(err);
+            goto rollback;
+        }
+    }
+
+    ret = sqlite3_exec(example->db, "commit;", NULL, NULL, &err);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        sqlite3_free(err);
+        goto rollback;
+    }
+
+    return more;
+
+rollback:
+    (void)sqlite3_exec(example->db, "rollback;", NULL, NULL, NULL);
+    return -1;
+}
+
+
+// Migrate the schema up from whatever user_version says. Steps without a
+// chunk function run to completion. At an online step, with budget == 0 this
+// stops and returns 1; otherwise it runs one chunk of budget and returns 1 if
+// the step isn't done yet, or carries on with the next steps if it is.
+// Returns 0 once the schema is at the current version, -1 on error, including
+// a schema newer than we know about.
+int example_schema_migrate (
+    struct example_s * example,
+    uint32_t budget
+)
+{
+
+    int ret = 0;
+    int version = 0;
+    const size_t migrations_len = sizeof(example_migrations) / sizeof(example_migrations[0]);
+    const int version_current = example_migrations[migrations_len - 1].version;
+
+    ret = example_schema_version_get(example, &version);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_version_get returned -1");
+        return -1;
+    }
+
+    // if the sqlite3 schema version is too new for us to handle; don't touch it!
+    if (version_current < version) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3 schema version %d is too new, we know up to %d; giving up",
+            version, version_current);
+        return -1;
+    }
+
+    for (size_t i = 0; i < migrations_len; i++) {
+        const struct example_migration_s * migration = &example_migrations[i];
+        if (migration->version <= version) {
+            continue;
+        }
+
+        const char * sql = (example->deviceid_packed && NULL != migration->sql_packed)
+            ? migration->sql_packed
+            : migration->sql;
+
+        if (NULL == migration->chunk) {
+            EXAMPLE_LOG(LOG_INFO, "migrating schema from version %d to %d",
+                version, migration->version);
+
+            ret = example_schema_migrate_txn(example, migration, sql, NULL, 0, true);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_schema_migrate_txn returned -1");
+                return -1;
+            }
+
+            version = migration->version;
+            continue;
+        }
+
+        // online step; run its sql once per connection before the first chunk
+        if (example->migration_online_started != migration->version) {
+            EXAMPLE_LOG(LOG_INFO, "starting online schema migration from version %d to %d",
+                version, migration->version);
+
+            ret = example_schema_migrate_txn(example, migration, sql, NULL, 0, false);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_schema_migrate_txn returned -1");
+                return -1;
+            }
+
+            example->migration_online_started = migration->version;
+        }
+
+        if (0 == budget) {
+            return 1;
+        }
+
+        ret = example_schema_migrate_txn(example, migration, NULL, migration->chunk, budget, true);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_schema_migrate_txn returned -1");
+            return -1;
+        }
+        if (1 == ret) {
+            return 1;
+        }
+
+        EXAMPLE_LOG(LOG_INFO, "online schema migration to version %d done",
+            migration->version);
+
+        version = migration->version;
+
+        // run the following steps on the next call, this one has used its
+        // budget.
+        return version_current == version ? 0 : 1;
+    }
+
+    return 0;
+}
+
+
+// Find out how the database stores deviceids: a new database (user_version 0)
+// is going to be created the way config asks for, an existing one says so in
+// pragma application_id.
+int example_deviceid_mode_init (
+    struct example_s * example,
+    const bool packed
+)
+{
+
+    int ret = 0;
+    int version = 0;
+    int64_t application_id = 0;
+
+    ret = example_schema_version_get(example, &version);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_version_get returned -1");
+        return -1;
+    }
+
+    if (0 == version) {
+        example->deviceid_packed = packed;
+        return 0;
+    }
+
+    ret = example_pragma_get(example, "application_id", &application_id, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    if (0 != application_id && EXAMPLE_APPLICATION_ID_PACKED != application_id) {
+        EXAMPLE_LOG(LOG_ERR, "unknown application_id %lld; giving up",
+            (long long)application_id);
+        return -1;
+    }
+
+    example->deviceid_packed = EXAMPLE_APPLICATION_ID_PACKED == application_id;
+    if (example->deviceid_packed != packed) {
+        EXAMPLE_LOG(LOG_WARNING, "database has %s deviceids, using those",
+            example->deviceid_packed ? "packed" : "text");
+    }
+
+    return 0;
+}
+
+
+// Bring the schema up as far as it goes without online steps; those are left
+// to example_schema_migrate with a budget, called from the service's own loop
+// until it returns 0. A new database has nothing to backfill, so there they
+// run through right away.
+int example_init_schema_migration (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+    int version = 0;
+
+    ret = example_schema_version_get(example, &version);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_schema_version_get returned -1");
+        return -1;
+    }
+
+    const uint32_t budget = 0 == version ? UINT32_MAX : 0;
+
+    do {
+        ret = example_schema_migrate(example, budget);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_schema_migrate returned -1");
+            return -1;
+        }
+    } while (1 == ret && 0 != budget);
+
+    if (1 == ret) {
+        EXAMPLE_LOG(LOG_INFO, "online schema migration pending");
+    }
+
+    return 0;
+}
+
+
+// Registry of the example_hash tables in this process, see struct
+// example_hash_s.
+static pthread_mutex_t example_hash_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct example_hash_s * example_hash_registry = NULL;
+
+
+// Name of the example_hash table "table" in the attached database "schema",
+// for the registry. An in-memory database that isn't a named memdb has no
+// file name and is private to its connection, and so is the table.
+void example_hash_name (
+    sqlite3 * db,
+    const char * schema,
+    const char * table,
+    char * name,
+    size_t name_len
+)
+{
+    const char * filename = sqlite3_db_filename(db, schema);
+
+    if (NULL == filename || '\0' == filename[0]) {
+        snprintf(name, name_len, "%p/%s", (void *)db, table);
+    } else {
+        snprintf(name, name_len, "%s/%s", filename, table);
+    }
+}
+
+
+// Look up the table by name or create it with the given capacity, and take a
+// reference; NULL on error. The table is freed once the last reference is
+// released with example_hash_release.
+struct example_hash_s * example_hash_acquire (
+    const char * name,
+    const struct example_hash_table_s * table,
+    uint32_t capacity
+)
+{
+
+    int ret = 0;
+    struct example_hash_s * hash = NULL;
+
+    pthread_mutex_lock(&example_hash_registry_lock);
+
+    for (hash = example_hash_registry; NULL != hash; hash = hash->next) {
+        if (0 == strcmp(hash->name, name)) {
+            break;
+        }
+    }
+
+    if (NULL != hash) {
+        if (hash->table != table) {
+            EXAMPLE_LOG(LOG_ERR, "%s already exists as a %s table",
+                name, hash->table->name);
+            pthread_mutex_unlock(&example_hash_registry_lock);
+            return NULL;
+        }
+        if (hash->capacity != capacity) {
+            EXAMPLE_LOG(LOG_WARNING, "%s already exists with capacity %u, not %u",
+                name, hash->capacity, capacity);
+        }
+        hash->refs++;
+        pthread_mutex_unlock(&example_hash_registry_lock);
+        return hash;
+    }
+
+    if (0 == capacity || (UINT32_MAX >> 2) < capacity) {
+        EXAMPLE_LOG(LOG_ERR, "capacity %u is out of range", capacity);
+        pthread_mutex_unlock(&example_hash_registry_lock);
+        return NULL;
+    }
+
+    hash = calloc(1, sizeof(*hash));
+    if (NULL == hash) {
+        EXAMPLE_LOG(LOG_ERR, "calloc: %s", strerror(errno));
+        pthread_mutex_unlock(&example_hash_registry_lock);
+        return NULL;
+    }
+
+    uint32_t slots_len = 1;
+    while (slots_len < 2 * capacity) {
+        slots_len <<= 1;
+    }
+
+    hash->slots = calloc(slots_len, sizeof(hash->slots[0]));
+    if (NULL == hash->slots) {
+        EXAMPLE_LOG(LOG_ERR, "calloc: %s", strerror(errno));
+        free(hash);
+        pthread_mutex_unlock(&example_hash_registry_lock);
+        return NULL;
+    }
+
+    ret = pthread_rwlock_init(&hash->lock, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_rwlock_init returned %d", ret);
+        free(hash->slots);
+        free(hash);
+        pthread_mutex_unlock(&example_hash_registry_lock);
+        return NULL;
+    }
+
+    snprintf(hash->name, sizeof(hash->name), "%s", name);
+    hash->refs = 1;
+    hash->table = table;
+    hash->capacity = capacity;
+    hash->mask = slots_len - 1;
+
+    hash->next = example_hash_registry;
+    example_hash_registry = hash;
+
+    pthread_mutex_unlock(&example_hash_registry_lock);
+
+    return hash;
+}
+
+
+void example_hash_release (
+    struct example_hash_s * hash
+)
+{
+
+    struct example_hash_s ** link = NULL;
+
+    if (NULL == hash) {
+        return;
+    }
+
+    pthread_mutex_lock(&example_hash_registry_lock);
+
+    hash->refs--;
+    if (0 < hash->refs) {
+        pthread_mutex_unlock(&example_hash_registry_lock);
+        return;
+    }
+
+    for (link = &example_hash_registry; NULL != *link; link = &(*link)->next) {
+        if (*link == hash) {
+            *link = hash->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&example_hash_registry_lock);
+
+    pthread_rwlock_destroy(&hash->lock);
+    free(hash->slots);
+    free(hash);
+}
+
+
+// Find the slot of a key; with the lock held. Returns the slot the key is in
+// and sets *found, or else the slot an insert should use: the first tombstone
+// on the way, or the empty slot the probe ended at.
+uint32_t example_hash_find (
+    const struct example_hash_s * hash,
+    const char * deviceid,
+    const int32_t outputid,
+    bool * found
+)
+{
+
+    // FNV-1a over the key, like the writer's coalesce table
+    uint32_t h = 2166136261u;
+    for (int j = 0; j < 12; j++) {
+        h = (h ^ (uint8_t)deviceid[j]) * 16777619u;
+    }
+    h = (h ^ (uint32_t)outputid) * 16777619u;
+
+    uint32_t tombstone = UINT32_MAX;
+    uint32_t slot = h & hash->mask;
+
+    // used + tombstones never reach the number of slots, so this ends
+    for (;;) {
+        const struct example_hash_slot_s * s = &hash->slots[slot];
+
+        if (EXAMPLE_HASH_SLOT_EMPTY == s->used) {
+            *found = false;
+            return UINT32_MAX == tombstone ? slot : tombstone;
+        }
+
+        if (EXAMPLE_HASH_SLOT_TOMBSTONE == s->used) {
+            if (UINT32_MAX == tombstone) {
+                tombstone = slot;
+            }
+        }
+        else if (s->outputid == outputid && 0 == memcmp(s->deviceid, deviceid, sizeof(s->deviceid))) {
+            *found = true;
+            return slot;
+        }
+
+        slot = (slot + 1) & hash->mask;
+    }
+}
+
+
+// Rebuild the slots without the tombstones; with the write lock held. With
+// steady deletes, e.g. by example_hash_evict, tombstones would otherwise take
+// over the empty slots a probe needs to end at. Rows move to other slots, and
+// the slot is the rowid of the virtual table, so this is only done before an
+// insert (see example_hash_tidy_locked): an update or delete statement has
+// collected the rowids it goes on to write before the first write. A scan
+// running at the same time may see rows twice or not at all, as it may with
+// any concurrent write. Returns -1 if there's no memory for the new slots.
+int example_hash_rehash_locked (
+    struct example_hash_s * hash
+)
+{
+
+    const uint32_t slots_len = hash->mask + 1;
+    struct example_hash_slot_s * old = hash->slots;
+    bool found = false;
+
+    hash->slots = calloc(slots_len, sizeof(hash->slots[0]));
+    if (NULL == hash->slots) {
+        EXAMPLE_LOG(LOG_ERR, "calloc returned NULL");
+        hash->slots = old;
+        return -1;
+    }
+    hash->tombstones = 0;
+
+    for (uint32_t i = 0; i < slots_len; i++) {
+        if (EXAMPLE_HASH_SLOT_USED == old[i].used) {
+            hash->slots[example_hash_find(hash, old[i].deviceid, old[i].outputid, &found)] = old[i];
+        }
+    }
+
+    free(old);
+
+    return 0;
+}
+
+
+// Rehash once the rows and tombstones take up three quarters of the slots;
+// with the write lock held, before inserting. The slots are at least twice the
+// capacity, so a rebuild gets well below this again.
+void example_hash_tidy_locked (
+    struct example_hash_s * hash
+)
+{
+    if ((hash->mask + 1) / 4 * 3 <= hash->used + hash->tombstones) {
+        (void)example_hash_rehash_locked(hash);
+    }
+}
+
+
+// Insert or replace a row; with the write lock held. If unchanged_mask is not
+// 0 and the row exists with the same values (and nulls) in the bits of
+// unchanged_mask, it is left alone, unless heartbeat is not 0 and values[0]
+// (the timestamp of state.measured) is at least heartbeat past the one
+// stored. Returns the slot, or -1 if the table is full.
+int64_t example_hash_put_locked (
+    struct example_hash_s * hash,
+    const char * deviceid,
+    const int32_t outputid,
+    const int64_t * values,
+    const uint8_t nulls,
+    const uint8_t unchanged_mask,
+    const uint64_t heartbeat
+)
+{
+
+    bool found = false;
+    const uint32_t slot = example_hash_find(hash, deviceid, outputid, &found);
+    struct example_hash_slot_s * s = &hash->slots[slot];
+
+    if (found && 0 != unchanged_mask && (s->nulls & unchanged_mask) == (nulls & unchanged_mask)) {
+        bool unchanged = true;
+        for (int i = 0; i < hash->table->values_len && unchanged; i++) {
+            if ((unchanged_mask & (1 << i)) && !(nulls & (1 << i))) {
+                unchanged = s->values[i] == values[i];
+            }
+        }
+        if (unchanged && 0 != heartbeat && !(s->nulls & 1)
+            && (uint64_t)values[0] - (uint64_t)s->values[0] >= heartbeat)
+        {
+            unchanged = false;
+        }
+        if (unchanged) {
+            return slot;
+        }
+    }
+
+    if (!found) {
+        if (hash->capacity <= hash->used) {
+            return -1;
+        }
+        // a probe has to end at an empty slot, see example_hash_rehash_locked
+        if (EXAMPLE_HASH_SLOT_EMPTY == s->used && hash->mask <= hash->used + hash->tombstones) {
+            return -1;
+        }
+        if (EXAMPLE_HASH_SLOT_TOMBSTONE == s->used) {
+            hash->tombstones--;
+        }
+        hash->used++;
+        s->used = EXAMPLE_HASH_SLOT_USED;
+        memcpy(s->deviceid, deviceid, sizeof(s->deviceid));
+        s->outputid = outputid;
+    }
+
+    s->nulls = nulls;
+    for (int i = 0; i < hash->table->values_len; i++) {
+        s->values[i] = (nulls & (1 << i)) ? 0 : values[i];
+    }
+
+    return slot;
+}
+
+
+// Delete the row in a slot; with the write lock held. A probe only needs a
+// tombstone to get past it, so if the slot after it is empty, the slot and
+// any tombstones right before it become empty instead. Otherwise steady
+// deletes, like those of example_hash_expire, would leave the table full of
+// tombstones over time.
+void example_hash_delete_locked (
+    struct example_hash_s * hash,
+    uint32_t slot
+)
+{
+    hash->used--;
+
+    if (EXAMPLE_HASH_SLOT_EMPTY != hash->slots[(slot + 1) & hash->mask].used) {
+        hash->slots[slot].used = EXAMPLE_HASH_SLOT_TOMBSTONE;
+        hash->tombstones++;
+        return;
+    }
+
+    hash->slots[slot].used = EXAMPLE_HASH_SLOT_EMPTY;
+    for (slot = (slot - 1) & hash->mask;
+        EXAMPLE_HASH_SLOT_TOMBSTONE == hash->slots[slot].used;
+        slot = (slot - 1) & hash->mask)
+    {
+        hash->slots[slot].used = EXAMPLE_HASH_SLOT_EMPTY;
+        hash->tombstones--;
+    }
+}
+
+
+// Delete the rows whose values[0] (the timestamp of state.measured) is before
+// cutoff, in at most slots_len slots from *cursor on; a null values[0] never
+// expires. The write lock is only held for those slots, and *cursor is left
+// where the next call should carry on, back at 0 after the last slot.
+// Returns the number of rows deleted.
+uint32_t example_hash_expire (
+    struct example_hash_s * hash,
+    const uint64_t cutoff,
+    uint32_t * cursor,
+    const uint32_t slots_len
+)
+{
+
+    uint32_t deleted = 0;
+    uint32_t slot = *cursor;
+
+    pthread_rwlock_wrlock(&hash->lock);
+
+    const uint32_t end = slots_len < hash->mask + 1 - slot
+        ? slot + slots_len
+        : hash->mask + 1;
+    for (; slot < end; slot++) {
+        const struct example_hash_slot_s * s = &hash->slots[slot];
+        if (EXAMPLE_HASH_SLOT_USED == s->used && !(s->nulls & 1) && (uint64_t)s->values[0] < cutoff) {
+            example_hash_delete_locked(hash, slot);
+            deleted++;
+        }
+    }
+
+    pthread_rwlock_unlock(&hash->lock);
+
+    *cursor = end & hash->mask;
+
+    return deleted;
+}
+
+
+// values[0] of a slot as an age for example_hash_evict; a null one is older
+// than everything
+uint64_t example_hash_evict_key (
+    const struct example_hash_s * hash,
+    const uint32_t slot
+)
+{
+    const struct example_hash_slot_s * s = &hash->slots[slot];
+    return (s->nulls & 1) ? 0 : (uint64_t)s->values[0];
+}
+
+
+// Delete the rows (at most EXAMPLE_HASH_EVICT_MAX) with the oldest values[0],
+// the timestamp of state.measured. There's no index to go by, so this is one
+// pass over all the slots with the write lock held, keeping the oldest ones
+// seen so far in a max-heap. Returns the number of rows deleted.
+uint32_t example_hash_evict (
+    struct example_hash_s * hash,
+    const uint32_t rows
+)
+{
+
+    uint32_t heap[EXAMPLE_HASH_EVICT_MAX];
+    uint32_t heap_len = 0;
+    const uint32_t heap_cap = rows < EXAMPLE_HASH_EVICT_MAX ? rows : EXAMPLE_HASH_EVICT_MAX;
+
+    if (0 == heap_cap) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&hash->lock);
+
+    for (uint32_t slot = 0; slot <= hash->mask; slot++) {
+        if (EXAMPLE_HASH_SLOT_USED != hash->slots[slot].used) {
+            continue;
+        }
+        const uint64_t key = example_hash_evict_key(hash, slot);
+
+        uint32_t i = 0;
+        if (heap_len < heap_cap) {
+            // sift up from the end
+            i = heap_len++;
+            while (0 < i && example_hash_evict_key(hash, heap[(i - 1) / 2]) < key) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            heap[i] = slot;
+            continue;
+        }
+
+        if (example_hash_evict_key(hash, heap[0]) <= key) {
+            continue;
+        }
+
+        // replace the youngest of the oldest, and sift down from the top
+        for (;;) {
+            uint32_t child = 2 * i + 1;
+            if (heap_len <= child) {
+                break;
+            }
+            if (child + 1 < heap_len
+                && example_hash_evict_key(hash, heap[child]) < example_hash_evict_key(hash, heap[child + 1]))
+            {
+                child++;
+            }
+            if (example_hash_evict_key(hash, heap[child]) <= key) {
+                break;
+            }
+            heap[i] = heap[child];
+            i = child;
+        }
+        heap[i] = slot;
+    }
+
+    for (uint32_t i = 0; i < heap_len; i++) {
+        example_hash_delete_locked(hash, heap[i]);
+    }
+
+    pthread_rwlock_unlock(&hash->lock);
+
+    return heap_len;
+}
+
+
+// Upsert from C, without going through sqlite; see example_hash_put_locked.
+int example_hash_put (
+    struct example_hash_s * hash,
+    const char * deviceid,
+    const int32_t outputid,
+    const int64_t * values,
+    const uint8_t nulls,
+    const uint8_t unchanged_mask,
+    const uint64_t heartbeat
+)
+{
+
+    int64_t slot = 0;
+
+    pthread_rwlock_wrlock(&hash->lock);
+    example_hash_tidy_locked(hash);
+    slot = example_hash_put_locked(hash, deviceid, outputid, values, nulls, unchanged_mask, heartbeat);
+    pthread_rwlock_unlock(&hash->lock);
+
+    if (-1 == slot) {
+        EXAMPLE_LOG(LOG_ERR, "%s is full at %u rows", hash->name, hash->capacity);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Point lookup from C. Returns 1 and fills values and nulls if the key is
+// there, 0 if it isn't.
+int example_hash_get (
+    struct example_hash_s * hash,
+    const char * deviceid,
+    const int32_t outputid,
+    int64_t * values,
+    uint8_t * nulls
+)
+{
+
+    bool found = false;
+
+    pthread_rwlock_rdlock(&hash->lock);
+
+    const uint32_t slot = example_hash_find(hash, deviceid, outputid, &found);
+    if (found) {
+        const struct example_hash_slot_s * s = &hash->slots[slot];
+        memcpy(values, s->values, hash->table->values_len * sizeof(values[0]));
+        *nulls = s->nulls;
+    }
+
+    pthread_rwlock_unlock(&hash->lock);
+
+    return found ? 1 : 0;
+}
+
+
+// A row as it was before a write of the current transaction, see
+// example_hash_vtab_log; existed is false for a key that wasn't there.
+struct example_hash_undo_s {
+    struct example_hash_slot_s row;
+    bool existed;
+};
+
+// The example_hash virtual table module: "create virtual table
+// state.measured using example_hash(capacity)", where the table name picks
+// the layout from example_hash_tables. One per connection; the undo log and
+// the savepoints are this connection's transaction, savepoints[i] is the
+// length of the undo log when savepoint i was opened.
+struct example_hash_vtab_s {
+    sqlite3_vtab base;
+    sqlite3 * db;
+    struct example_hash_s * hash;
+    clockid_t clock_id;
+
+    struct example_hash_undo_s * undo;
+    uint32_t undo_len;
+    uint32_t undo_cap;
+    uint32_t * savepoints;
+    int savepoints_len;
+    int savepoints_cap;
+};
+
+// Each row is copied on xNext, so xColumn doesn't need the lock and a row that
+// is changed while the cursor is on it doesn't change under sqlite's feet.
+struct example_hash_cursor_s {
+    sqlite3_vtab_cursor base;
+    int64_t slot;
+    bool eof;
+    bool point;
+    struct example_hash_slot_s row;
+};
+
+// xBestIndex plans, passed to xFilter as idxNum
+#define EXAMPLE_HASH_PLAN_SCAN 0
+#define EXAMPLE_HASH_PLAN_KEY 1
+#define EXAMPLE_HASH_PLAN_ROWID 2
+
+
+int example_hash_vtab_connect_or_create (
+    sqlite3 * db,
+    const struct example_s * example,
+    int argc,
+    const char * const * argv,
+    sqlite3_vtab ** vtab_out,
+    char ** err
+)
+{
+
+    int ret = 0;
+    const struct example_hash_table_s * table = NULL;
+    struct example_hash_vtab_s * vtab = NULL;
+    char name[256];
+
+    for (size_t i = 0; i < sizeof(example_hash_tables) / sizeof(example_hash_tables[0]); i++) {
+        if (0 == sqlite3_stricmp(argv[2], example_hash_tables[i].name)) {
+            table = &example_hash_tables[i];
+        }
+    }
+    if (NULL == table) {
+        *err = sqlite3_mprintf("example_hash: no table layout for %s", argv[2]);
+        return SQLITE_ERROR;
+    }
+
+    if (4 != argc || 0 >= atoll(argv[3])) {
+        *err = sqlite3_mprintf("example_hash: expected example_hash(capacity)");
+        return SQLITE_ERROR;
+    }
+
+    ret = sqlite3_declare_vtab(db, table->schema);
+    if (SQLITE_OK != ret) {
+        *err = sqlite3_mprintf("example_hash: %s", sqlite3_errmsg(db));
+        return ret;
+    }
+
+    // lets xUpdate see "insert or replace" through sqlite3_vtab_on_conflict
+    (void)sqlite3_vtab_config(db, SQLITE_VTAB_CONSTRAINT_SUPPORT, 1);
+
+    vtab = sqlite3_malloc(sizeof(*vtab));
+    if (NULL == vtab) {
+        return SQLITE_NOMEM;
+    }
+    memset(vtab, 0, sizeof(*vtab));
+
+    example_hash_name(db, argv[1], argv[2], name, sizeof(name));
+    vtab->db = db;
+    vtab->clock_id = example->clock_id;
+    vtab->hash = example_hash_acquire(name, table, (uint32_t)atoll(argv[3]));
+    if (NULL == vtab->hash) {
+        sqlite3_free(vtab);
+        *err = sqlite3_mprintf("example_hash: can't set up %s", name);
+        return SQLITE_ERROR;
+    }
+
+    *vtab_out = &vtab->base;
+
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_create (
+    sqlite3 * db,
+    void * user_data,
+    int argc,
+    const char * const * argv,
+    sqlite3_vtab ** vtab,
+    char ** err
+)
+{
+    return example_hash_vtab_connect_or_create(db, user_data, argc, argv, vtab, err);
+}
+
+
+int example_hash_vtab_connect (
+    sqlite3 * db,
+    void * user_data,
+    int argc,
+    const char * const * argv,
+    sqlite3_vtab ** vtab,
+    char ** err
+)
+{
+    return example_hash_vtab_connect_or_create(db, user_data, argc, argv, vtab, err);
+}
+
+
+int example_hash_vtab_disconnect (
+    sqlite3_vtab * base
+)
+{
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    example_hash_release(vtab->hash);
+    sqlite3_free(vtab->undo);
+    sqlite3_free(vtab->savepoints);
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+
+// drop table; other connections may still have the table attached, so empty
+// it rather than waiting for the last reference.
+int example_hash_vtab_destroy (
+    sqlite3_vtab * base
+)
+{
+
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    struct example_hash_s * hash = vtab->hash;
+
+    pthread_rwlock_wrlock(&hash->lock);
+    memset(hash->slots, 0, ((size_t)hash->mask + 1) * sizeof(hash->slots[0]));
+    hash->used = 0;
+    hash->tombstones = 0;
+    pthread_rwlock_unlock(&hash->lock);
+
+    return example_hash_vtab_disconnect(base);
+}
+
+
+// Full key equality is a single probe, rowid equality a single slot;
+// everything else scans all slots.
+int example_hash_vtab_best_index (
+    sqlite3_vtab * base,
+    sqlite3_index_info * info
+)
+{
+
+    int deviceid = -1;
+    int outputid = -1;
+    int rowid = -1;
+
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint * c = &info->aConstraint[i];
+        if (!c->usable || SQLITE_INDEX_CONSTRAINT_EQ != c->op) {
+            continue;
+        }
+        if (0 == c->iColumn) {
+            deviceid = i;
+        } else if (1 == c->iColumn) {
+            outputid = i;
+        } else if (-1 == c->iColumn) {
+            rowid = i;
+        }
+    }
+
+    if (-1 != deviceid && -1 != outputid) {
+        info->idxNum = EXAMPLE_HASH_PLAN_KEY;
+        info->aConstraintUsage[deviceid].argvIndex = 1;
+        info->aConstraintUsage[deviceid].omit = 1;
+        info->aConstraintUsage[outputid].argvIndex = 2;
+        info->aConstraintUsage[outputid].omit = 1;
+        info->estimatedCost = 1;
+        info->estimatedRows = 1;
+        info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    }
+    else if (-1 != rowid) {
+        info->idxNum = EXAMPLE_HASH_PLAN_ROWID;
+        info->aConstraintUsage[rowid].argvIndex = 1;
+        info->aConstraintUsage[rowid].omit = 1;
+        info->estimatedCost = 1;
+        info->estimatedRows = 1;
+        info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    }
+    else {
+        const struct example_hash_s * hash = ((struct example_hash_vtab_s *)base)->hash;
+        info->idxNum = EXAMPLE_HASH_PLAN_SCAN;
+        info->estimatedCost = (double)hash->mask + 1;
+        info->estimatedRows = hash->used;
+    }
+
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_open (
+    sqlite3_vtab * base,
+    sqlite3_vtab_cursor ** cursor_out
+)
+{
+
+    struct example_hash_cursor_s * cursor = sqlite3_malloc(sizeof(*cursor));
+    if (NULL == cursor) {
+        return SQLITE_NOMEM;
+    }
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->eof = true;
+
+    *cursor_out = &cursor->base;
+
+    return SQLITE_OK;
+    (void)base;
+}
+
+
+int example_hash_vtab_close (
+    sqlite3_vtab_cursor * cursor
+)
+{
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+
+// Move a scanning cursor to the next used slot after cursor->slot.
+void example_hash_cursor_advance (
+    struct example_hash_cursor_s * cursor
+)
+{
+
+    struct example_hash_s * hash = ((struct example_hash_vtab_s *)cursor->base.pVtab)->hash;
+
+    pthread_rwlock_rdlock(&hash->lock);
+
+    cursor->eof = true;
+    for (int64_t slot = cursor->slot + 1; slot <= hash->mask; slot++) {
+        if (EXAMPLE_HASH_SLOT_USED == hash->slots[slot].used) {
+            cursor->slot = slot;
+            cursor->row = hash->slots[slot];
+            cursor->eof = false;
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&hash->lock);
+}
+
+
+int example_hash_vtab_filter (
+    sqlite3_vtab_cursor * base,
+    int idx_num,
+    const char * idx_str,
+    int argc,
+    sqlite3_value ** argv
+)
+{
+
+    struct example_hash_cursor_s * cursor = (struct example_hash_cursor_s *)base;
+    struct example_hash_s * hash = ((struct example_hash_vtab_s *)base->pVtab)->hash;
+
+    cursor->eof = true;
+    cursor->point = EXAMPLE_HASH_PLAN_SCAN != idx_num;
+
+    if (EXAMPLE_HASH_PLAN_SCAN == idx_num) {
+        cursor->slot = -1;
+        example_hash_cursor_advance(cursor);
+        return SQLITE_OK;
+    }
+
+    if (EXAMPLE_HASH_PLAN_ROWID == idx_num) {
+        if (SQLITE_INTEGER != sqlite3_value_numeric_type(argv[0])) {
+            return SQLITE_OK;
+        }
+        const int64_t slot = sqlite3_value_int64(argv[0]);
+        pthread_rwlock_rdlock(&hash->lock);
+        if (0 <= slot && slot <= hash->mask && EXAMPLE_HASH_SLOT_USED == hash->slots[slot].used) {
+            cursor->slot = slot;
+            cursor->row = hash->slots[slot];
+            cursor->eof = false;
+        }
+        pthread_rwlock_unlock(&hash->lock);
+        return SQLITE_OK;
+    }
+
+    // EXAMPLE_HASH_PLAN_KEY; anything that can't be a key matches nothing
+    const unsigned char * deviceid = sqlite3_value_text(argv[0]);
+    if (NULL == deviceid || 12 != sqlite3_value_bytes(argv[0])) {
+        return SQLITE_OK;
+    }
+    if (SQLITE_INTEGER != sqlite3_value_numeric_type(argv[1])) {
+        return SQLITE_OK;
+    }
+    const int64_t outputid = sqlite3_value_int64(argv[1]);
+    if (outputid < INT32_MIN || INT32_MAX < outputid) {
+        return SQLITE_OK;
+    }
+
+    bool found = false;
+    pthread_rwlock_rdlock(&hash->lock);
+    const uint32_t slot = example_hash_find(hash, (const char *)deviceid, (int32_t)outputid, &found);
+    if (found) {
+        cursor->slot = slot;
+        cursor->row = hash->slots[slot];
+        cursor->eof = false;
+    }
+    pthread_rwlock_unlock(&hash->lock);
+
+    return SQLITE_OK;
+    (void)idx_str;
+    (void)argc;
+}
+
+
+int example_hash_vtab_next (
+    sqlite3_vtab_cursor * base
+)
+{
+
+    struct example_hash_cursor_s * cursor = (struct example_hash_cursor_s *)base;
+
+    if (cursor->point) {
+        cursor->eof = true;
+    } else {
+        example_hash_cursor_advance(cursor);
+    }
+
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_eof (
+    sqlite3_vtab_cursor * base
+)
+{
+    return ((struct example_hash_cursor_s *)base)->eof;
+}
+
+
+int example_hash_vtab_column (
+    sqlite3_vtab_cursor * base,
+    sqlite3_context * ctx,
+    int column
+)
+{
+
+    const struct example_hash_slot_s * row = &((struct example_hash_cursor_s *)base)->row;
+
+    if (0 == column) {
+        sqlite3_result_text(ctx, row->deviceid, sizeof(row->deviceid), SQLITE_TRANSIENT);
+    } else if (1 == column) {
+        sqlite3_result_int(ctx, row->outputid);
+    } else if (row->nulls & (1 << (column - 2))) {
+        sqlite3_result_null(ctx);
+    } else {
+        sqlite3_result_int64(ctx, row->values[column - 2]);
+    }
+
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_rowid (
+    sqlite3_vtab_cursor * base,
+    sqlite3_int64 * rowid
+)
+{
+    *rowid = ((struct example_hash_cursor_s *)base)->slot;
+    return SQLITE_OK;
+}
+
+
+// Check the columns of an insert or update, argv[2] onwards, and convert them
+// into a slot; an insert gets the now_monotonic() defaults. Returns SQLITE_OK,
+// or SQLITE_CONSTRAINT with the message set.
+int example_hash_vtab_row (
+    struct example_hash_vtab_s * vtab,
+    sqlite3_value ** argv,
+    const bool insert,
+    struct example_hash_slot_s * row
+)
+{
+
+    const struct example_hash_table_s * table = vtab->hash->table;
+
+    const unsigned char * deviceid = sqlite3_value_text(argv[2]);
+    if (NULL == deviceid || 12 != sqlite3_value_bytes(argv[2])) {
+        vtab->base.zErrMsg = sqlite3_mprintf("CHECK constraint failed: length(deviceid)==12");
+        return SQLITE_CONSTRAINT;
+    }
+    memcpy(row->deviceid, deviceid, sizeof(row->deviceid));
+
+    if (SQLITE_INTEGER != sqlite3_value_numeric_type(argv[3])
+            || sqlite3_value_int64(argv[3]) < 0
+            || INT32_MAX < sqlite3_value_int64(argv[3]))
+    {
+        vtab->base.zErrMsg = sqlite3_mprintf("CHECK constraint failed: 0 <= outputid");
+        return SQLITE_CONSTRAINT;
+    }
+    row->outputid = sqlite3_value_int(argv[3]);
+
+    row->nulls = 0;
+    for (int i = 0; i < table->values_len; i++) {
+        sqlite3_value * value = argv[4 + i];
+        if (SQLITE_NULL == sqlite3_value_type(value) && insert && (table->now_default & (1 << i))) {
+            uint64_t now = 0;
+            if (-1 == example_monotonic_now(vtab->clock_id, &now)) {
+                vtab->base.zErrMsg = sqlite3_mprintf("clock_gettime returned -1");
+                return SQLITE_ERROR;
+            }
+            row->values[i] = now;
+            continue;
+        }
+        if (SQLITE_NULL == sqlite3_value_type(value)) {
+            if (!(table->nullable & (1 << i))) {
+                vtab->base.zErrMsg = sqlite3_mprintf("NOT NULL constraint failed: %s column %d",
+                    table->name, 2 + i);
+                return SQLITE_CONSTRAINT;
+            }
+            row->nulls |= 1 << i;
+            row->values[i] = 0;
+            continue;
+        }
+        if (SQLITE_INTEGER != sqlite3_value_numeric_type(value)) {
+            vtab->base.zErrMsg = sqlite3_mprintf("%s column %d only takes integers", table->name, 2 + i);
+            return SQLITE_CONSTRAINT;
+        }
+        row->values[i] = sqlite3_value_int64(value);
+    }
+
+    return SQLITE_OK;
+}
+
+
+// Note a row in the undo log before it's written to; with the write lock
+// held. slot is where the key is, or -1 if it isn't there. Returns SQLITE_OK,
+// or SQLITE_NOMEM and the row must not be written to.
+int example_hash_vtab_log (
+    struct example_hash_vtab_s * vtab,
+    const char * deviceid,
+    const int32_t outputid,
+    const int64_t slot
+)
+{
+
+    if (vtab->undo_len == vtab->undo_cap) {
+        const uint32_t cap = 0 == vtab->undo_cap ? 64 : 2 * vtab->undo_cap;
+        struct example_hash_undo_s * undo = sqlite3_realloc64(vtab->undo, (uint64_t)cap * sizeof(undo[0]));
+        if (NULL == undo) {
+            return SQLITE_NOMEM;
+        }
+        vtab->undo = undo;
+        vtab->undo_cap = cap;
+    }
+
+    struct example_hash_undo_s * entry = &vtab->undo[vtab->undo_len++];
+    entry->existed = -1 != slot;
+    if (entry->existed) {
+        entry->row = vtab->hash->slots[slot];
+    } else {
+        memset(&entry->row, 0, sizeof(entry->row));
+        memcpy(entry->row.deviceid, deviceid, sizeof(entry->row.deviceid));
+        entry->row.outputid = outputid;
+    }
+
+    return SQLITE_OK;
+}
+
+
+// Undo the writes logged after the first undo_len, newest first. Rows go back
+// by key, since they may have moved to other slots since.
+void example_hash_vtab_undo (
+    struct example_hash_vtab_s * vtab,
+    const uint32_t undo_len
+)
+{
+
+    struct example_hash_s * hash = vtab->hash;
+    bool found = false;
+
+    pthread_rwlock_wrlock(&hash->lock);
+
+    for (; undo_len < vtab->undo_len; vtab->undo_len--) {
+        const struct example_hash_slot_s * row = &vtab->undo[vtab->undo_len - 1].row;
+        if (vtab->undo[vtab->undo_len - 1].existed) {
+            (void)example_hash_put_locked(hash, row->deviceid, row->outputid, row->values, row->nulls, 0, 0);
+            continue;
+        }
+        const uint32_t slot = example_hash_find(hash, row->deviceid, row->outputid, &found);
+        if (found) {
+            example_hash_delete_locked(hash, slot);
+        }
+    }
+
+    pthread_rwlock_unlock(&hash->lock);
+}
+
+
+int example_hash_vtab_begin (
+    sqlite3_vtab * base
+)
+{
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    vtab->undo_len = 0;
+    vtab->savepoints_len = 0;
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_sync (
+    sqlite3_vtab * base
+)
+{
+    return SQLITE_OK;
+    (void)base;
+}
+
+
+int example_hash_vtab_commit (
+    sqlite3_vtab * base
+)
+{
+    return example_hash_vtab_begin(base);
+}
+
+
+int example_hash_vtab_rollback (
+    sqlite3_vtab * base
+)
+{
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    example_hash_vtab_undo(vtab, 0);
+    vtab->savepoints_len = 0;
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_savepoint (
+    sqlite3_vtab * base,
+    int savepoint
+)
+{
+
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+
+    if (vtab->savepoints_cap <= savepoint) {
+        const int cap = savepoint + 8;
+        uint32_t * savepoints = sqlite3_realloc64(vtab->savepoints, (uint64_t)cap * sizeof(savepoints[0]));
+        if (NULL == savepoints) {
+            return SQLITE_NOMEM;
+        }
+        vtab->savepoints = savepoints;
+        vtab->savepoints_cap = cap;
+    }
+
+    // savepoints sqlite opened before this table was in the transaction
+    // start out empty
+    for (int i = vtab->savepoints_len; i < savepoint; i++) {
+        vtab->savepoints[i] = 0;
+    }
+    vtab->savepoints[savepoint] = vtab->undo_len;
+    vtab->savepoints_len = savepoint + 1;
+
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_release (
+    sqlite3_vtab * base,
+    int savepoint
+)
+{
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    if (savepoint < vtab->savepoints_len) {
+        vtab->savepoints_len = savepoint;
+    }
+    return SQLITE_OK;
+}
+
+
+// the savepoint itself stays open
+int example_hash_vtab_rollback_to (
+    sqlite3_vtab * base,
+    int savepoint
+)
+{
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    if (savepoint < vtab->savepoints_len) {
+        example_hash_vtab_undo(vtab, vtab->savepoints[savepoint]);
+        vtab->savepoints_len = savepoint + 1;
+    }
+    return SQLITE_OK;
+}
+
+
+int example_hash_vtab_update (
+    sqlite3_vtab * base,
+    int argc,
+    sqlite3_value ** argv,
+    sqlite3_int64 * rowid
+)
+{
+
+    int ret = SQLITE_OK;
+    struct example_hash_vtab_s * vtab = (struct example_hash_vtab_s *)base;
+    struct example_hash_s * hash = vtab->hash;
+    struct example_hash_slot_s row = {0};
+    const bool replace = SQLITE_REPLACE == sqlite3_vtab_on_conflict(vtab->db);
+    const bool ignore = SQLITE_IGNORE == sqlite3_vtab_on_conflict(vtab->db);
+
+    // delete
+    if (1 == argc) {
+        const int64_t slot = sqlite3_value_int64(argv[0]);
+        pthread_rwlock_wrlock(&hash->lock);
+        if (0 <= slot && slot <= hash->mask && EXAMPLE_HASH_SLOT_USED == hash->slots[slot].used) {
+            ret = example_hash_vtab_log(vtab, NULL, 0, slot);
+            if (SQLITE_OK == ret) {
+                example_hash_delete_locked(hash, slot);
+            }
+        }
+        pthread_rwlock_unlock(&hash->lock);
+        return ret;
+    }
+
+    // the rowid is the slot, so it can't be picked
+    const bool insert = SQLITE_NULL == sqlite3_value_type(argv[0]);
+    if ((insert && SQLITE_NULL != sqlite3_value_type(argv[1]))
+        || (!insert && sqlite3_value_int64(argv[0]) != sqlite3_value_int64(argv[1])))
+    {
+        base->zErrMsg = sqlite3_mprintf("the rowid of %s can't be set", hash->table->name);
+        return SQLITE_CONSTRAINT;
+    }
+
+    ret = example_hash_vtab_row(vtab, argv, insert, &row);
+    if (SQLITE_OK != ret) {
+        return ret;
+    }
+
+    pthread_rwlock_wrlock(&hash->lock);
+
+    // without this, the tombstones of deletes through sql would fill the
+    // table up; the undo log goes by key, so moving rows doesn't upset it
+    if (insert) {
+        example_hash_tidy_locked(hash);
+    }
+
+    bool found = false;
+    const uint32_t slot = example_hash_find(hash, row.deviceid, row.outputid, &found);
+
+    if (!insert) {
+        const int64_t old_slot = sqlite3_value_int64(argv[0]);
+        if (old_slot < 0 || hash->mask < old_slot || EXAMPLE_HASH_SLOT_USED != hash->slots[old_slot].used) {
+            pthread_rwlock_unlock(&hash->lock);
+            return SQLITE_OK;
+        }
+        // the key changed, and the new one is taken
+        if (found && slot != old_slot && !replace) {
+            pthread_rwlock_unlock(&hash->lock);
+            if (ignore) {
+                return SQLITE_OK;
+            }
+            base->zErrMsg = sqlite3_mprintf("UNIQUE constraint failed: %s.deviceid, %s.outputid",
+                hash->table->name, hash->table->name);
+            return SQLITE_CONSTRAINT;
+        }
+        // the key changed; move the row, which gives it a new rowid
+        if (slot != old_slot) {
+            ret = example_hash_vtab_log(vtab, NULL, 0, old_slot);
+            if (SQLITE_OK != ret) {
+                pthread_rwlock_unlock(&hash->lock);
+                return ret;
+            }
+            example_hash_delete_locked(hash, old_slot);
+        }
+    }
+    else if (found && !replace) {
+        pthread_rwlock_unlock(&hash->lock);
+        if (ignore) {
+            return SQLITE_OK;
+        }
+        base->zErrMsg = sqlite3_mprintf("UNIQUE constraint failed: %s.deviceid, %s.outputid",
+            hash->table->name, hash->table->name);
+        return SQLITE_CONSTRAINT;
+    }
+
+    ret = example_hash_vtab_log(vtab, row.deviceid, row.outputid, found ? (int64_t)slot : -1);
+    if (SQLITE_OK != ret) {
+        pthread_rwlock_unlock(&hash->lock);
+        return ret;
+    }
+
+    const int64_t put = example_hash_put_locked(hash, row.deviceid, row.outputid, row.values, row.nulls, 0, 0);
+
+    pthread_rwlock_unlock(&hash->lock);
+
+    if (-1 == put) {
+        vtab->undo_len--;
+        base->zErrMsg = sqlite3_mprintf("%s is full at %u rows", hash->table->name, hash->capacity);
+        return SQLITE_FULL;
+    }
+
+    *rowid = put;
+
+    return SQLITE_OK;
+}
+
+
+static const sqlite3_module example_hash_module = {
+    .iVersion = 2,
+    .xCreate = example_hash_vtab_create,
+    .xConnect = example_hash_vtab_connect,
+    .xBestIndex = example_hash_vtab_best_index,
+    .xDisconnect = example_hash_vtab_disconnect,
+    .xDestroy = example_hash_vtab_destroy,
+    .xOpen = example_hash_vtab_open,
+    .xClose = example_hash_vtab_close,
+    .xFilter = example_hash_vtab_filter,
+    .xNext = example_hash_vtab_next,
+    .xEof = example_hash_vtab_eof,
+    .xColumn = example_hash_vtab_column,
+    .xRowid = example_hash_vtab_rowid,
+    .xUpdate = example_hash_vtab_update,
+    .xBegin = example_hash_vtab_begin,
+    .xSync = example_hash_vtab_sync,
+    .xCommit = example_hash_vtab_commit,
+    .xRollback = example_hash_vtab_rollback,
+    .xSavepoint = example_hash_vtab_savepoint,
+    .xRelease = example_hash_vtab_release,
+    .xRollbackTo = example_hash_vtab_rollback_to,
+};
+
+
+int example_init_schema_memory (
+    struct example_s * example,
+    const struct example_config_s * config
+)
+{
+
+    int ret = 0;
+    char * err = NULL;
+    char sql[256];
+    char name[256];
+
+
+    // every connection needs the module, readers included, to use the tables
+    // the writer created with it
+    ret = sqlite3_create_module_v2(example->db, "example_hash", &example_hash_module, example, NULL);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_create_module_v2 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+
+    // attach in-memory database
+    sqlite3_snprintf(sizeof(sql), sql, "attach %Q as state;", config->state_path);
+    ret = sqlite3_exec(
+        /* db = */ example->db,
+        /* sql = */ sql,
+        /* cb = */ NULL,
+        /* user_data = */ NULL,
+        /* err = */ &err
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        return -1;
+    }
+
+
+    // hold on to the hash tables for the C fast path; the virtual tables
+    // attach the same ones by name.
+    if (0 != config->state_hash_capacity) {
+        example_hash_name(example->db, "state", "measured", name, sizeof(name));
+        example->state_measured = example_hash_acquire(name, &example_hash_tables[0], config->state_hash_capacity);
+        example_hash_name(example->db, "state", "setpoint", name, sizeof(name));
+        example->state_setpoint = example_hash_acquire(name, &example_hash_tables[1], config->state_hash_capacity);
+        if (NULL == example->state_measured || NULL == example->state_setpoint) {
+            EXAMPLE_LOG(LOG_ERR, "example_hash_acquire returned NULL");
+            return -1;
+        }
+        example->measured_expire_cursor = 0;
+    }
+    example->measured_rows_max = config->measured_rows_max;
+    example->state_trim_size = config->state_trim_size;
+
+
+    // readers share the schema the writer created
+    if (config->readonly) {
+        return 0;
+    }
+
+
+    // the limit is kept by the memdb, for every connection to it; memdb makes
+    // a limit below its current size the current size
+    if (0 != config->state_size_limit) {
+        sqlite3_int64 size_limit = config->state_size_limit;
+        ret = sqlite3_file_control(example->db, "state", SQLITE_FCNTL_SIZE_LIMIT, &size_limit);
+        if (SQLITE_NOTFOUND == ret) {
+            EXAMPLE_LOG(LOG_INFO, "the state vfs doesn't do SQLITE_FCNTL_SIZE_LIMIT");
+        } else if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_file_control(SQLITE_FCNTL_SIZE_LIMIT) returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+            return -1;
+        } else if (size_limit != config->state_size_limit) {
+            EXAMPLE_LOG(LOG_WARNING, "state_size_limit is %lld, the state database is already larger",
+                (long long)size_limit);
+        }
+    }
+
+
+    // create schema; the drift tables first, the triggers in
+    // example_memory_schema write to them.
+    err = NULL;
+    ret = sqlite3_exec(
+        /* db = */ example->db,
+        /* sql = */ example_memory_schema_drift,
+        /* cb = */ NULL,
+        /* user_data = */ NULL,
+        /* err = */ &err
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        return -1;
+    }
+
+    if (0 != config->state_hash_capacity) {
+        sqlite3_snprintf(sizeof(sql), sql, example_memory_schema_hash,
+            config->state_hash_capacity, config->state_hash_capacity);
+    }
+    err = NULL;
+    ret = sqlite3_exec(
+        /* db = */ example->db,
+        /* sql = */ 0 != config->state_hash_capacity
+            ? sql
+            : example->deviceid_packed ? example_memory_schema_packed : example_memory_schema,
+        /* cb = */ NULL,
+        /* user_data = */ NULL,
+        /* err = */ &err
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        return -1;
+    }
+    
+
+    return 0;
+}
+
+
+int example_init_custom_agg_function (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+
+    // registered as a window function, so it works both as a plain aggregate
+    // and with an over (...) clause
+    ret = sqlite3_create_window_function(
+        /* db = */ example->db,
+        /* function_name = */ "example_agg_f",
+        /* num_args = */ 3,
+        /* flags = */ SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+        /* user_data = */ example,
+        /* step = */ example_agg_f_step,
+        /* final = */ example_agg_f_final,
+        /* value = */ example_agg_f_value,
+        /* inverse = */ example_agg_f_inverse,
+        /* destroy = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_create_window_function returned %d: %s"
+                , ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int example_init_custom_evicting_function (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+
+    example->evicting = false;
+
+    // not SQLITE_DIRECTONLY, the triggers on state.measured call it
+    ret = sqlite3_create_function_v2(
+        /* db = */ example->db,
+        /* function_name = */ "example_evicting",
+        /* num_args = */ 0,
+        /* flags = */ SQLITE_UTF8,
+        /* user_data = */ example,
+        /* func = */ example_evicting,
+        /* step = */ NULL,
+        /* final = */ NULL,
+        /* destroy = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_create_function_v2 returned %d: %s"
+                , ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int example_init_custom_now_monotonic_function (
+    struct example_s * example,
+    const struct example_config_s * config
+)
+{
+
+    int ret = 0;
+
+    example->clock_id = config->coarse_clock ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC;
+    example->instrument = config->instrument;
+    example->measured_heartbeat = (uint64_t)config->measured_heartbeat_s << 32;
+    example->clock_stable_valid = false;
+
+    // Neither of these are SQLITE_DETERMINISTIC; that would allow the planner
+    // to evaluate them once and treat the result as a constant, or use them in
+    // indexes.
+    ret = sqlite3_create_function_v2(
+        /* db = */ example->db,
+        /* function_name = */ "now_monotonic",
+        /* num_args = */ 0,
+        /* flags = */ SQLITE_UTF8,
+        /* user_data = */ example,
+        /* func = */ example_now_monotonic,
+        /* step = */ NULL,
+        /* final = */ NULL,
+        /* destroy = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_create_function_v2 returned %d: %s"
+                , ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    ret = sqlite3_create_function_v2(
+        /* db = */ example->db,
+        /* function_name = */ "now_monotonic_stable",
+        /* num_args = */ 0,
+        /* flags = */ SQLITE_UTF8,
+        /* user_data = */ example,
+        /* func = */ example_now_monotonic_stable,
+        /* step = */ NULL,
+        /* final = */ NULL,
+        /* destroy = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_create_function_v2 returned %d: %s"
+                , ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    // drops the now_monotonic_stable() reading at the start of each
+    // statement, and times them with config->instrument
+    ret = sqlite3_trace_v2(
+        /* db = */ example->db,
+        /* mask = */ SQLITE_TRACE_STMT | (config->instrument ? SQLITE_TRACE_PROFILE : 0),
+        /* callback = */ example_trace,
+        /* user_data = */ example
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_trace_v2 returned %d: %s"
+                , ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// The descriptor of a cached statement on this connection, see
+// example_stmts_hash.
+const struct example_stmt_desc_s * example_stmt_desc (
+    const struct example_s * example,
+    const enum example_stmt_e id
+)
+{
+    if (NULL != example->state_measured && NULL != example_stmts_hash[id].sql) {
+        return &example_stmts_hash[id];
+    }
+    return &example_stmts[id];
+}
+
+
+// Whether the declared type of a column fits a type of struct
+// example_stmt_desc_s. Columns which don't come straight from a table, like
+// expressions or the rows of a pragma, have no declared type and fit
+// anything.
+bool example_stmt_decltype_fits (
+    const struct example_s * example,
+    const char * decltype,
+    char type
+)
+{
+
+    if (NULL == decltype) {
+        return true;
+    }
+
+    if ('d' == type) {
+        type = example->deviceid_packed ? 'I' : 't';
+    }
+
+    switch (type) {
+        case 'i':
+        case 'I':
+        case 'n':
+        case 'N':
+        case 'b':
+            return 0 == sqlite3_strlike("%int%", decltype, 0) || 0 == sqlite3_stricmp(decltype, "bool");
+        case 't':
+            return 0 == sqlite3_strlike("%text%", decltype, 0) || 0 == sqlite3_strlike("%char%", decltype, 0);
+        default:
+            return false;
+    }
+}
+
+
+// Check a freshly prepared cached statement against its descriptor: the
+// number of parameters and of result columns, and the declared types of the
+// columns. Returns -1 on the first mismatch.
+int example_stmt_check (
+    struct example_s * example,
+    const enum example_stmt_e id
+)
+{
+
+    const struct example_stmt_desc_s * desc = example_stmt_desc(example, id);
+    sqlite3_stmt * stmt = example->stmts[id];
+    const int params_len = strlen(desc->params);
+    const int columns_len = strlen(desc->columns);
+
+    if (params_len != sqlite3_bind_parameter_count(stmt)) {
+        EXAMPLE_LOG(LOG_ERR, "\"%s\" has %d parameters, its descriptor %d",
+            desc->sql, sqlite3_bind_parameter_count(stmt), params_len);
+        return -1;
+    }
+
+    if (columns_len != sqlite3_column_count(stmt)) {
+        EXAMPLE_LOG(LOG_ERR, "\"%s\" has %d columns, its descriptor %d",
+            desc->sql, sqlite3_column_count(stmt), columns_len);
+        return -1;
+    }
+
+    for (int i = 0; i < columns_len; i++) {
+        const char * decltype = sqlite3_column_decltype(stmt, i);
+        if (!example_stmt_decltype_fits(example, decltype, desc->columns[i])) {
+            EXAMPLE_LOG(LOG_ERR, "column %s of \"%s\" is declared %s, its descriptor says %c",
+                sqlite3_column_name(stmt, i), desc->sql, decltype, desc->columns[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int example_init_stmts (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+
+    // SQLITE_PREPARE_PERSISTENT tells sqlite that these statements are going
+    // to be around for a long time, so it will not use lookaside memory for
+    // them.
+    for (int i = 0; i < EXAMPLE_STMT_MAX; i++) {
+        const struct example_stmt_desc_s * desc = example_stmt_desc(example, i);
+
+        ret = sqlite3_prepare_v3(
+            /* db = */ example->db,
+            /* sql = */ desc->sql,
+            /* sql_len = */ desc->sql_len,
+            /* flags = */ SQLITE_PREPARE_PERSISTENT | SQLITE_PREPARE_NORMALIZE,
+            /* &stmt = */ &example->stmts[i],
+            /* &sql_end = */ NULL
+        );
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v3 returned %d on \"%s\": %s",
+                ret, desc->sql, sqlite3_errmsg(example->db));
+            return -1;
+        }
+
+        ret = example_stmt_check(example, i);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_stmt_check returned -1");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Put a cached statement back into a clean state so that the next user can
+// bind and step it. Any error from the last sqlite3_step has already been
+// reported by the caller, so the return value of sqlite3_reset is ignored.
+void example_stmt_release (
+    sqlite3_stmt * stmt
+)
+{
+    (void)sqlite3_reset(stmt);
+    (void)sqlite3_clear_bindings(stmt);
+}
+
+
+int example_pragma_set (
+    struct example_s * example,
+    const char * const pragma,
+    const char * const value
+)
+{
+
+    int ret = 0;
+    char * err = NULL;
+    char sql[128];
+
+    // pragmas can't take bound parameters; %Q quotes the value as a string
+    // literal, which every pragma we use accepts.
+    sqlite3_snprintf(sizeof(sql), sql, "pragma %s=%Q;", pragma, value);
+
+    ret = sqlite3_exec(
+        /* db = */ example->db,
+        /* sql = */ sql,
+        /* cb = */ NULL,
+        /* user_data = */ NULL,
+        /* err = */ &err
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d on \"%s\": %s",
+            ret, sql, err);
+        sqlite3_free(err);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int example_pragma_set_int (
+    struct example_s * example,
+    const char * const pragma,
+    const int64_t value
+)
+{
+
+    char value_str[24];
+
+    snprintf(value_str, sizeof(value_str), "%lld", (long long)value);
+
+    return example_pragma_set(example, pragma, value_str);
+}
+
+
+// Read back the settings that are in effect on the database; sqlite accepts
+// most pragmas without complaint even when it ignores them (e.g. WAL on an
+// in-memory database, or mmap_size above the compile-time limit).
+int example_settings_get (
+    struct example_s * example,
+    struct example_settings_s * settings
+)
+{
+
+    int ret = 0;
+    int64_t value = 0;
+
+    ret = example_pragma_get(example, "journal_mode", NULL, settings->journal_mode, sizeof(settings->journal_mode));
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    ret = example_pragma_get(example, "synchronous", &value, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    settings->synchronous = value;
+
+    ret = example_pragma_get(example, "mmap_size", &settings->mmap_size, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    ret = example_pragma_get(example, "cache_size", &settings->cache_size, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    ret = example_pragma_get(example, "page_size", &value, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    settings->page_size = value;
+
+    ret = example_pragma_get(example, "foreign_keys", &value, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    settings->foreign_keys = value;
+
+    ret = example_pragma_get(example, "auto_vacuum", &value, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    settings->auto_vacuum = value;
+
+    return 0;
+}
+
+
+// The growth settings of the database file, see config->chunk_size and
+// config->size_hint. A vfs which doesn't know the file control returns
+// SQLITE_NOTFOUND; that's not an error.
+int example_init_file_controls (
+    struct example_s * example,
+    const struct example_config_s * config
+)
+{
+
+    int ret = 0;
+    int chunk_size = config->chunk_size;
+    sqlite3_int64 size_hint = config->size_hint;
+
+    if (config->readonly) {
+        return 0;
+    }
+
+    if (0 != chunk_size) {
+        if (0 != config->page_size && 0 != chunk_size % config->page_size) {
+            EXAMPLE_LOG(LOG_WARNING, "chunk_size %d is not a multiple of page_size %d",
+                chunk_size, config->page_size);
+        }
+
+        ret = sqlite3_file_control(example->db, "main", SQLITE_FCNTL_CHUNK_SIZE, &chunk_size);
+        if (SQLITE_NOTFOUND == ret) {
+            EXAMPLE_LOG(LOG_INFO, "the vfs doesn't do SQLITE_FCNTL_CHUNK_SIZE");
+        } else if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_file_control(SQLITE_FCNTL_CHUNK_SIZE) returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+            return -1;
+        }
+    }
+
+    if (0 != size_hint) {
+        ret = sqlite3_file_control(example->db, "main", SQLITE_FCNTL_SIZE_HINT, &size_hint);
+        if (SQLITE_NOTFOUND == ret) {
+            EXAMPLE_LOG(LOG_INFO, "the vfs doesn't do SQLITE_FCNTL_SIZE_HINT");
+        } else if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_file_control(SQLITE_FCNTL_SIZE_HINT) returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int example_init_pragmas (
+    struct example_s * example,
+    const struct example_config_s * config
+)
+{
+
+    int ret = 0;
+
+    // page_size has to go first; it can't be changed once the database is in
+    // wal mode. auto_vacuum only changes before the first table is created.
+    // None of these can be changed from a read-only connection.
+    if (0 != config->page_size && !config->readonly) {
+        ret = example_pragma_set_int(example, "page_size", config->page_size);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_set_int returned -1");
+            return -1;
+        }
+    }
+
+    if (NULL != config->auto_vacuum && !config->readonly) {
+        ret = example_pragma_set(example, "auto_vacuum", config->auto_vacuum);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_set returned -1");
+            return -1;
+        }
+    }
+
+    if (NULL != config->journal_mode && !config->readonly) {
+        ret = example_pragma_set(example, "journal_mode", config->journal_mode);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_set returned -1");
+            return -1;
+        }
+    }
+
+    if (NULL != config->synchronous) {
+        ret = example_pragma_set(example, "synchronous", config->synchronous);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_set returned -1");
+            return -1;
+        }
+    }
+
+    if (-1 != config->mmap_size) {
+        ret = example_pragma_set_int(example, "mmap_size", config->mmap_size);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_set_int returned -1");
+            return -1;
+        }
+    }
+
+    if (0 != config->cache_size) {
+        ret = example_pragma_set_int(example, "cache_size", config->cache_size);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_set_int returned -1");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Thread caching allocator for sqlite, see example_global_config_s.pool_malloc.
+// Allocations up to EXAMPLE_ALLOC_CLASS_MAX bytes are rounded up to a power of
+// two size class, and freed blocks are kept on a per-thread free list of their
+// class (up to EXAMPLE_ALLOC_CACHE_LEN of them) instead of going back to
+// malloc; statement execution allocates and frees the same few sizes over and
+// over, so most allocations never get to the libc allocator and its locks.
+// Every block has a header with its usable size in front, for xSize.
+struct example_alloc_cache_s {
+    void * free[EXAMPLE_ALLOC_CLASSES];
+    uint32_t free_len[EXAMPLE_ALLOC_CLASSES];
+    uint32_t ops;
+    uint64_t hits;
+    uint64_t misses;
+    bool registered;
+    bool exited;
+};
+
+
+// counters of all threads; each thread adds its own every
+// EXAMPLE_ALLOC_FLUSH_OPS operations and when it exits
+static _Atomic uint64_t example_alloc_hits = 0;
+static _Atomic uint64_t example_alloc_misses = 0;
+static pthread_key_t example_alloc_key;
+
+static _Thread_local struct example_alloc_cache_s example_alloc_cache;
+
+
+void example_alloc_flush (
+    struct example_alloc_cache_s * cache
+)
+{
+    atomic_fetch_add_explicit(&example_alloc_hits, cache->hits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&example_alloc_misses, cache->misses, memory_order_relaxed);
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->ops = 0;
+}
+
+
+// pthread key destructor: hand the thread's cached blocks back to malloc.
+// sqlite may still free memory from later destructors; that goes straight to
+// free() once exited is set.
+void example_alloc_cache_exit (
+    void * arg
+)
+{
+    struct example_alloc_cache_s * cache = arg;
+
+    for (int i = 0; i < EXAMPLE_ALLOC_CLASSES; i++) {
+        while (NULL != cache->free[i]) {
+            void ** block = cache->free[i];
+            cache->free[i] = *block;
+            free((char *)block - EXAMPLE_ALLOC_HEADER);
+        }
+        cache->free_len[i] = 0;
+    }
+
+    example_alloc_flush(cache);
+    cache->exited = true;
+}
+
+
+int example_alloc_class (
+    const int size
+)
+{
+    int class = 0;
+    while ((EXAMPLE_ALLOC_CLASS_MIN << class) < size) {
+        class++;
+    }
+    return class;
+}
+
+
+int example_alloc_roundup (
+    int size
+)
+{
+    if (EXAMPLE_ALLOC_CLASS_MAX < size) {
+        return (size + 15) & ~15;
+    }
+    return EXAMPLE_ALLOC_CLASS_MIN << example_alloc_class(size);
+}
+
+
+int example_alloc_size (
+    void * p
+)
+{
+    if (NULL == p) {
+        return 0;
+    }
+    return *(int *)((char *)p - EXAMPLE_ALLOC_HEADER);
+}
+
+
+void * example_alloc_malloc (
+    int size
+)
+{
+
+    struct example_alloc_cache_s * cache = &example_alloc_cache;
+    size = example_alloc_roundup(size);
+
+    if (size <= EXAMPLE_ALLOC_CLASS_MAX && !cache->exited) {
+        if (!cache->registered) {
+            cache->registered = true;
+            pthread_setspecific(example_alloc_key, cache);
+        }
+
+        if (EXAMPLE_ALLOC_FLUSH_OPS <= ++cache->ops) {
+            example_alloc_flush(cache);
+        }
+
+        const int class = example_alloc_class(size);
+        void ** block = cache->free[class];
+        if (NULL != block) {
+            cache->free[class] = *block;
+            cache->free_len[class]--;
+            cache->hits++;
+            return block;
+        }
+        cache->misses++;
+    }
+
+    char * header = malloc(EXAMPLE_ALLOC_HEADER + size);
+    if (NULL == header) {
+        return NULL;
+    }
+    *(int *)header = size;
+    return header + EXAMPLE_ALLOC_HEADER;
+}
+
+
+void example_alloc_free (
+    void * p
+)
+{
+
+    struct example_alloc_cache_s * cache = &example_alloc_cache;
+
+    if (NULL == p) {
+        return;
+    }
+
+    const int size = example_alloc_size(p);
+    if (size <= EXAMPLE_ALLOC_CLASS_MAX && cache->registered && !cache->exited) {
+        const int class = example_alloc_class(size);
+        if (cache->free_len[class] < EXAMPLE_ALLOC_CACHE_LEN) {
+            *(void **)p = cache->free[class];
+            cache->free[class] = p;
+            cache->free_len[class]++;
+            return;
+        }
+    }
+
+    free((char *)p - EXAMPLE_ALLOC_HEADER);
+}
+
+
+void * example_alloc_realloc (
+    void * p,
+    int size
+)
+{
+
+    const int old_size = example_alloc_size(p);
+    if (example_alloc_roundup(size) == old_size) {
+        return p;
+    }
+
+    void * q = example_alloc_malloc(size);
+    if (NULL == q) {
+        return NULL;
+    }
+    memcpy(q, p, old_size < size ? old_size : size);
+    example_alloc_free(p);
+    return q;
+}
+
+
+int example_alloc_init (
+    void * app_data
+)
+{
+    int ret = 0;
+
+    ret = pthread_key_create(&example_alloc_key, example_alloc_cache_exit);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_key_create returned %d", ret);
+        return SQLITE_NOMEM;
+    }
+
+    return SQLITE_OK;
+    (void)app_data;
+}
+
+
+void example_alloc_shutdown (
+    void * app_data
+)
+{
+    pthread_key_delete(example_alloc_key);
+    (void)app_data;
+}
+
+
+static const sqlite3_mem_methods example_alloc_methods = {
+    .xMalloc = example_alloc_malloc,
+    .xFree = example_alloc_free,
+    .xRealloc = example_alloc_realloc,
+    .xSize = example_alloc_size,
+    .xRoundup = example_alloc_roundup,
+    .xInit = example_alloc_init,
+    .xShutdown = example_alloc_shutdown,
+    .pAppData = NULL
+};
+
+
+// Process wide sqlite memory configuration; sqlite3_config only works before
+// sqlite3_initialize, so example_global_init has to be called before the
+// first example_init (which otherwise initializes sqlite with the defaults).
+struct example_global_config_s {
+    // preallocate a page cache arena of this many pages of page_size bytes
+    // for all connections (SQLITE_CONFIG_PAGECACHE); pages which don't fit
+    // are malloc'ed as usual and show up in example_stats_s.pagecache_overflow.
+    // Should match example_config_s.page_size. 0 pages leaves the default.
+    int pagecache_page_size;
+    int pagecache_pages;
+
+    // default lookaside for new connections (SQLITE_CONFIG_LOOKASIDE), see
+    // example_config_s.lookaside_slot_size. 0 leaves the default.
+    int lookaside_slot_size;
+    int lookaside_slots;
+
+    // use the thread caching allocator above (SQLITE_CONFIG_MALLOC)
+    bool pool_malloc;
+
+    // sqlite3_soft_heap_limit64: above this many bytes of sqlite memory,
+    // connections give back page cache memory before allocating more. For the
+    // state schema's budget see example_config_s.state_trim_size.
+    // sqlite3_hard_heap_limit64: allocations which would go above this fail
+    // with SQLITE_NOMEM. 0 for no limit; a soft limit above the hard one is
+    // lowered to it.
+    int64_t soft_heap_limit;
+    int64_t hard_heap_limit;
+};
+
+
+static const struct example_global_config_s example_global_config_default = {
+    .pagecache_page_size = 4096,
+    .pagecache_pages = 0,
+    .lookaside_slot_size = 0,
+    .lookaside_slots = 0,
+    .pool_malloc = false,
+    .soft_heap_limit = 0,
+    .hard_heap_limit = 0
+};
+
+
+// the page cache arena; sqlite keeps using it until sqlite3_shutdown
+static void * example_pagecache = NULL;
+static size_t example_pagecache_len = 0;
+
+
+
+
+// the counters behind struct example_io_stats_s
+struct example_io_counters_s {
+    _Atomic uint64_t reads;
+    _Atomic uint64_t bytes_read;
+    _Atomic uint64_t readahead_hits;
+    _Atomic uint64_t writes;
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t syncs;
+};
+
+
+static struct example_io_counters_s example_io_counters[EXAMPLE_IO_MAX];
+
+
+// An open file of the "example" vfs: the file of the vfs underneath follows
+// right after it, see example_vfs_open. Reads of the main database that
+// continue where the last one ended are served from a readahead buffer of
+// example_vfs_readahead bytes, filled with one large read; it's dropped on
+// anything that could make it stale, i.e. writes, truncates, locks and the
+// wal-index calls that start and end transactions.
+struct example_vfs_file_s {
+    sqlite3_file base;
+    sqlite3_file * real;
+    struct example_io_counters_s * counters;
+
+    char * readahead;
+    sqlite3_int64 readahead_offset;
+    int readahead_len;
+    sqlite3_int64 read_end;
+};
+
+
+static sqlite3_vfs example_vfs;
+static int example_vfs_readahead = 0;
+static pthread_mutex_t example_vfs_register_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool example_vfs_registered = false;
+
+
+void example_vfs_readahead_drop (
+    struct example_vfs_file_s * file
+)
+{
+    file->readahead_len = 0;
+    file->read_end = -1;
+}
+
+
+int example_vfs_close (
+    sqlite3_file * base
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    int ret = file->real->pMethods->xClose(file->real);
+    sqlite3_free(file->readahead);
+    file->readahead = NULL;
+    return ret;
+}
+
+
+int example_vfs_read (
+    sqlite3_file * base,
+    void * buf,
+    int amt,
+    sqlite3_int64 offset
+)
+{
+
+    int ret = 0;
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    const sqlite3_int64 end = offset + amt;
+
+    if (NULL != file->readahead) {
+        // a hit
+        if (file->readahead_offset <= offset && end <= file->readahead_offset + file->readahead_len) {
+            memcpy(buf, file->readahead + (offset - file->readahead_offset), amt);
+            file->read_end = end;
+            atomic_fetch_add_explicit(&file->counters->readahead_hits, 1, memory_order_relaxed);
+            return SQLITE_OK;
+        }
+
+        // sequential; fill the buffer from here, as far as the file goes
+        if (offset == file->read_end && amt < example_vfs_readahead) {
+            sqlite3_int64 size = 0;
+            ret = file->real->pMethods->xFileSize(file->real, &size);
+            if (SQLITE_OK == ret && end <= size) {
+                const int len = size - offset < example_vfs_readahead ? size - offset : example_vfs_readahead;
+                ret = file->real->pMethods->xRead(file->real, file->readahead, len, offset);
+                atomic_fetch_add_explicit(&file->counters->reads, 1, memory_order_relaxed);
+                if (SQLITE_OK == ret) {
+                    atomic_fetch_add_explicit(&file->counters->bytes_read, len, memory_order_relaxed);
+                    file->readahead_offset = offset;
+                    file->readahead_len = len;
+                    file->read_end = end;
+                    memcpy(buf, file->readahead, amt);
+                    return SQLITE_OK;
+                }
+                example_vfs_readahead_drop(file);
+            }
+        }
+    }
+
+    ret = file->real->pMethods->xRead(file->real, buf, amt, offset);
+    atomic_fetch_add_explicit(&file->counters->reads, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&file->counters->bytes_read, amt, memory_order_relaxed);
+    file->read_end = end;
+    return ret;
+}
+
+
+int example_vfs_write (
+    sqlite3_file * base,
+    const void * buf,
+    int amt,
+    sqlite3_int64 offset
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    atomic_fetch_add_explicit(&file->counters->writes, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&file->counters->bytes_written, amt, memory_order_relaxed);
+    return file->real->pMethods->xWrite(file->real, buf, amt, offset);
+}
+
+
+int example_vfs_truncate (
+    sqlite3_file * base,
+    sqlite3_int64 size
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    return file->real->pMethods->xTruncate(file->real, size);
+}
+
+
+int example_vfs_sync (
+    sqlite3_file * base,
+    int flags
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    atomic_fetch_add_explicit(&file->counters->syncs, 1, memory_order_relaxed);
+    return file->real->pMethods->xSync(file->real, flags);
+}
+
+
+int example_vfs_file_size (
+    sqlite3_file * base,
+    sqlite3_int64 * size
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xFileSize(file->real, size);
+}
+
+
+int example_vfs_lock (
+    sqlite3_file * base,
+    int lock
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    return file->real->pMethods->xLock(file->real, lock);
+}
+
+
+int example_vfs_unlock (
+    sqlite3_file * base,
+    int lock
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    return file->real->pMethods->xUnlock(file->real, lock);
+}
+
+
+int example_vfs_check_reserved_lock (
+    sqlite3_file * base,
+    int * out
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xCheckReservedLock(file->real, out);
+}
+
+
+int example_vfs_file_control (
+    sqlite3_file * base,
+    int op,
+    void * arg
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xFileControl(file->real, op, arg);
+}
+
+
+int example_vfs_sector_size (
+    sqlite3_file * base
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xSectorSize(file->real);
+}
+
+
+int example_vfs_device_characteristics (
+    sqlite3_file * base
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xDeviceCharacteristics(file->real);
+}
+
+
+int example_vfs_shm_map (
+    sqlite3_file * base,
+    int page,
+    int page_size,
+    int extend,
+    void volatile ** p
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    return file->real->pMethods->xShmMap(file->real, page, page_size, extend, p);
+}
+
+
+int example_vfs_shm_lock (
+    sqlite3_file * base,
+    int offset,
+    int n,
+    int flags
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    return file->real->pMethods->xShmLock(file->real, offset, n, flags);
+}
+
+
+void example_vfs_shm_barrier (
+    sqlite3_file * base
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    file->real->pMethods->xShmBarrier(file->real);
+}
+
+
+int example_vfs_shm_unmap (
+    sqlite3_file * base,
+    int delete
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    example_vfs_readahead_drop(file);
+    return file->real->pMethods->xShmUnmap(file->real, delete);
+}
+
+
+int example_vfs_fetch (
+    sqlite3_file * base,
+    sqlite3_int64 offset,
+    int amt,
+    void ** p
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xFetch(file->real, offset, amt, p);
+}
+
+
+int example_vfs_unfetch (
+    sqlite3_file * base,
+    sqlite3_int64 offset,
+    void * p
+)
+{
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+    return file->real->pMethods->xUnfetch(file->real, offset, p);
+}
+
+
+// by the iVersion of the file underneath: 1 has no wal-index, 2 no mmap
+static const sqlite3_io_methods example_vfs_io_methods[3] = {
+#define EXAMPLE_VFS_IO_METHODS_V1 \
+    .xClose = example_vfs_close, \
+    .xRead = example_vfs_read, \
+    .xWrite = example_vfs_write, \
+    .xTruncate = example_vfs_truncate, \
+    .xSync = example_vfs_sync, \
+    .xFileSize = example_vfs_file_size, \
+    .xLock = example_vfs_lock, \
+    .xUnlock = example_vfs_unlock, \
+    .xCheckReservedLock = example_vfs_check_reserved_lock, \
+    .xFileControl = example_vfs_file_control, \
+    .xSectorSize = example_vfs_sector_size, \
+    .xDeviceCharacteristics = example_vfs_device_characteristics
+#define EXAMPLE_VFS_IO_METHODS_V2 \
+    .xShmMap = example_vfs_shm_map, \
+    .xShmLock = example_vfs_shm_lock, \
+    .xShmBarrier = example_vfs_shm_barrier, \
+    .xShmUnmap = example_vfs_shm_unmap
+    {
+        .iVersion = 1,
+        EXAMPLE_VFS_IO_METHODS_V1
+    },
+    {
+        .iVersion = 2,
+        EXAMPLE_VFS_IO_METHODS_V1,
+        EXAMPLE_VFS_IO_METHODS_V2
+    },
+    {
+        .iVersion = 3,
+        EXAMPLE_VFS_IO_METHODS_V1,
+        EXAMPLE_VFS_IO_METHODS_V2,
+        .xFetch = example_vfs_fetch,
+        .xUnfetch = example_vfs_unfetch
+    },
+#undef EXAMPLE_VFS_IO_METHODS_V1
+#undef EXAMPLE_VFS_IO_METHODS_V2
+};
+
+
+int example_vfs_open (
+    sqlite3_vfs * vfs,
+    const char * name,
+    sqlite3_file * base,
+    int flags,
+    int * out_flags
+)
+{
+
+    int ret = 0;
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    struct example_vfs_file_s * file = (struct example_vfs_file_s *)base;
+
+    memset(file, 0, sizeof(*file));
+    file->real = (sqlite3_file *)&file[1];
+    file->read_end = -1;
+
+    if (flags & SQLITE_OPEN_MAIN_DB) {
+        file->counters = &example_io_counters[EXAMPLE_IO_MAIN_DB];
+    } else if (flags & SQLITE_OPEN_WAL) {
+        file->counters = &example_io_counters[EXAMPLE_IO_WAL];
+    } else if (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_SUBJOURNAL)) {
+        file->counters = &example_io_counters[EXAMPLE_IO_JOURNAL];
+    } else {
+        file->counters = &example_io_counters[EXAMPLE_IO_OTHER];
+    }
+
+    ret = real_vfs->xOpen(real_vfs, name, file->real, flags, out_flags);
+    if (NULL == file->real->pMethods) {
+        return ret;
+    }
+
+    // the scans that read-ahead is for are over the main database
+    if ((flags & SQLITE_OPEN_MAIN_DB) && 0 < example_vfs_readahead) {
+        file->readahead = sqlite3_malloc(example_vfs_readahead);
+    }
+
+    const int version = file->real->pMethods->iVersion;
+    base->pMethods = &example_vfs_io_methods[(version < 1 ? 1 : 3 < version ? 3 : version) - 1];
+
+    return ret;
+}
+
+
+int example_vfs_delete (
+    sqlite3_vfs * vfs,
+    const char * name,
+    int sync_dir
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xDelete(real_vfs, name, sync_dir);
+}
+
+
+int example_vfs_access (
+    sqlite3_vfs * vfs,
+    const char * name,
+    int flags,
+    int * out
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xAccess(real_vfs, name, flags, out);
+}
+
+
+int example_vfs_full_pathname (
+    sqlite3_vfs * vfs,
+    const char * name,
+    int out_len,
+    char * out
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xFullPathname(real_vfs, name, out_len, out);
+}
+
+void * example_vfs_dl_open (
+    sqlite3_vfs * vfs,
+    const char * name
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xDlOpen(real_vfs, name);
+}
+
+
+void example_vfs_dl_error (
+    sqlite3_vfs * vfs,
+    int len,
+    char * msg
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    real_vfs->xDlError(real_vfs, len, msg);
+}
+
+
+void (*example_vfs_dl_sym (
+    sqlite3_vfs * vfs,
+    void * handle,
+    const char * sym
+))(void)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xDlSym(real_vfs, handle, sym);
+}
+
+
+void example_vfs_dl_close (
+    sqlite3_vfs * vfs,
+    void * handle
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    real_vfs->xDlClose(real_vfs, handle);
+}
+
+
+int example_vfs_randomness (
+    sqlite3_vfs * vfs,
+    int len,
+    char * out
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xRandomness(real_vfs, len, out);
+}
+
+
+int example_vfs_sleep (
+    sqlite3_vfs * vfs,
+    int us
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xSleep(real_vfs, us);
+}
+
+
+int example_vfs_current_time (
+    sqlite3_vfs * vfs,
+    double * out
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xCurrentTime(real_vfs, out);
+}
+
+
+int example_vfs_get_last_error (
+    sqlite3_vfs * vfs,
+    int len,
+    char * out
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xGetLastError(real_vfs, len, out);
+}
+
+
+int example_vfs_current_time_int64 (
+    sqlite3_vfs * vfs,
+    sqlite3_int64 * out
+)
+{
+    sqlite3_vfs * real_vfs = vfs->pAppData;
+    return real_vfs->xCurrentTimeInt64(real_vfs, out);
+}
+
+
+// Register the "example" vfs on top of the default one, once per process;
+// readahead is the read-ahead size in bytes, 0 to only count. That's up to
+// the first caller, later ones get the vfs as it is.
+int example_vfs_register (
+    const int readahead
+)
+{
+
+    int ret = 0;
+
+    pthread_mutex_lock(&example_vfs_register_lock);
+    if (example_vfs_registered) {
+        pthread_mutex_unlock(&example_vfs_register_lock);
+        return 0;
+    }
+
+    sqlite3_vfs * real_vfs = sqlite3_vfs_find(NULL);
+    if (NULL == real_vfs) {
+        EXAMPLE_LOG(LOG_ERR, "no default vfs");
+        pthread_mutex_unlock(&example_vfs_register_lock);
+        return -1;
+    }
+
+    // version 2 is enough for xCurrentTimeInt64; the system call hooks of
+    // version 3 are for testing the unix vfs itself
+    example_vfs = (sqlite3_vfs){
+        .iVersion = 2,
+        .szOsFile = sizeof(struct example_vfs_file_s) + real_vfs->szOsFile,
+        .mxPathname = real_vfs->mxPathname,
+        .zName = "example",
+        .pAppData = real_vfs,
+        .xOpen = example_vfs_open,
+        .xDelete = example_vfs_delete,
+        .xAccess = example_vfs_access,
+        .xFullPathname = example_vfs_full_pathname,
+        .xDlOpen = example_vfs_dl_open,
+        .xDlError = example_vfs_dl_error,
+        .xDlSym = example_vfs_dl_sym,
+        .xDlClose = example_vfs_dl_close,
+        .xRandomness = example_vfs_randomness,
+        .xSleep = example_vfs_sleep,
+        .xCurrentTime = example_vfs_current_time,
+        .xGetLastError = example_vfs_get_last_error,
+        .xCurrentTimeInt64 = example_vfs_current_time_int64,
+    };
+    example_vfs_readahead = readahead;
+
+    ret = sqlite3_vfs_register(&example_vfs, 0);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_vfs_register returned %d", ret);
+        pthread_mutex_unlock(&example_vfs_register_lock);
+        return -1;
+    }
+
+    example_vfs_registered = true;
+    pthread_mutex_unlock(&example_vfs_register_lock);
+
+    return 0;
+}
+
+
+
+
+// Upper bound in ns of the bucket the q quantile (0 to 1) of histogram falls
+// into; 0 without any samples.
+uint64_t example_histogram_quantile (
+    const struct example_histogram_s * histogram,
+    const double q
+)
+{
+
+    uint64_t seen = 0;
+    const uint64_t rank = q * histogram->count;
+
+    if (0 == histogram->count) {
+        return 0;
+    }
+
+    for (int i = 0; i < EXAMPLE_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (rank < seen) {
+            return UINT64_C(1) << i;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+
+// The number of rows in state.measured, or -1. For the b-tree table that's
+// state.measured_rows, which the triggers keep.
+int64_t example_measured_rows (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+    int64_t rows = 0;
+    sqlite3_stmt * stmt = example->stmts[EXAMPLE_STMT_MEASURED_COUNT];
+
+    if (NULL != example->state_measured) {
+        pthread_rwlock_rdlock(&example->state_measured->lock);
+        rows = example->state_measured->used;
+        pthread_rwlock_unlock(&example->state_measured->lock);
+        return rows;
+    }
+
+    ret = sqlite3_step(stmt);
+    if (SQLITE_ROW != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+        example_stmt_release(stmt);
+        return -1;
+    }
+    rows = sqlite3_column_int64(stmt, 0);
+
+    example_stmt_release(stmt);
+
+    return rows;
+}
+
+
+// Take a snapshot of the statement latencies, sqlite3_stmt_status counters of
+// the cached statements and the sqlite3_db_status page cache counters. With
+// reset, everything which can be starts over from 0 (the memory in use
+// can't).
+int example_stats_get (
+    struct example_s * example,
+    struct example_stats_s * stats,
+    const bool reset
+)
+{
+
+    int ret = 0;
+    int highwater = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i <= EXAMPLE_STMT_MAX; i++) {
+        struct example_stmt_stats_s * stmt_stats = &stats->stmts[i];
+        stmt_stats->latency = example->latency[i];
+        if (reset) {
+            memset(&example->latency[i], 0, sizeof(example->latency[i]));
+        }
+
+        if (EXAMPLE_STMT_MAX == i || NULL == example->stmts[i]) {
+            continue;
+        }
+
+        sqlite3_stmt * stmt = example->stmts[i];
+        stmt_stats->fullscan_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, reset);
+        stmt_stats->sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, reset);
+        stmt_stats->autoindexes = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, reset);
+        stmt_stats->vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, reset);
+        stmt_stats->reprepares = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, reset);
+        stmt_stats->runs = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_RUN, reset);
+        stmt_stats->memused = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, false);
+    }
+
+    // the lookaside hit and miss counts are only reported as the highwater
+    const struct {
+        int op;
+        int * value;
+        bool resettable;
+        bool highwater;
+    } db_status[] = {
+        { SQLITE_DBSTATUS_CACHE_HIT, &stats->cache_hit, true, false },
+        { SQLITE_DBSTATUS_CACHE_MISS, &stats->cache_miss, true, false },
+        { SQLITE_DBSTATUS_CACHE_WRITE, &stats->cache_write, true, false },
+        { SQLITE_DBSTATUS_CACHE_SPILL, &stats->cache_spill, true, false },
+        { SQLITE_DBSTATUS_CACHE_USED, &stats->cache_used, false, false },
+        { SQLITE_DBSTATUS_LOOKASIDE_USED, &stats->lookaside_used, false, false },
+        { SQLITE_DBSTATUS_LOOKASIDE_HIT, &stats->lookaside_hit, true, true },
+        { SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &stats->lookaside_miss_size, true, true },
+        { SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &stats->lookaside_miss_full, true, true },
+        { SQLITE_DBSTATUS_SCHEMA_USED, &stats->schema_used, false, false },
+        { SQLITE_DBSTATUS_STMT_USED, &stats->stmt_used, false, false },
+    };
+
+    for (size_t i = 0; i < sizeof(db_status) / sizeof(db_status[0]); i++) {
+        int current = 0;
+        ret = sqlite3_db_status(
+            /* db = */ example->db,
+            /* op = */ db_status[i].op,
+            /* current = */ &current,
+            /* highwater = */ &highwater,
+            /* reset = */ reset && db_status[i].resettable
+        );
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_db_status returned %d on %d",
+                ret, db_status[i].op);
+            return -1;
+        }
+        *db_status[i].value = db_status[i].highwater ? highwater : current;
+    }
+
+    sqlite3_int64 status_highwater = 0;
+    const struct {
+        int op;
+        int64_t * value;
+    } status[] = {
+        { SQLITE_STATUS_MEMORY_USED, &stats->memory_used },
+        { SQLITE_STATUS_PAGECACHE_USED, &stats->pagecache_used },
+        { SQLITE_STATUS_PAGECACHE_OVERFLOW, &stats->pagecache_overflow },
+    };
+
+    for (size_t i = 0; i < sizeof(status) / sizeof(status[0]); i++) {
+        sqlite3_int64 current = 0;
+        ret = sqlite3_status64(status[i].op, &current, &status_highwater, false);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_status64 returned %d on %d",
+                ret, status[i].op);
+            return -1;
+        }
+        *status[i].value = current;
+    }
+
+    for (int i = 0; i < EXAMPLE_IO_MAX; i++) {
+        const struct example_io_counters_s * counters = &example_io_counters[i];
+        stats->io[i] = (struct example_io_stats_s){
+            .reads = atomic_load_explicit(&counters->reads, memory_order_relaxed),
+            .bytes_read = atomic_load_explicit(&counters->bytes_read, memory_order_relaxed),
+            .readahead_hits = atomic_load_explicit(&counters->readahead_hits, memory_order_relaxed),
+            .writes = atomic_load_explicit(&counters->writes, memory_order_relaxed),
+            .bytes_written = atomic_load_explicit(&counters->bytes_written, memory_order_relaxed),
+            .syncs = atomic_load_explicit(&counters->syncs, memory_order_relaxed),
+        };
+    }
+
+    // includes the calling thread's counts which haven't been flushed yet
+    stats->pool_hits = atomic_load_explicit(&example_alloc_hits, memory_order_relaxed) + example_alloc_cache.hits;
+    stats->pool_misses = atomic_load_explicit(&example_alloc_misses, memory_order_relaxed) + example_alloc_cache.misses;
+
+    static const char * const dbs[EXAMPLE_DB_MAX] = {"main", "state"};
+    for (int i = 0; i < EXAMPLE_DB_MAX; i++) {
+        struct example_db_stats_s * db_stats = &stats->dbs[i];
+        int64_t page_size = 0;
+        int64_t page_count = 0;
+        int64_t freelist_count = 0;
+        char pragma[32];
+
+        // -1 reads the limit without changing it
+        sqlite3_int64 size_limit = -1;
+        ret = sqlite3_file_control(example->db, dbs[i], SQLITE_FCNTL_SIZE_LIMIT, &size_limit);
+        db_stats->size_limit = SQLITE_OK == ret ? size_limit : 0;
+
+        snprintf(pragma, sizeof(pragma), "%s.page_size", dbs[i]);
+        ret = example_pragma_get(example, pragma, &page_size, NULL, 0);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+            return -1;
+        }
+        snprintf(pragma, sizeof(pragma), "%s.page_count", dbs[i]);
+        ret = example_pragma_get(example, pragma, &page_count, NULL, 0);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+            return -1;
+        }
+        snprintf(pragma, sizeof(pragma), "%s.freelist_count", dbs[i]);
+        ret = example_pragma_get(example, pragma, &freelist_count, NULL, 0);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+            return -1;
+        }
+
+        db_stats->bytes = page_count * page_size;
+        db_stats->free_bytes = freelist_count * page_size;
+    }
+
+    // the hash tables aren't in the memdb pages, but they are what the state
+    // schema is; their size is fixed at creation
+    if (NULL != example->state_measured) {
+        stats->dbs[EXAMPLE_DB_STATE].bytes +=
+            (int64_t)(example->state_measured->mask + 1) * sizeof(example->state_measured->slots[0]) +
+            (int64_t)(example->state_setpoint->mask + 1) * sizeof(example->state_setpoint->slots[0]);
+    }
+
+    stats->measured_rows = example_measured_rows(example);
+    if (-1 == stats->measured_rows) {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_rows returned -1");
+        return -1;
+    }
+
+    stats->soft_heap_limit = sqlite3_soft_heap_limit64(-1);
+    stats->hard_heap_limit = sqlite3_hard_heap_limit64(-1);
+
+    return 0;
+}
+
+
+// Log a snapshot from example_stats_get, one line per statement which has
+// run; the sort and fullscan counts are what gives away a plan that's gone
+// bad, like a group by needing a temp b-tree.
+void example_stats_log (
+    struct example_s * example,
+    const struct example_stats_s * stats
+)
+{
+
+    const uint64_t lookups = (uint64_t)stats->cache_hit + stats->cache_miss;
+
+    EXAMPLE_LOG(LOG_INFO, "cache hit=%d miss=%d (%.1f%% hits) write=%d spill=%d used=%d "
+        "lookaside_used=%d schema_used=%d stmt_used=%d",
+        stats->cache_hit, stats->cache_miss,
+        0 == lookups ? 0.0 : 100.0 * stats->cache_hit / lookups,
+        stats->cache_write, stats->cache_spill, stats->cache_used,
+        stats->lookaside_used, stats->schema_used, stats->stmt_used);
+
+    const uint64_t allocations = stats->pool_hits + stats->pool_misses;
+    EXAMPLE_LOG(LOG_INFO, "lookaside hit=%d miss_size=%d miss_full=%d memory_used=%lld "
+        "pagecache_used=%lld pagecache_overflow=%lld pool hit=%llu miss=%llu (%.1f%% hits)",
+        stats->lookaside_hit, stats->lookaside_miss_size, stats->lookaside_miss_full,
+        (long long)stats->memory_used, (long long)stats->pagecache_used, (long long)stats->pagecache_overflow,
+        (unsigned long long)stats->pool_hits, (unsigned long long)stats->pool_misses,
+        0 == allocations ? 0.0 : 100.0 * stats->pool_hits / allocations);
+
+    EXAMPLE_LOG(LOG_INFO, "memory main=%lld (free %lld, limit %lld) state=%lld (free %lld, limit %lld) "
+        "measured_rows=%lld soft_heap_limit=%lld hard_heap_limit=%lld",
+        (long long)stats->dbs[EXAMPLE_DB_MAIN].bytes, (long long)stats->dbs[EXAMPLE_DB_MAIN].free_bytes,
+        (long long)stats->dbs[EXAMPLE_DB_MAIN].size_limit,
+        (long long)stats->dbs[EXAMPLE_DB_STATE].bytes, (long long)stats->dbs[EXAMPLE_DB_STATE].free_bytes,
+        (long long)stats->dbs[EXAMPLE_DB_STATE].size_limit,
+        (long long)stats->measured_rows, (long long)stats->soft_heap_limit, (long long)stats->hard_heap_limit);
+
+    static const char * const io_kinds[EXAMPLE_IO_MAX] = {"db", "wal", "journal", "other"};
+    for (int i = 0; i < EXAMPLE_IO_MAX; i++) {
+        const struct example_io_stats_s * io = &stats->io[i];
+        if (0 == io->reads + io->readahead_hits + io->writes) {
+            continue;
+        }
+        EXAMPLE_LOG(LOG_INFO, "io %s: reads=%llu bytes_read=%llu readahead_hits=%llu writes=%llu "
+            "bytes_written=%llu syncs=%llu",
+            io_kinds[i], (unsigned long long)io->reads, (unsigned long long)io->bytes_read,
+            (unsigned long long)io->readahead_hits, (unsigned long long)io->writes,
+            (unsigned long long)io->bytes_written, (unsigned long long)io->syncs);
+    }
+
+    for (int i = 0; i <= EXAMPLE_STMT_MAX; i++) {
+        const struct example_stmt_stats_s * stmt_stats = &stats->stmts[i];
+        const struct example_histogram_s * latency = &stmt_stats->latency;
+        if (0 == latency->count && 0 == stmt_stats->runs) {
+            continue;
+        }
+
+        EXAMPLE_LOG(LOG_INFO, "%.48s: n=%llu mean=%lluns p50<%lluns p99<%lluns max=%lluns "
+            "runs=%d vm_steps=%d fullscan_steps=%d sorts=%d autoindexes=%d reprepares=%d memused=%d",
+            EXAMPLE_STMT_MAX == i || NULL == example->stmts[i] ? "(other)" : sqlite3_sql(example->stmts[i]),
+            (unsigned long long)latency->count,
+            (unsigned long long)(0 == latency->count ? 0 : latency->sum_ns / latency->count),
+            (unsigned long long)example_histogram_quantile(latency, 0.5),
+            (unsigned long long)example_histogram_quantile(latency, 0.99),
+            (unsigned long long)latency->max_ns,
+            stmt_stats->runs, stmt_stats->vm_steps, stmt_stats->fullscan_steps, stmt_stats->sorts,
+            stmt_stats->autoindexes, stmt_stats->reprepares, stmt_stats->memused);
+    }
+}
+
+
+// Configure sqlite's memory allocation and initialize it; see struct
+// example_global_config_s. Call once, before any other example_* function.
+int example_global_init (
+    const struct example_global_config_s * config
+)
+{
+
+    int ret = 0;
+    int header = 0;
+
+    if (config->pool_malloc) {
+        ret = sqlite3_config(SQLITE_CONFIG_MALLOC, &example_alloc_methods);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_config(SQLITE_CONFIG_MALLOC) returned %d", ret);
+            return -1;
+        }
+    }
+
+    if (0 < config->pagecache_pages) {
+        // each slot has the page followed by the page cache's header
+        ret = sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ) returned %d", ret);
+            return -1;
+        }
+
+        const int slot_size = (config->pagecache_page_size + header + 7) & ~7;
+        example_pagecache_len = (size_t)slot_size * config->pagecache_pages;
+        example_pagecache = mmap(NULL, example_pagecache_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == example_pagecache) {
+            EXAMPLE_LOG(LOG_ERR, "mmap %zu bytes: %s", example_pagecache_len, strerror(errno));
+            example_pagecache = NULL;
+            return -1;
+        }
+
+        ret = sqlite3_config(SQLITE_CONFIG_PAGECACHE, example_pagecache, slot_size, config->pagecache_pages);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_config(SQLITE_CONFIG_PAGECACHE) returned %d", ret);
+            return -1;
+        }
+    }
+
+    if (0 < config->lookaside_slots) {
+        ret = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, config->lookaside_slot_size, config->lookaside_slots);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_config(SQLITE_CONFIG_LOOKASIDE) returned %d", ret);
+            return -1;
+        }
+    }
+
+    ret = sqlite3_initialize();
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_initialize returned %d", ret);
+        return -1;
+    }
+
+    // these return the previous limit and can't fail; the hard limit first,
+    // since the soft one is capped at it
+    if (0 < config->hard_heap_limit) {
+        (void)sqlite3_hard_heap_limit64(config->hard_heap_limit);
+    }
+    if (0 < config->soft_heap_limit) {
+        (void)sqlite3_soft_heap_limit64(config->soft_heap_limit);
+    }
+
+    return 0;
+}
+
+
+// Undo example_global_init, after the last example_deinit.
+int example_global_deinit (
+    void
+)
+{
+
+    int ret = 0;
+
+    ret = sqlite3_shutdown();
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_shutdown returned %d", ret);
+        return -1;
+    }
+
+    if (NULL != example_pagecache) {
+        munmap(example_pagecache, example_pagecache_len);
+        example_pagecache = NULL;
+    }
+
+    example_alloc_flush(&example_alloc_cache);
+
+    return 0;
+}
+
+
+int example_init (
+    struct example_s * example,
+    const struct example_config_s * config
+)
+{
+
+    int ret = 0;
+    char * err = NULL;
+    struct example_settings_s settings = {0};
+
+    ret = sqlite3_initialize();
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_initialize returned %d", ret);
+        return -1;
+    }
+
+
+    if (config->vfs) {
+        ret = example_vfs_register(config->readahead);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_vfs_register returned -1");
+            return -1;
+        }
+    }
+
+
+    // open database, create it if it doesn't exist
+    // useful flags: SQLITE_OPEN_READONLY, SQLITE_OPEN_READWRITE, SQLITE_OPEN_CREATE, SQLITE_OPEN_MEMORY
+    ret = sqlite3_open_v2(
+        /* path = */ config->path,
+        /* db = */ &example->db,
+        /* flags = */ config->open_flags,
+        /* vfs = */ config->vfs ? "example" : NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_open_v2 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+
+    // before anything has been allocated from the default lookaside
+    if (0 < config->lookaside_slots) {
+        ret = sqlite3_db_config(
+            /* db = */ example->db,
+            /* op = */ SQLITE_DBCONFIG_LOOKASIDE,
+            /* buf = */ NULL,
+            /* slot_size = */ config->lookaside_slot_size,
+            /* slots = */ config->lookaside_slots
+        );
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_db_config(SQLITE_DBCONFIG_LOOKASIDE) returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+            return -1;
+        }
+    }
+
+
+    ret = sqlite3_busy_timeout(example->db, config->busy_timeout_ms);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_busy_timeout returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+
+    // enable foreign keys
+    ret = sqlite3_exec(
+        /* db = */ example->db,
+        /* sql = */ "pragma foreign_keys=1;",
+        /* cb = */ NULL,
+        /* user_data = */ NULL,
+        /* err = */ &err
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        return -1;
+    }
+
+
+    // journal, synchronous and cache settings
+    ret = example_init_pragmas(example, config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_pragmas returned -1");
+        return -1;
+    }
+
+
+    // file growth; after page_size, so the size hint is in whole pages
+    ret = example_init_file_controls(example, config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_file_controls returned -1");
+        return -1;
+    }
+
+
+    // packed or text deviceids; this decides on the schema below. An
+    // existing database decides for itself, so the check comes after.
+    ret = example_deviceid_mode_init(example, config->deviceid_packed);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_deviceid_mode_init returned -1");
+        return -1;
+    }
+
+    if (example->deviceid_packed && 0 != config->state_hash_capacity) {
+        EXAMPLE_LOG(LOG_ERR, "packed deviceids don't go with state_hash_capacity");
+        return -1;
+    }
+
+
+    // migrate schema to current schema version; that's the writer's job.
+    if (!config->readonly) {
+        ret = example_init_schema_migration(example);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_init_schema_migration returned -1");
+            return -1;
+        }
+    }
+
+
+    // time functions; state.measured uses now_monotonic() as a default, so
+    // these need to be in place before anything is inserted there.
+    ret = example_init_custom_now_monotonic_function(example, config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_custom_now_monotonic_function returned -1");
+        return -1;
+    }
+
+    // called by the triggers on state.measured
+    ret = example_init_custom_evicting_function(example);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_custom_evicting_function returned -1");
+        return -1;
+    }
+
+
+    // attach in-memory database on top and set up schemas
+    ret = example_init_schema_memory(example, config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_schema_memory returned -1");
+        return -1;
+    }
+
+
+
+    // create custom aggregate function
+    ret = example_init_custom_agg_function(example);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_custom_agg_function returned -1");
+        return -1;
+    }
+
+
+    // prepare the statement cache; this needs to happen last since the
+    // statements refer to the schemas and functions set up above.
+    ret = example_init_stmts(example);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_stmts returned -1");
+        return -1;
+    }
+
+
+    // log what we actually ended up with, so that each deployment can be
+    // checked against its config.
+    ret = example_settings_get(example, &settings);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_settings_get returned -1");
+        return -1;
+    }
+    EXAMPLE_LOG(LOG_INFO, "journal_mode=%s synchronous=%d mmap_size=%lld cache_size=%lld page_size=%d foreign_keys=%d "
+            "auto_vacuum=%d",
+            settings.journal_mode, settings.synchronous,
+            (long long)settings.mmap_size, (long long)settings.cache_size, settings.page_size,
+            settings.foreign_keys, settings.auto_vacuum);
+
+
+    return 0;
+}
+
+
+// Finalize the statement cache and close the database. Safe to call on a
+// partially initialized struct example_s.
+void example_deinit (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+
+    for (int i = 0; i < EXAMPLE_STMT_MAX; i++) {
+        // sqlite3_finalize on a NULL statement is a harmless no-op
+        (void)sqlite3_finalize(example->stmts[i]);
+        example->stmts[i] = NULL;
+    }
+
+    ret = sqlite3_close_v2(example->db);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_close_v2 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+    }
+    example->db = NULL;
+
+    example_hash_release(example->state_measured);
+    example_hash_release(example->state_setpoint);
+    example->state_measured = NULL;
+    example->state_setpoint = NULL;
+
+    // sqlite may read from the mapping up until the database is closed
+    if (NULL != example->restore_map) {
+        munmap(example->restore_map, example->restore_map_len);
+        example->restore_map = NULL;
+        example->restore_map_len = 0;
+    }
+}
+
+
+
+// Open the writer and readers_len reader connections. The writer is opened
+// first with config as-is, so that the schemas exist before the readers
+// attach to them. On error, whatever was opened is closed again.
+int example_pool_init (
+    struct example_pool_s * pool,
+    const struct example_config_s * config,
+    const uint32_t readers_len
+)
+{
+
+    int ret = 0;
+    struct example_config_s reader_config = *config;
+
+    if (EXAMPLE_POOL_READERS_MAX < readers_len) {
+        EXAMPLE_LOG(LOG_ERR, "readers_len=%u is larger than EXAMPLE_POOL_READERS_MAX=%d",
+                readers_len, EXAMPLE_POOL_READERS_MAX);
+        return -1;
+    }
+
+    ret = pthread_mutex_init(&pool->writer_lock, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_mutex_init returned %d", ret);
+        return -1;
+    }
+
+    ret = pthread_mutex_init(&pool->readers_lock, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_mutex_init returned %d", ret);
+        goto destroy_writer_lock;
+    }
+
+    ret = pthread_cond_init(&pool->readers_cond, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_cond_init returned %d", ret);
+        goto destroy_readers_lock;
+    }
+
+    ret = example_init(&pool->writer, config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(&pool->writer);
+        goto destroy_readers_cond;
+    }
+
+    reader_config.readonly = true;
+    reader_config.open_flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX
+                             | (config->open_flags & SQLITE_OPEN_URI);
+
+    for (uint32_t i = 0; i < readers_len; i++) {
+        ret = example_init(&pool->readers[i], &reader_config);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_init returned -1 on reader %u", i);
+            // the readers first, as in example_pool_deinit
+            for (uint32_t j = 0; j <= i; j++) {
+                example_deinit(&pool->readers[j]);
+            }
+            example_deinit(&pool->writer);
+            goto destroy_readers_cond;
+        }
+        pool->readers_busy[i] = false;
+    }
+    pool->readers_len = readers_len;
+
+    pool->sentinel = EXAMPLE_POOL_SENTINEL;
+
+    return 0;
+
+destroy_readers_cond:
+    pthread_cond_destroy(&pool->readers_cond);
+destroy_readers_lock:
+    pthread_mutex_destroy(&pool->readers_lock);
+destroy_writer_lock:
+    pthread_mutex_destroy(&pool->writer_lock);
+    return -1;
+}
+
+
+// Close all connections; nothing may be checked out.
+void example_pool_deinit (
+    struct example_pool_s * pool
+)
+{
+    // close the readers first; a named memdb goes away with the last
+    // connection that has it open, and there's no point in keeping it around
+    // for the readers only.
+    for (uint32_t i = 0; i < pool->readers_len; i++) {
+        example_deinit(&pool->readers[i]);
+    }
+    pool->readers_len = 0;
+
+    example_deinit(&pool->writer);
+
+    if (EXAMPLE_POOL_SENTINEL == pool->sentinel) {
+        pthread_cond_destroy(&pool->readers_cond);
+        pthread_mutex_destroy(&pool->readers_lock);
+        pthread_mutex_destroy(&pool->writer_lock);
+    }
+    pool->sentinel = 0;
+}
+
+
+// There's only one writer; checking it out serializes all writes in the
+// process, which is what sqlite would do anyway.
+struct example_s * example_pool_writer_checkout (
+    struct example_pool_s * pool
+)
+{
+    pthread_mutex_lock(&pool->writer_lock);
+    return &pool->writer;
+}
+
+
+void example_pool_writer_checkin (
+    struct example_pool_s * pool,
+    struct example_s * writer
+)
+{
+    pthread_mutex_unlock(&pool->writer_lock);
+    (void)writer;
+}
+
+
+// Check out a reader, blocking until one is free. If the pool has no readers
+// the writer is handed out instead, so callers don't have to care; check it
+// back in with example_pool_reader_checkin all the same.
+struct example_s * example_pool_reader_checkout (
+    struct example_pool_s * pool
+)
+{
+
+    struct example_s * reader = NULL;
+
+    if (0 == pool->readers_len) {
+        return example_pool_writer_checkout(pool);
+    }
+
+    pthread_mutex_lock(&pool->readers_lock);
+    while (NULL == reader) {
+        for (uint32_t i = 0; i < pool->readers_len; i++) {
+            if (!pool->readers_busy[i]) {
+                pool->readers_busy[i] = true;
+                reader = &pool->readers[i];
+                break;
+            }
+        }
+        if (NULL == reader) {
+            pthread_cond_wait(&pool->readers_cond, &pool->readers_lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->readers_lock);
+
+    return reader;
+}
+
+
+void example_pool_reader_checkin (
+    struct example_pool_s * pool,
+    struct example_s * reader
+)
+{
+
+    if (&pool->writer == reader) {
+        example_pool_writer_checkin(pool, reader);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->readers_lock);
+    pool->readers_busy[reader - pool->readers] = false;
+    pthread_cond_signal(&pool->readers_cond);
+    pthread_mutex_unlock(&pool->readers_lock);
+}
+
+
+// Pack 12 lowercase hex digits (which includes 12 decimal digits) into the 48
+// bit integer they spell. Returns -1 for anything else; those ids can't be
+// stored in a database with packed deviceids.
+int example_deviceid_pack (
+    const char * const deviceid,
+    const uint32_t deviceid_len,
+    int64_t * packed
+)
+{
+
+    int64_t value = 0;
+
+    if (12 != deviceid_len) {
+        return -1;
+    }
+
+    for (int i = 0; i < 12; i++) {
+        const char c = deviceid[i];
+        if ('0' <= c && c <= '9') {
+            value = (value << 4) | (c - '0');
+        } else if ('a' <= c && c <= 'f') {
+            value = (value << 4) | (c - 'a' + 10);
+        } else {
+            return -1;
+        }
+    }
+
+    *packed = value;
+
+    return 0;
+}
+
+
+void example_deviceid_unpack (
+    int64_t packed,
+    char deviceid[12]
+)
+{
+    static const char digits[16] = "0123456789abcdef";
+
+    for (int i = 11; 0 <= i; i--) {
+        deviceid[i] = digits[packed & 0xf];
+        packed >>= 4;
+    }
+}
+
+
+// Bind a deviceid the way the database stores it: as text, or with packed
+// deviceids as an integer, see example_deviceid_pack. Returns an sqlite3
+// result code like the sqlite3_bind_* functions, SQLITE_MISMATCH for an id
+// which doesn't pack. Text is bound with SQLITE_STATIC.
+int example_bind_deviceid (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    int index,
+    const char * const deviceid,
+    const uint32_t deviceid_len
+)
+{
+
+    int64_t packed = 0;
+
+    if (!example->deviceid_packed) {
+        return sqlite3_bind_text(stmt, index, deviceid, deviceid_len, SQLITE_STATIC);
+    }
+
+    if (-1 == example_deviceid_pack(deviceid, deviceid_len, &packed)) {
+        return SQLITE_MISMATCH;
+    }
+
+    return sqlite3_bind_int64(stmt, index, packed);
+}
+
+
+// Read a deviceid column back into its 12 characters, which aren't
+// nul-terminated. Returns -1 if the column isn't a deviceid.
+int example_column_deviceid (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    int column,
+    char deviceid[12]
+)
+{
+
+    if (example->deviceid_packed) {
+        if (SQLITE_INTEGER != sqlite3_column_type(stmt, column)) {
+            return -1;
+        }
+        example_deviceid_unpack(sqlite3_column_int64(stmt, column), deviceid);
+        return 0;
+    }
+
+    const unsigned char * text = sqlite3_column_text(stmt, column);
+    if (NULL == text || 12 != sqlite3_column_bytes(stmt, column)) {
+        return -1;
+    }
+    memcpy(deviceid, text, 12);
+
+    return 0;
+}
+
+
+// The typed wrappers of each cached statement in EXAMPLE_STMTS:
+//
+// example_stmt_<name>_bind binds all parameters, in the types of the
+// statement's list, e.g. for EXAMPLE_STMT_OUTPUT_NEW a deviceid, its length
+// and an outputid. Anything bound with SQLITE_STATIC must live until the
+// statement is released. On error the statement is released and -1 returned.
+//
+// example_stmt_<name>_step steps it, and with a row stores its columns
+// through the pointers; a NULL pointer skips a column. Returns 1 with a row,
+// 0 when the statement is done and -1 on error; at 0 and -1 the statement has
+// been released, at 1 the caller releases it if it doesn't step on to the end.
+//
+// example_stmt_<name>_run binds and steps a statement which doesn't return
+// rows, e.g. an insert, and releases it.
+#define EXAMPLE_STMT_PARAM_DECL(type, name) EXAMPLE_STMT_PARAM_DECL_##type(name)
+#define EXAMPLE_STMT_PARAM_DECL_d(name) , const char * name, const uint32_t name##_len
+#define EXAMPLE_STMT_PARAM_DECL_i(name) , const int32_t name
+#define EXAMPLE_STMT_PARAM_DECL_I(name) , const int64_t name
+#define EXAMPLE_STMT_PARAM_DECL_b(name) , const bool name
+#define EXAMPLE_STMT_PARAM_DECL_n(name) , const int32_t * name
+#define EXAMPLE_STMT_PARAM_DECL_N(name) , const int64_t * name
+#define EXAMPLE_STMT_PARAM_DECL_t(name) , const char * name
+
+#define EXAMPLE_STMT_PARAM_ARG(type, name) EXAMPLE_STMT_PARAM_ARG_##type(name)
+#define EXAMPLE_STMT_PARAM_ARG_d(name) , name, name##_len
+#define EXAMPLE_STMT_PARAM_ARG_i(name) , name
+#define EXAMPLE_STMT_PARAM_ARG_I(name) , name
+#define EXAMPLE_STMT_PARAM_ARG_b(name) , name
+#define EXAMPLE_STMT_PARAM_ARG_n(name) , name
+#define EXAMPLE_STMT_PARAM_ARG_N(name) , name
+#define EXAMPLE_STMT_PARAM_ARG_t(name) , name
+
+#define EXAMPLE_STMT_PARAM_BIND(type, name) \
+    if (SQLITE_OK == ret) { \
+        param++; \
+        ret = EXAMPLE_STMT_PARAM_BIND_##type(name); \
+    }
+#define EXAMPLE_STMT_PARAM_BIND_d(name) example_bind_deviceid(example, stmt, param, name, name##_len)
+#define EXAMPLE_STMT_PARAM_BIND_i(name) sqlite3_bind_int(stmt, param, name)
+#define EXAMPLE_STMT_PARAM_BIND_I(name) sqlite3_bind_int64(stmt, param, name)
+#define EXAMPLE_STMT_PARAM_BIND_b(name) sqlite3_bind_int(stmt, param, name)
+#define EXAMPLE_STMT_PARAM_BIND_n(name) \
+    (NULL == name ? sqlite3_bind_null(stmt, param) : sqlite3_bind_int(stmt, param, *name))
+#define EXAMPLE_STMT_PARAM_BIND_N(name) \
+    (NULL == name ? sqlite3_bind_null(stmt, param) : sqlite3_bind_int64(stmt, param, *name))
+#define EXAMPLE_STMT_PARAM_BIND_t(name) sqlite3_bind_text(stmt, param, name, -1, SQLITE_STATIC)
+
+#define EXAMPLE_STMT_COLUMN_DECL(type, name) EXAMPLE_STMT_COLUMN_DECL_##type(name)
+#define EXAMPLE_STMT_COLUMN_DECL_d(name) , char * name
+#define EXAMPLE_STMT_COLUMN_DECL_i(name) , int32_t * name
+#define EXAMPLE_STMT_COLUMN_DECL_I(name) , int64_t * name
+#define EXAMPLE_STMT_COLUMN_DECL_b(name) , uint8_t * name
+#define EXAMPLE_STMT_COLUMN_DECL_n(name) , int32_t * name, uint8_t * name##_null
+#define EXAMPLE_STMT_COLUMN_DECL_N(name) , int64_t * name, uint8_t * name##_null
+#define EXAMPLE_STMT_COLUMN_DECL_t(name) , const unsigned char ** name
+
+#define EXAMPLE_STMT_COLUMN_SKIP(type, name) EXAMPLE_STMT_COLUMN_SKIP_##type
+#define EXAMPLE_STMT_COLUMN_SKIP_d , NULL
+#define EXAMPLE_STMT_COLUMN_SKIP_i , NULL
+#define EXAMPLE_STMT_COLUMN_SKIP_I , NULL
+#define EXAMPLE_STMT_COLUMN_SKIP_b , NULL
+#define EXAMPLE_STMT_COLUMN_SKIP_n , NULL, NULL
+#define EXAMPLE_STMT_COLUMN_SKIP_N , NULL, NULL
+#define EXAMPLE_STMT_COLUMN_SKIP_t , NULL
+
+#define EXAMPLE_STMT_COLUMN_READ(type, name) \
+    EXAMPLE_STMT_COLUMN_READ_##type(name) \
+    column++;
+#define EXAMPLE_STMT_COLUMN_READ_d(name) \
+    if (NULL != name && -1 == example_column_deviceid(example, stmt, column, name)) { \
+        EXAMPLE_LOG(LOG_ERR, "column %d of \"%s\" is not a deviceid", column, sqlite3_sql(stmt)); \
+        example_stmt_release(stmt); \
+        return -1; \
+    }
+#define EXAMPLE_STMT_COLUMN_READ_i(name) \
+    if (NULL != name) { \
+        *name = sqlite3_column_int(stmt, column); \
+    }
+#define EXAMPLE_STMT_COLUMN_READ_I(name) \
+    if (NULL != name) { \
+        *name = sqlite3_column_int64(stmt, column); \
+    }
+#define EXAMPLE_STMT_COLUMN_READ_b(name) \
+    if (NULL != name) { \
+        *name = 0 != sqlite3_column_int(stmt, column); \
+    }
+#define EXAMPLE_STMT_COLUMN_READ_n(name) \
+    EXAMPLE_STMT_COLUMN_READ_i(name) \
+    if (NULL != name##_null) { \
+        *name##_null = SQLITE_NULL == sqlite3_column_type(stmt, column); \
+    }
+#define EXAMPLE_STMT_COLUMN_READ_N(name) \
+    EXAMPLE_STMT_COLUMN_READ_I(name) \
+    if (NULL != name##_null) { \
+        *name##_null = SQLITE_NULL == sqlite3_column_type(stmt, column); \
+    }
+#define EXAMPLE_STMT_COLUMN_READ_t(name) \
+    if (NULL != name) { \
+        *name = sqlite3_column_text(stmt, column); \
+    }
+
+#define EXAMPLE_STMT_WRAPPERS(NAME, name) \
+    static inline int example_stmt_##name##_bind ( \
+        struct example_s * example \
+        EXAMPLE_STMT_##NAME##_PARAMS(EXAMPLE_STMT_PARAM_DECL) \
+    ) \
+    { \
+        int ret = SQLITE_OK; \
+        int param = 0; \
+        sqlite3_stmt * stmt = example->stmts[EXAMPLE_STMT_##NAME]; \
+        EXAMPLE_STMT_##NAME##_PARAMS(EXAMPLE_STMT_PARAM_BIND) \
+        if (SQLITE_OK != ret) { \
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_bind of parameter %d returned %d on \"%s\": %s", \
+                param, ret, sqlite3_sql(stmt), sqlite3_errmsg(example->db)); \
+            example_stmt_release(stmt); \
+            return -1; \
+        } \
+        return 0; \
+    } \
+    \
+    static inline int example_stmt_##name##_step ( \
+        struct example_s * example \
+        EXAMPLE_STMT_##NAME##_COLUMNS(EXAMPLE_STMT_COLUMN_DECL) \
+    ) \
+    { \
+        int ret = 0; \
+        int column = 0; \
+        sqlite3_stmt * stmt = example->stmts[EXAMPLE_STMT_##NAME]; \
+        ret = sqlite3_step(stmt); \
+        if (SQLITE_DONE == ret) { \
+            example_stmt_release(stmt); \
+            return 0; \
+        } \
+        if (SQLITE_ROW != ret) { \
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d on \"%s\": %s", \
+                ret, sqlite3_sql(stmt), sqlite3_errmsg(example->db)); \
+            example_stmt_release(stmt); \
+            return -1; \
+        } \
+        EXAMPLE_STMT_##NAME##_COLUMNS(EXAMPLE_STMT_COLUMN_READ) \
+        (void)column; \
+        return 1; \
+    } \
+    \
+    static inline int example_stmt_##name##_run ( \
+        struct example_s * example \
+        EXAMPLE_STMT_##NAME##_PARAMS(EXAMPLE_STMT_PARAM_DECL) \
+    ) \
+    { \
+        int ret = 0; \
+        ret = example_stmt_##name##_bind(example EXAMPLE_STMT_##NAME##_PARAMS(EXAMPLE_STMT_PARAM_ARG)); \
+        if (-1 == ret) { \
+            return -1; \
+        } \
+        ret = example_stmt_##name##_step(example EXAMPLE_STMT_##NAME##_COLUMNS(EXAMPLE_STMT_COLUMN_SKIP)); \
+        if (1 == ret) { \
+            EXAMPLE_LOG(LOG_ERR, "\"%s\" returned a row", sqlite3_sql(example->stmts[EXAMPLE_STMT_##NAME])); \
+            example_stmt_release(example->stmts[EXAMPLE_STMT_##NAME]); \
+            return -1; \
+        } \
+        return ret; \
+    }
+
+EXAMPLE_STMTS(EXAMPLE_STMT_WRAPPERS)
+
+
+int example_device_new (
+    struct example_s * example,
+    const char * const deviceid,
+    const uint32_t deviceid_len
+)
+{
+
+    int ret = 0;
+
+
+    // bind, execute and release; the deviceid is bound with SQLITE_STATIC, so
+    // the binding must not outlive this call.
+    ret = example_stmt_device_new_run(
+        /* example = */ example,
+        /* deviceid = */ deviceid,
+        /* deviceid_len = */ deviceid_len
+    );
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_device_new_run returned -1");
+        return -1;
+    }
+
+
+    return 0;
+}
+
+
+// Step a cached statement which doesn't return any rows, e.g. begin or
+// commit.
+int example_stmt_exec (
+    struct example_s * example,
+    const enum example_stmt_e id
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = example->stmts[id];
+
+    ret = sqlite3_step(stmt);
+    if (SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d on \"%s\": %s",
+                ret, sqlite3_sql(stmt), sqlite3_errmsg(example->db));
+        example_stmt_release(stmt);
+        return -1;
+    }
+
+    example_stmt_release(stmt);
+
+    return 0;
+}
+
+
+// Run one of the cached foreign_key_check statements and record what it finds
+// in batch->violations. Returns the number of violations, or -1 on error.
+int example_fk_check (
+    struct example_s * example,
+    enum example_stmt_e id,
+    struct example_batch_s * batch
+)
+{
+
+    int ret = 0;
+    int violations = 0;
+    const unsigned char * table = NULL;
+    const unsigned char * parent = NULL;
+    int64_t rowid = 0;
+    uint8_t rowid_null = 0;
+    int32_t fkid = 0;
+    // the two have the same columns
+    int (*step)(struct example_s *, const unsigned char **, int64_t *, uint8_t *, const unsigned char **, int32_t *) =
+        EXAMPLE_STMT_FOREIGN_KEY_CHECK_GROUPS == id
+            ? example_stmt_foreign_key_check_groups_step
+            : example_stmt_foreign_key_check_outputs_step;
+
+    while (1 == (ret = step(example, &table, &rowid, &rowid_null, &parent, &fkid))) {
+        if (batch->violations_len < batch->violations_cap) {
+            struct example_fk_violation_s * violation = &batch->violations[batch->violations_len];
+            snprintf(violation->table, sizeof(violation->table), "%s", NULL == table ? "" : (const char *)table);
+            snprintf(violation->parent, sizeof(violation->parent), "%s", NULL == parent ? "" : (const char *)parent);
+            violation->rowid = rowid_null ? -1 : rowid;
+            violation->fkid = fkid;
+        }
+        batch->violations_len += 1;
+        violations += 1;
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "step returned -1");
+        return -1;
+    }
+
+    return violations;
+}
+
+
+// Insert rows [0, n) using the cached statement stmt, batch->batch_size rows
+// per transaction. The bind callback binds row i of rows to the statement.
+//
+// Rows which violate a constraint are recorded in batch->rejects; the rest of
+// the batch is still stepped so that every rejected row in it is reported,
+// and then the whole batch is rolled back and no further batches are tried.
+// Returns -1 if any batch was rolled back, in which case batch->committed is
+// the number of leading rows that made it into the database.
+//
+// With batch->fk_deferred, the foreign_key_check statement fk_check (or none
+// with EXAMPLE_STMT_MAX) runs before each commit instead; foreign keys have
+// already been turned off by example_insert_batch.
+int example_insert_batch_run (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    const void * rows,
+    const uint32_t n,
+    int (*bind)(struct example_s * example, sqlite3_stmt * stmt, const void * rows, uint32_t i),
+    enum example_stmt_e fk_check,
+    struct example_batch_s * batch
+)
+{
+
+    int ret = 0;
+    const uint32_t batch_size = (0 == batch->batch_size) ? n : batch->batch_size;
+
+    batch->rejects_len = 0;
+    batch->violations_len = 0;
+    batch->committed = 0;
+
+    for (uint32_t start = 0; start < n; start += batch_size) {
+        const uint32_t end = (n - start < batch_size) ? n : start + batch_size;
+        bool rejected = false;
+
+        ret = example_stmt_exec(example, EXAMPLE_STMT_BEGIN);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+            return -1;
+        }
+
+        for (uint32_t i = start; i < end; i++) {
+            // a key which doesn't bind is rejected like one which fails a
+            // constraint
+            ret = bind(example, stmt, rows, i);
+            if (SQLITE_MISMATCH == ret) {
+                if (batch->rejects_len < batch->rejects_cap) {
+                    batch->rejects[batch->rejects_len].row = i;
+                    batch->rejects[batch->rejects_len].errcode = ret;
+                }
+                batch->rejects_len += 1;
+                rejected = true;
+                example_stmt_release(stmt);
+                continue;
+            }
+            if (SQLITE_OK != ret) {
+                EXAMPLE_LOG(LOG_ERR, "bind returned %d on row %u: %s",
+                    ret, i, sqlite3_errmsg(example->db));
+                example_stmt_release(stmt);
+                (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+                return -1;
+            }
+
+            ret = sqlite3_step(stmt);
+            if (SQLITE_DONE == ret) {
+                example_stmt_release(stmt);
+                continue;
+            }
+
+            // a constraint violation only aborts the statement, not the
+            // transaction, so we can keep going and find the rest of the bad
+            // rows in this batch.
+            if (SQLITE_CONSTRAINT == (ret & 0xff)) {
+                if (batch->rejects_len < batch->rejects_cap) {
+                    batch->rejects[batch->rejects_len].row = i;
+                    batch->rejects[batch->rejects_len].errcode = sqlite3_extended_errcode(example->db);
+                }
+                batch->rejects_len += 1;
+                rejected = true;
+                example_stmt_release(stmt);
+                continue;
+            }
+
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d on row %u: %s",
+                    ret, i, sqlite3_errmsg(example->db));
+            example_stmt_release(stmt);
+            (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+            return -1;
+        }
+
+        if (!rejected && batch->fk_deferred && EXAMPLE_STMT_MAX != fk_check) {
+            ret = example_fk_check(example, fk_check, batch);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_fk_check returned -1");
+                (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+                return -1;
+            }
+            if (0 < ret) {
+                EXAMPLE_LOG(LOG_INFO, "rolling back rows %u to %u, %d foreign key violations",
+                        start, end - 1, ret);
+                rejected = true;
+            }
+        }
+
+        if (rejected) {
+            EXAMPLE_LOG(LOG_INFO, "rolling back rows %u to %u, %u rows rejected",
+                    start, end - 1, batch->rejects_len);
+            ret = example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+            }
+            return -1;
+        }
+
+        ret = example_stmt_exec(example, EXAMPLE_STMT_COMMIT);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+            (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+            return -1;
+        }
+
+        batch->committed = end;
+    }
+
+    return 0;
+}
+
+
+// example_insert_batch_run, with foreign keys turned off around it for
+// batch->fk_deferred.
+int example_insert_batch (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    const void * rows,
+    const uint32_t n,
+    int (*bind)(struct example_s * example, sqlite3_stmt * stmt, const void * rows, uint32_t i),
+    enum example_stmt_e fk_check,
+    struct example_batch_s * batch
+)
+{
+
+    int ret = 0;
+
+    if (!batch->fk_deferred) {
+        return example_insert_batch_run(example, stmt, rows, n, bind, fk_check, batch);
+    }
+
+    // not a cached statement: pragma foreign_keys takes effect when it's
+    // prepared, not when it's stepped. It's a no-op inside a transaction, and
+    // the statements which insert rows are recompiled without the parent key
+    // lookups.
+    ret = example_pragma_set_int(example, "foreign_keys", 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_set_int returned -1");
+        return -1;
+    }
+
+    ret = example_insert_batch_run(example, stmt, rows, n, bind, fk_check, batch);
+
+    // every path out of example_insert_batch_run has ended its transaction,
+    // so this takes effect
+    if (-1 == example_pragma_set_int(example, "foreign_keys", 1)) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_set_int returned -1");
+        return -1;
+    }
+
+    return ret;
+}
+
+
+int example_devices_bind (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    const void * rows,
+    uint32_t i
+)
+{
+    const struct example_device_s * device = &((const struct example_device_s *)rows)[i];
+
+    return example_bind_deviceid(example, stmt, 1, device->deviceid, device->deviceid_len);
+}
+
+
+int example_outputs_bind (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    const void * rows,
+    uint32_t i
+)
+{
+    int ret = 0;
+    const struct example_output_s * output = &((const struct example_output_s *)rows)[i];
+
+    ret = example_bind_deviceid(example, stmt, 1, output->deviceid, output->deviceid_len);
+    if (SQLITE_OK != ret) {
+        return ret;
+    }
+
+    return sqlite3_bind_int(stmt, 2, output->outputid);
+}
+
+
+int example_groups_bind (
+    struct example_s * example,
+    sqlite3_stmt * stmt,
+    const void * rows,
+    uint32_t i
+)
+{
+    int ret = 0;
+    const struct example_group_s * group = &((const struct example_group_s *)rows)[i];
+
+    ret = example_bind_deviceid(example, stmt, 1, group->deviceid, group->deviceid_len);
+    if (SQLITE_OK != ret) {
+        return ret;
+    }
+
+    ret = sqlite3_bind_int(stmt, 2, group->outputid);
+    if (SQLITE_OK != ret) {
+        return ret;
+    }
+
+    return sqlite3_bind_int(stmt, 3, group->groupid);
+}
+
+
+int example_devices_insert_batch (
+    struct example_s * example,
+    const struct example_device_s * devices,
+    const uint32_t devices_len,
+    struct example_batch_s * batch
+)
+{
+    return example_insert_batch(
+        /* example = */ example,
+        /* stmt = */ example->stmts[EXAMPLE_STMT_DEVICE_NEW],
+        /* rows = */ devices,
+        /* n = */ devices_len,
+        /* bind = */ example_devices_bind,
+        /* fk_check = */ EXAMPLE_STMT_MAX,
+        /* batch = */ batch
+    );
+}
+
+
+int example_outputs_insert_batch (
+    struct example_s * example,
+    const struct example_output_s * outputs,
+    const uint32_t outputs_len,
+    struct example_batch_s * batch
+)
+{
+    return example_insert_batch(
+        /* example = */ example,
+        /* stmt = */ example->stmts[EXAMPLE_STMT_OUTPUT_NEW],
+        /* rows = */ outputs,
+        /* n = */ outputs_len,
+        /* bind = */ example_outputs_bind,
+        /* fk_check = */ EXAMPLE_STMT_FOREIGN_KEY_CHECK_OUTPUTS,
+        /* batch = */ batch
+    );
+}
+
+
+int example_groups_insert_batch (
+    struct example_s * example,
+    const struct example_group_s * groups,
+    const uint32_t groups_len,
+    struct example_batch_s * batch
+)
+{
+    return example_insert_batch(
+        /* example = */ example,
+        /* stmt = */ example->stmts[EXAMPLE_STMT_GROUP_NEW],
+        /* rows = */ groups,
+        /* n = */ groups_len,
+        /* bind = */ example_groups_bind,
+        /* fk_check = */ EXAMPLE_STMT_FOREIGN_KEY_CHECK_GROUPS,
+        /* batch = */ batch
+    );
+}
+
+
+// Delete up to rows of the least recently updated rows of state.measured,
+// oldest first through the timestamp index; see example_hash_evict for the hash
+// tables. Returns the number of rows deleted, or -1.
+int example_measured_evict (
+    struct example_s * example,
+    const uint32_t rows
+)
+{
+
+    int ret = 0;
+
+    if (NULL != example->state_measured) {
+        return example_hash_evict(example->state_measured, rows);
+    }
+
+    example->evicting = true;
+    ret = example_stmt_measured_evict_run(example, rows);
+    example->evicting = false;
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_measured_evict_run returned -1");
+        return -1;
+    }
+
+    return sqlite3_changes(example->db);
+}
+
+
+// Evict what's above config->measured_rows_max from state.measured. Returns
+// the number of rows evicted, or -1.
+int example_measured_cap (
+    struct example_s * example
+)
+{
+
+    int64_t rows = 0;
+
+    if (0 == example->measured_rows_max) {
+        return 0;
+    }
+
+    rows = example_measured_rows(example);
+    if (-1 == rows) {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_rows returned -1");
+        return -1;
+    }
+    if (rows <= example->measured_rows_max) {
+        return 0;
+    }
+
+    return example_measured_evict(example, rows - example->measured_rows_max);
+}
+
+
+// Insert or update the measured state of an output. The timestamp is
+// supplied by the caller (see example_monotonic_now), which lets a batch of
+// upserts share one clock reading instead of evaluating the now_monotonic()
+// default for each row. level is NULL for a null level.
+//
+// With skip_unchanged, a row whose state and level are the same as before is
+// left alone, including its timestamp; the timestamp then says when the
+// output last changed rather than when it was last heard from. Set
+// config->measured_heartbeat_s to have it written anyway every so often, for
+// example_measured_expire.
+//
+// If the state schema is out of memory (the hash table is full, or the
+// memdb is at config->state_size_limit or sqlite at the hard heap limit),
+// EXAMPLE_MEASURED_EVICT_ROWS of the least recently updated rows are evicted
+// and the upsert is tried again, a few times with more rows; unless the error rolled back the
+// transaction the upsert was part of, in which case it fails as it was. A row
+// which takes state.measured above config->measured_rows_max evicts the
+// least recently updated one.
+//
+// Returns EXAMPLE_MEASURED_BAD_KEY, without touching the database, for a key
+// which can't be bound: with packed deviceids one which doesn't pack, in an
+// example_hash table one which isn't 12 characters or has a negative
+// outputid. Text deviceids go to sqlite as they are and fail its checks.
+int example_measured_upsert (
+    struct example_s * example,
+    const char * const deviceid,
+    const uint32_t deviceid_len,
+    const int32_t outputid,
+    const bool state,
+    const int32_t * const level,
+    const uint64_t timestamp,
+    const bool skip_unchanged
+)
+{
+
+    int ret = 0;
+    const enum example_stmt_e id = skip_unchanged
+        ? EXAMPLE_STMT_MEASURED_UPSERT_CHANGED
+        : EXAMPLE_STMT_MEASURED_UPSERT;
+    sqlite3_stmt * stmt = example->stmts[id];
+    const int64_t heartbeat = example->measured_heartbeat;
+
+    if (NULL != example->state_measured) {
+        if (12 != deviceid_len || outputid < 0) {
+            EXAMPLE_LOG(LOG_ERR, "bad key");
+            return EXAMPLE_MEASURED_BAD_KEY;
+        }
+
+        int64_t values[EXAMPLE_HASH_VALUES_MAX];
+        values[EXAMPLE_MEASURED_TIMESTAMP] = timestamp;
+        values[EXAMPLE_MEASURED_STATE] = state;
+        values[EXAMPLE_MEASURED_LEVEL] = NULL == level ? 0 : *level;
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (0 < attempt && 0 == example_hash_evict(example->state_measured, EXAMPLE_MEASURED_EVICT_ROWS)) {
+                break;
+            }
+            ret = example_hash_put(
+                /* hash = */ example->state_measured,
+                /* deviceid = */ deviceid,
+                /* outputid = */ outputid,
+                /* values = */ values,
+                /* nulls = */ NULL == level ? 1 << EXAMPLE_MEASURED_LEVEL : 0,
+                /* unchanged_mask = */ skip_unchanged
+                    ? (1 << EXAMPLE_MEASURED_STATE) | (1 << EXAMPLE_MEASURED_LEVEL)
+                    : 0,
+                /* heartbeat = */ example->measured_heartbeat
+            );
+            if (0 == ret) {
+                break;
+            }
+        }
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_hash_put returned -1");
+            return -1;
+        }
+
+        ret = example_measured_cap(example);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_measured_cap returned -1");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int64_t packed = 0;
+    if (example->deviceid_packed && -1 == example_deviceid_pack(deviceid, deviceid_len, &packed)) {
+        EXAMPLE_LOG(LOG_ERR, "bad key");
+        return EXAMPLE_MEASURED_BAD_KEY;
+    }
+
+    // the heartbeat is only a parameter of EXAMPLE_STMT_MEASURED_UPSERT_CHANGED
+    if (skip_unchanged) {
+        ret = example_stmt_measured_upsert_changed_bind(
+            /* example = */ example,
+            /* deviceid = */ deviceid,
+            /* deviceid_len = */ deviceid_len,
+            /* outputid = */ outputid,
+            /* timestamp = */ (int64_t)timestamp,
+            /* state = */ state,
+            /* level = */ level,
+            /* heartbeat = */ 0 == heartbeat ? NULL : &heartbeat
+        );
+    } else {
+        ret = example_stmt_measured_upsert_bind(
+            /* example = */ example,
+            /* deviceid = */ deviceid,
+            /* deviceid_len = */ deviceid_len,
+            /* outputid = */ outputid,
+            /* timestamp = */ (int64_t)timestamp,
+            /* state = */ state,
+            /* level = */ level
+        );
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_measured_upsert_bind returned -1");
+        return -1;
+    }
+
+    // the space freed by a delete isn't necessarily where the insert needs
+    // it, so each try evicts twice as many rows
+    const bool in_transaction = !sqlite3_get_autocommit(example->db);
+    ret = sqlite3_step(stmt);
+    for (uint32_t evict = EXAMPLE_MEASURED_EVICT_ROWS;
+        (SQLITE_FULL == ret || SQLITE_NOMEM == ret) && evict <= 4 * EXAMPLE_MEASURED_EVICT_ROWS
+            && in_transaction == !sqlite3_get_autocommit(example->db);
+        evict *= 2)
+    {
+        // sqlite3_reset keeps the bindings
+        EXAMPLE_LOG(LOG_WARNING, "sqlite3_step returned %d, evicting %u rows of state.measured",
+            ret, evict);
+        sqlite3_reset(stmt);
+        if (0 >= example_measured_evict(example, evict)) {
+            break;
+        }
+        ret = sqlite3_step(stmt);
+    }
+    if (SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+        example_stmt_release(stmt);
+        return -1;
+    }
+
+    example_stmt_release(stmt);
+
+    ret = example_measured_cap(example);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_cap returned -1");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Push a measurement into the write pipeline from any thread. Returns -1
+// without blocking if the ring is full.
+int example_writer_push (
+    struct example_writer_s * writer,
+    const struct example_measurement_s * measurement
+)
+{
+
+    struct example_writer_cell_s * cell = NULL;
+    uint64_t pos = atomic_load_explicit(&writer->head, memory_order_relaxed);
+
+    for (;;) {
+        cell = &writer->ring[pos & (EXAMPLE_WRITER_RING_LEN - 1)];
+        const uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        const int64_t diff = (int64_t)seq - (int64_t)pos;
+
+        // the cell is free for this lap; try to claim it
+        if (0 == diff) {
+            if (atomic_compare_exchange_weak_explicit(&writer->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+            continue;
+        }
+
+        // the cell still holds a measurement from the previous lap; the
+        // writer thread hasn't caught up.
+        if (diff < 0) {
+            atomic_fetch_add_explicit(&writer->dropped, 1, memory_order_relaxed);
+            return -1;
+        }
+
+        // another producer claimed the cell first
+        pos = atomic_load_explicit(&writer->head, memory_order_relaxed);
+    }
+
+    cell->measurement = *measurement;
+
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+
+// Pop up to EXAMPLE_WRITER_BATCH_MAX measurements into writer->batch,
+// keeping only the last measurement for each (deviceid, outputid). Only
+// called from the writer thread.
+void example_writer_drain (
+    struct example_writer_s * writer
+)
+{
+
+    writer->batch_len = 0;
+    memset(writer->coalesce, 0, sizeof(writer->coalesce));
+
+    for (uint32_t i = 0; i < EXAMPLE_WRITER_BATCH_MAX; i++) {
+        struct example_writer_cell_s * cell = &writer->ring[writer->tail & (EXAMPLE_WRITER_RING_LEN - 1)];
+        const uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq != writer->tail + 1) {
+            // empty, or a producer is still filling in the cell
+            break;
+        }
+
+        const struct example_measurement_s * measurement = &cell->measurement;
+
+        // FNV-1a over the key
+        uint32_t hash = 2166136261u;
+        for (int j = 0; j < 12; j++) {
+            hash = (hash ^ (uint8_t)measurement->deviceid[j]) * 16777619u;
+        }
+        hash = (hash ^ (uint32_t)measurement->outputid) * 16777619u;
+
+        // the coalesce table holds batch index + 1, 0 means empty
+        uint32_t slot = hash & (EXAMPLE_WRITER_COALESCE_LEN - 1);
+        for (;;) {
+            const uint16_t idx = writer->coalesce[slot];
+            if (0 == idx) {
+                writer->coalesce[slot] = writer->batch_len + 1;
+                writer->batch[writer->batch_len++] = *measurement;
+                break;
+            }
+            struct example_measurement_s * prev = &writer->batch[idx - 1];
+            if (prev->outputid == measurement->outputid &&
+                0 == memcmp(prev->deviceid, measurement->deviceid, sizeof(prev->deviceid)))
+            {
+                *prev = *measurement;
+                break;
+            }
+            slot = (slot + 1) & (EXAMPLE_WRITER_COALESCE_LEN - 1);
+        }
+
+        atomic_store_explicit(&cell->seq, writer->tail + EXAMPLE_WRITER_RING_LEN, memory_order_release);
+        writer->tail += 1;
+    }
+}
+
+
+// Apply writer->batch in one transaction. Rows rejected by a constraint, or
+// with a key example_measured_upsert can't bind, are counted and skipped;
+// unlike example_insert_batch they don't take the rest of the batch down with
+// them, since the measurements are independent.
+int example_writer_apply (
+    struct example_writer_s * writer
+)
+{
+
+    int ret = 0;
+    uint32_t rejected = 0;
+    uint64_t now = 0;
+    struct example_s * example = NULL;
+
+    // one clock reading for every measurement in the batch that doesn't have
+    // a timestamp of its own
+    ret = example_monotonic_now(writer->pool->writer.clock_id, &now);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_monotonic_now returned -1");
+        return -1;
+    }
+
+    example = example_pool_writer_checkout(writer->pool);
+
+    ret = example_stmt_exec(example, EXAMPLE_STMT_BEGIN);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+        example_pool_writer_checkin(writer->pool, example);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < writer->batch_len; i++) {
+        const struct example_measurement_s * measurement = &writer->batch[i];
+
+        ret = example_measured_upsert(
+            /* example = */ example,
+            /* deviceid = */ measurement->deviceid,
+            /* deviceid_len = */ sizeof(measurement->deviceid),
+            /* outputid = */ measurement->outputid,
+            /* state = */ measurement->state,
+            /* level = */ measurement->level_null ? NULL : &measurement->level,
+            /* timestamp = */ 0 == measurement->timestamp ? now : measurement->timestamp,
+            /* skip_unchanged = */ writer->skip_unchanged
+        );
+        if (EXAMPLE_MEASURED_BAD_KEY == ret) {
+            rejected += 1;
+        } else if (-1 == ret) {
+            if (SQLITE_CONSTRAINT != sqlite3_errcode(example->db)) {
+                EXAMPLE_LOG(LOG_ERR, "example_measured_upsert returned -1");
+                goto rollback;
+            }
+            rejected += 1;
+        }
+    }
+
+    ret = example_stmt_exec(example, EXAMPLE_STMT_COMMIT);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+        goto rollback;
+    }
+
+    example_pool_writer_checkin(writer->pool, example);
+
+    atomic_fetch_add_explicit(&writer->applied, writer->batch_len - rejected, memory_order_relaxed);
+    atomic_fetch_add_explicit(&writer->rejected, rejected, memory_order_relaxed);
+
+    return 0;
+
+rollback:
+    (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+    example_pool_writer_checkin(writer->pool, example);
+    atomic_fetch_add_explicit(&writer->failed, writer->batch_len, memory_order_relaxed);
+    return -1;
+}
+
+
+void * example_writer_thread (
+    void * arg
+)
+{
+
+    int ret = 0;
+    struct example_writer_s * writer = arg;
+    const struct timespec poll_interval = {
+        .tv_sec = writer->poll_interval_us / 1000000,
+        .tv_nsec = (writer->poll_interval_us % 1000000) * 1000
+    };
+
+    for (;;) {
+        example_writer_drain(writer);
+
+        if (0 == writer->batch_len) {
+            // only stop once the ring has been emptied
+            if (!atomic_load_explicit(&writer->running, memory_order_acquire)) {
+                break;
+            }
+            nanosleep(&poll_interval, NULL);
+            continue;
+        }
+
+        ret = example_writer_apply(writer);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_writer_apply returned -1, dropped %u measurements",
+                    writer->batch_len);
+        }
+    }
+
+    return NULL;
+}
+
+
+// Start the writer thread. The writer struct is large (the ring is inline),
+// so it's best kept in static storage or on the heap. See
+// example_measured_upsert for skip_unchanged.
+int example_writer_start (
+    struct example_writer_s * writer,
+    struct example_pool_s * pool,
+    const uint32_t poll_interval_us,
+    const bool skip_unchanged
+)
+{
+
+    int ret = 0;
+
+    writer->pool = pool;
+    writer->poll_interval_us = poll_interval_us;
+    writer->skip_unchanged = skip_unchanged;
+    writer->tail = 0;
+    atomic_init(&writer->head, 0);
+    atomic_init(&writer->dropped, 0);
+    atomic_init(&writer->applied, 0);
+    atomic_init(&writer->rejected, 0);
+    atomic_init(&writer->failed, 0);
+    atomic_init(&writer->running, true);
+
+    for (uint32_t i = 0; i < EXAMPLE_WRITER_RING_LEN; i++) {
+        atomic_init(&writer->ring[i].seq, i);
+    }
+
+    ret = pthread_create(&writer->thread, NULL, example_writer_thread, writer);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_create returned %d", ret);
+        return -1;
+    }
+
+    writer->sentinel = EXAMPLE_WRITER_SENTINEL;
+
+    return 0;
+}
+
+
+// Stop the writer thread after it has applied everything pushed so far. No
+// producer may push concurrently with or after this call.
+int example_writer_stop (
+    struct example_writer_s * writer
+)
+{
+
+    int ret = 0;
+
+    if (EXAMPLE_WRITER_SENTINEL != writer->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "writer is not running");
+        return -1;
+    }
+
+    atomic_store_explicit(&writer->running, false, memory_order_release);
+
+    ret = pthread_join(writer->thread, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_join returned %d", ret);
+        return -1;
+    }
+
+    writer->sentinel = 0;
+
+    return 0;
+}
+
+
+int example_query_open (
+    struct example_query_s * query,
+    struct example_s * example,
+    enum example_stmt_e id
+)
+{
+
+    if (EXAMPLE_STMT_MAX <= id || NULL == example->stmts[id]) {
+        EXAMPLE_LOG(LOG_ERR, "no cached statement %d", id);
+        return -1;
+    }
+
+    if (EXAMPLE_QUERY_COLUMNS_MAX < sqlite3_column_count(example->stmts[id])) {
+        EXAMPLE_LOG(LOG_ERR, "statement %d has %d columns, more than %d",
+            id, sqlite3_column_count(example->stmts[id]), EXAMPLE_QUERY_COLUMNS_MAX);
+        return -1;
+    }
+
+    *query = (struct example_query_s){
+        .sentinel = EXAMPLE_QUERY_SENTINEL,
+        .example = example,
+        .stmt = example->stmts[id],
+        .cached = true
+    };
+
+    return 0;
+}
+
+
+int example_query_open_sql (
+    struct example_query_s * query,
+    struct example_s * example,
+    const char * sql
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = NULL;
+
+    ret = sqlite3_prepare_v3(
+        /* db = */ example->db,
+        /* sql = */ sql,
+        /* sql_len = */ strlen(sql),
+        /* flags = */ 0,
+        /* &stmt = */ &stmt,
+        /* &sql_end = */ NULL
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v3 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    if (EXAMPLE_QUERY_COLUMNS_MAX < sqlite3_column_count(stmt)) {
+        EXAMPLE_LOG(LOG_ERR, "statement has %d columns, more than %d",
+            sqlite3_column_count(stmt), EXAMPLE_QUERY_COLUMNS_MAX);
+        sqlite3_finalize(stmt);
+        return -1;
+    }
+
+    *query = (struct example_query_s){
+        .sentinel = EXAMPLE_QUERY_SENTINEL,
+        .example = example,
+        .stmt = stmt,
+        .cached = false
+    };
+
+    return 0;
+}
+
+
+// Load the current row of the statement into query->row.
+void example_query_row_load (
+    struct example_query_s * query
+)
+{
+
+    struct example_row_s * row = &query->row;
+
+    row->columns_len = sqlite3_column_count(query->stmt);
+
+    for (int i = 0; i < row->columns_len; i++) {
+        struct example_column_s * column = &row->columns[i];
+
+        column->type = sqlite3_column_type(query->stmt, i);
+        column->value_int = 0;
+        column->value_double = 0;
+        column->data = NULL;
+        column->data_len = 0;
+
+        switch (column->type) {
+            case SQLITE_INTEGER:
+                column->value_int = sqlite3_column_int64(query->stmt, i);
+                break;
+            case SQLITE_FLOAT:
+                column->value_double = sqlite3_column_double(query->stmt, i);
+                break;
+            case SQLITE_TEXT:
+                // text first, then bytes; see "Memory management" in the
+                // sqlite3_column_blob docs
+                column->data = sqlite3_column_text(query->stmt, i);
+                column->data_len = sqlite3_column_bytes(query->stmt, i);
+                break;
+            case SQLITE_BLOB:
+                column->data = sqlite3_column_blob(query->stmt, i);
+                column->data_len = sqlite3_column_bytes(query->stmt, i);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+// Step to the next row; returns 1 with the row in *row, 0 when there are no
+// more rows, -1 on error. row points at query->row.
+int example_query_next (
+    struct example_query_s * query,
+    const struct example_row_s ** row
+)
+{
+
+    int ret = 0;
+
+    if (EXAMPLE_QUERY_SENTINEL != query->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "query is not open");
+        return -1;
+    }
+
+    if (query->pending) {
+        query->pending = false;
+        *row = &query->row;
+        return 1;
+    }
+
+    if (query->done) {
+        return 0;
+    }
+
+    ret = sqlite3_step(query->stmt);
+    if (SQLITE_DONE == ret) {
+        query->done = true;
+        return 0;
+    }
+    if (SQLITE_ROW != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+                ret, sqlite3_errmsg(query->example->db));
+        return -1;
+    }
+
+    example_query_row_load(query);
+    query->rows++;
+
+    *row = &query->row;
+
+    return 1;
+}
+
+
+// Call cb on every remaining row; cb returns 0 to keep going, 1 to stop early
+// or -1 to fail. Returns 0, or -1 if stepping or the callback failed.
+int example_query_each (
+    struct example_query_s * query,
+    int (*cb)(void * user_data, const struct example_row_s * row),
+    void * user_data
+)
+{
+
+    int ret = 0;
+    const struct example_row_s * row = NULL;
+
+    while (1 == (ret = example_query_next(query, &row))) {
+        ret = cb(user_data, row);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "cb returned -1");
+            return -1;
+        }
+        if (1 == ret) {
+            return 0;
+        }
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_query_next returned -1");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Fetch up to rows_cap rows into rows. Since those outlive the statement's own
+// buffers, text and blob columns are copied into buf (text nul-terminated) and
+// the rows point there; a row that doesn't fit in what's left of buf ends the
+// batch and comes first in the next one. *rows_len is 0 once the query is
+// done.
+//
+// Returns 0, or -1 on error. If the next row doesn't fit even into an empty
+// buf, returns 1 with no rows and *buf_needed set to the buf_len it takes;
+// the row stays pending for a call with a buf that large.
+int example_query_fetch (
+    struct example_query_s * query,
+    struct example_row_s * rows,
+    size_t rows_cap,
+    char * buf,
+    size_t buf_len,
+    size_t * rows_len,
+    size_t * buf_needed
+)
+{
+
+    int ret = 0;
+    size_t buf_used = 0;
+    const struct example_row_s * row = NULL;
+
+    *rows_len = 0;
+    *buf_needed = 0;
+
+    while (*rows_len < rows_cap) {
+        ret = example_query_next(query, &row);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_query_next returned -1");
+            return -1;
+        }
+        if (0 == ret) {
+            break;
+        }
+
+        size_t row_bytes = 0;
+        for (int i = 0; i < row->columns_len; i++) {
+            if (NULL != row->columns[i].data) {
+                row_bytes += row->columns[i].data_len + 1;
+            }
+        }
+
+        if (buf_len - buf_used < row_bytes) {
+            query->pending = true;
+            if (0 == *rows_len) {
+                *buf_needed = row_bytes;
+                return 1;
+            }
+            break;
+        }
+
+        struct example_row_s * out = &rows[*rows_len];
+        *out = *row;
+        for (int i = 0; i < out->columns_len; i++) {
+            struct example_column_s * column = &out->columns[i];
+            if (NULL == column->data) {
+                continue;
+            }
+            memcpy(buf + buf_used, column->data, column->data_len);
+            buf[buf_used + column->data_len] = '\0';
+            column->data = buf + buf_used;
+            buf_used += column->data_len + 1;
+        }
+
+        (*rows_len)++;
+    }
+
+    return 0;
+}
+
+
+// Done with the query; cached statements are reset for the next user, the
+// others are finalized.
+void example_query_close (
+    struct example_query_s * query
+)
+{
+
+    if (EXAMPLE_QUERY_SENTINEL != query->sentinel) {
+        return;
+    }
+
+    if (query->cached) {
+        example_stmt_release(query->stmt);
+    } else {
+        sqlite3_finalize(query->stmt);
+    }
+
+    query->sentinel = 0;
+    query->stmt = NULL;
+}
+
+
+// Delete up to batch_rows rows of state.measured whose timestamp is more than
+// ttl_s seconds old, oldest first; a single statement, so outside of a
+// transaction it's a short write transaction of its own, and the timestamp
+// index makes it O(batch_rows) rather than a scan. Sets *done once there's
+// nothing left to expire, i.e. the batch wasn't full. Expired rows don't show
+// up on state.drift_feed, the same as evicted ones: the deletes run under
+// example_evicting(), and a drifted output stays in state.drift until it's
+// measured again.
+//
+// With config->state_hash_capacity, the hash table has no order to go by, so
+// a call instead sweeps the next batch_rows slots of it, and *done is set
+// when a sweep has gone through the whole table.
+//
+// Returns the number of rows deleted, or -1.
+int example_measured_expire (
+    struct example_s * example,
+    const uint32_t ttl_s,
+    const uint32_t batch_rows,
+    bool * done
+)
+{
+
+    int ret = 0;
+    uint64_t now = 0;
+    uint64_t cutoff = 0;
+
+    ret = example_monotonic_now(example->clock_id, &now);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_monotonic_now returned -1");
+        return -1;
+    }
+
+    // nothing can be older than the clock
+    if (now <= (uint64_t)ttl_s << 32) {
+        *done = true;
+        return 0;
+    }
+    cutoff = now - ((uint64_t)ttl_s << 32);
+
+    if (NULL != example->state_measured) {
+        const uint32_t deleted = example_hash_expire(
+            /* hash = */ example->state_measured,
+            /* cutoff = */ cutoff,
+            /* cursor = */ &example->measured_expire_cursor,
+            /* slots_len = */ batch_rows
+        );
+        *done = 0 == example->measured_expire_cursor;
+        return deleted;
+    }
+
+    example->evicting = true;
+    ret = example_stmt_measured_expire_run(example, (int64_t)cutoff, batch_rows);
+    example->evicting = false;
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_measured_expire_run returned -1");
+        return -1;
+    }
+
+    // the drift triggers' writes aren't counted in this
+    ret = sqlite3_changes(example->db);
+    *done = (uint32_t)ret < batch_rows;
+
+    return ret;
+}
+
+
+// Bytes of the state schema's pages in use: those not on the freelist, which
+// is where the pages eviction frees go. Returns -1 on error.
+int64_t example_state_size (
+    struct example_s * example
+)
+{
+
+    int ret = 0;
+    int64_t page_size = 0;
+    int64_t page_count = 0;
+    int64_t freelist_count = 0;
+
+    ret = example_pragma_get(example, "state.page_size", &page_size, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    ret = example_pragma_get(example, "state.page_count", &page_count, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    ret = example_pragma_get(example, "state.freelist_count", &freelist_count, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    return (page_count - freelist_count) * page_size;
+}
+
+
+// Bring state.measured back within its budget, by evicting up to batch_rows
+// of the least recently updated rows: those above config->measured_rows_max
+// which example_measured_upsert didn't see, such as rows written in SQL, or,
+// while the state schema has more than config->state_trim_size bytes of
+// pages in use, a batch_rows per call. Sets *done once the rows are within
+// the cap; the size only ever takes one batch, since deleting rows frees
+// whole pages only once they're empty. The hash tables have a fixed size,
+// and make room on their own when they're full. Returns the number of rows
+// evicted, or -1.
+int example_measured_trim (
+    struct example_s * example,
+    const uint32_t batch_rows,
+    bool * done
+)
+{
+
+    int64_t rows = 0;
+    int64_t evict = 0;
+
+    *done = true;
+
+    if (0 != example->measured_rows_max) {
+        rows = example_measured_rows(example);
+        if (-1 == rows) {
+            EXAMPLE_LOG(LOG_ERR, "example_measured_rows returned -1");
+            return -1;
+        }
+        if (example->measured_rows_max < rows) {
+            evict = rows - example->measured_rows_max;
+            *done = evict <= batch_rows;
+        }
+    }
+
+    if (0 == evict && 0 != example->state_trim_size && NULL == example->state_measured) {
+        const int64_t size = example_state_size(example);
+        if (-1 == size) {
+            EXAMPLE_LOG(LOG_ERR, "example_state_size returned -1");
+            return -1;
+        }
+        if (example->state_trim_size < size) {
+            evict = batch_rows;
+        }
+    }
+
+    if (0 == evict) {
+        return 0;
+    }
+
+    return example_measured_evict(example, evict < batch_rows ? evict : batch_rows);
+}
+
+
+void * example_compactor_thread (
+    void * arg
+)
+{
+
+    int ret = 0;
+    struct example_compactor_s * compactor = arg;
+    struct example_s * example = NULL;
+    bool done = false;
+    // sleep in short steps, so that example_compactor_stop doesn't have to
+    // wait out a whole interval
+    const struct timespec step = {
+        .tv_sec = 0,
+        .tv_nsec = 10 * 1000 * 1000
+    };
+
+    while (atomic_load_explicit(&compactor->running, memory_order_acquire)) {
+        for (uint32_t slept_us = 0;
+            slept_us < compactor->interval_us && atomic_load_explicit(&compactor->running, memory_order_acquire);
+            slept_us += step.tv_nsec / 1000)
+        {
+            nanosleep(&step, NULL);
+        }
+
+        ret = 1;
+        while (1 == ret && atomic_load_explicit(&compactor->running, memory_order_acquire)) {
+            example = example_pool_writer_checkout(compactor->pool);
+            ret = example_schema_migrate(example, compactor->batch_rows);
+            example_pool_writer_checkin(compactor->pool, example);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_schema_migrate returned -1");
+                atomic_fetch_add_explicit(&compactor->failed, 1, memory_order_relaxed);
+            }
+        }
+
+        done = false;
+        while (!done && atomic_load_explicit(&compactor->running, memory_order_acquire)) {
+            example = example_pool_writer_checkout(compactor->pool);
+            ret = example_measured_expire(
+                /* example = */ example,
+                /* ttl_s = */ compactor->ttl_s,
+                /* batch_rows = */ compactor->batch_rows,
+                /* done = */ &done
+            );
+            example_pool_writer_checkin(compactor->pool, example);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_measured_expire returned -1");
+                atomic_fetch_add_explicit(&compactor->failed, 1, memory_order_relaxed);
+                break;
+            }
+            atomic_fetch_add_explicit(&compactor->expired, ret, memory_order_relaxed);
+        }
+
+        done = false;
+        while (!done && atomic_load_explicit(&compactor->running, memory_order_acquire)) {
+            example = example_pool_writer_checkout(compactor->pool);
+            ret = example_measured_trim(
+                /* example = */ example,
+                /* batch_rows = */ compactor->batch_rows,
+                /* done = */ &done
+            );
+            example_pool_writer_checkin(compactor->pool, example);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_measured_trim returned -1");
+                atomic_fetch_add_explicit(&compactor->failed, 1, memory_order_relaxed);
+                break;
+            }
+            atomic_fetch_add_explicit(&compactor->evicted, ret, memory_order_relaxed);
+        }
+
+        atomic_fetch_add_explicit(&compactor->sweeps, 1, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+
+// Start the compactor thread. With skip_unchanged writes, also set
+// config->measured_heartbeat_s to well below ttl_s, or outputs that don't
+// change will expire even though their devices keep reporting.
+int example_compactor_start (
+    struct example_compactor_s * compactor,
+    struct example_pool_s * pool,
+    const uint32_t ttl_s,
+    const uint32_t interval_us,
+    const uint32_t batch_rows
+)
+{
+
+    int ret = 0;
+
+    if (0 == batch_rows) {
+        EXAMPLE_LOG(LOG_ERR, "batch_rows is 0");
+        return -1;
+    }
+
+    compactor->pool = pool;
+    compactor->ttl_s = ttl_s;
+    compactor->interval_us = interval_us;
+    compactor->batch_rows = batch_rows;
+    atomic_init(&compactor->sweeps, 0);
+    atomic_init(&compactor->expired, 0);
+    atomic_init(&compactor->evicted, 0);
+    atomic_init(&compactor->failed, 0);
+    atomic_init(&compactor->running, true);
+
+    ret = pthread_create(&compactor->thread, NULL, example_compactor_thread, compactor);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_create returned %d", ret);
+        return -1;
+    }
+
+    compactor->sentinel = EXAMPLE_COMPACTOR_SENTINEL;
+
+    return 0;
+}
+
+
+// Stop the compactor thread; a batch in progress is finished first.
+int example_compactor_stop (
+    struct example_compactor_s * compactor
+)
+{
+
+    int ret = 0;
+
+    if (EXAMPLE_COMPACTOR_SENTINEL != compactor->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "compactor is not running");
+        return -1;
+    }
+
+    atomic_store_explicit(&compactor->running, false, memory_order_release);
+
+    ret = pthread_join(compactor->thread, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_join returned %d", ret);
+        return -1;
+    }
+
+    compactor->sentinel = 0;
+
+    return 0;
+}
+
+
+// Hand up to pages free pages of a database created with auto_vacuum =
+// incremental back to the filesystem, all of them with 0. Meant to run every
+// so often, e.g. from a timer or after a large delete: each call is a write
+// transaction of its own, so small steps keep the write lock short, where a
+// full vacuum would rewrite the whole database. Returns the number of free
+// pages left, or -1.
+int example_incremental_vacuum (
+    struct example_s * example,
+    const uint32_t pages
+)
+{
+
+    int ret = 0;
+    int64_t auto_vacuum = 0;
+    int64_t freelist_count = 0;
+    char * err = NULL;
+    char sql[64];
+
+    ret = example_pragma_get(example, "auto_vacuum", &auto_vacuum, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    // 2 is incremental; anything else makes incremental_vacuum a no-op
+    if (2 != auto_vacuum) {
+        EXAMPLE_LOG(LOG_ERR, "auto_vacuum is %lld, not incremental", (long long)auto_vacuum);
+        return -1;
+    }
+
+    ret = example_pragma_get(example, "freelist_count", &freelist_count, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+    if (0 == freelist_count) {
+        return 0;
+    }
+
+    sqlite3_snprintf(sizeof(sql), sql, "pragma incremental_vacuum(%u);", pages);
+    ret = sqlite3_exec(
+        /* db = */ example->db,
+        /* sql = */ sql,
+        /* cb = */ NULL,
+        /* user_data = */ NULL,
+        /* err = */ &err
+    );
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s",
+            ret, err);
+        sqlite3_free(err);
+        return -1;
+    }
+
+    ret = example_pragma_get(example, "freelist_count", &freelist_count, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    return freelist_count;
+}
+
+
+// Run the custom aggregate query and hand each result to cb; cb returns 0 to
+// keep going, 1 to stop early or -1 to fail.
+int example_custom_aggregate_query (
+    struct example_s * example,
+    int (*cb)(void * user_data, int64_t aggregate),
+    void * user_data
+)
+{
+
+    int ret = 0;
+    struct example_query_s query = {0};
+    const struct example_row_s * row = NULL;
+
+    ret = example_query_open(&query, example, EXAMPLE_STMT_CUSTOM_AGGREGATE_QUERY);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_query_open returned -1");
+        return -1;
+    }
+
+    while (1 == (ret = example_query_next(&query, &row))) {
+        ret = cb(user_data, row->columns[0].value_int);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "cb returned -1");
+            example_query_close(&query);
+            return -1;
+        }
+        if (1 == ret) {
+            break;
+        }
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_query_next returned -1");
+        example_query_close(&query);
+        return -1;
+    }
+
+    example_query_close(&query);
+
+    return 0;
+}
+
+
+// A groupid and its example_agg_f, as computed by one shard of
+// example_custom_aggregate_query_parallel.
+struct example_agg_shard_row_s {
+    int64_t groupid;
+    struct example_agg_f_s agg_f;
+};
+
+
+struct example_agg_shard_s {
+    struct example_pool_s * pool;
+    pthread_t thread;
+    int64_t groupid_lo;
+    int64_t groupid_hi;
+    struct example_agg_shard_row_s * rows;
+    size_t rows_len;
+    size_t rows_cap;
+    int ret;
+};
+
+
+// Run the aggregate over one groupid range on a reader of its own.
+void * example_agg_shard_thread (
+    void * arg
+)
+{
+
+    int ret = 0;
+    struct example_agg_shard_s * shard = arg;
+    struct example_s * reader = example_pool_reader_checkout(shard->pool);
+    int64_t groupid = 0;
+    int64_t aggregate = 0;
+
+    shard->ret = -1;
+
+    ret = example_stmt_custom_aggregate_shard_bind(reader, shard->groupid_lo, shard->groupid_hi);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_custom_aggregate_shard_bind returned -1");
+        example_pool_reader_checkin(shard->pool, reader);
+        return NULL;
+    }
+
+    while (1 == (ret = example_stmt_custom_aggregate_shard_step(reader, &groupid, &aggregate))) {
+        if (shard->rows_len == shard->rows_cap) {
+            const size_t cap = 0 == shard->rows_cap ? 1024 : 2 * shard->rows_cap;
+            struct example_agg_shard_row_s * rows = realloc(shard->rows, cap * sizeof(*rows));
+            if (NULL == rows) {
+                EXAMPLE_LOG(LOG_ERR, "realloc: %s", strerror(errno));
+                example_stmt_release(reader->stmts[EXAMPLE_STMT_CUSTOM_AGGREGATE_SHARD]);
+                example_pool_reader_checkin(shard->pool, reader);
+                return NULL;
+            }
+            shard->rows = rows;
+            shard->rows_cap = cap;
+        }
+
+        struct example_agg_shard_row_s * row = &shard->rows[shard->rows_len++];
+        row->groupid = groupid;
+        row->agg_f.sentinel = EXAMPLE_AGG_F_SENTINEL;
+        row->agg_f.aggregate = aggregate;
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_custom_aggregate_shard_step returned -1");
+        example_pool_reader_checkin(shard->pool, reader);
+        return NULL;
+    }
+
+    shard->ret = 0;
+    example_pool_reader_checkin(shard->pool, reader);
+    return NULL;
+}
+
+
+// The first groupid of shard i of n, over the span groupids from lo on; a span
+// of 0 stands for all 2^64 of them. Shards differ in width by at most one.
+// Unsigned, so that even the widest range doesn't overflow.
+int64_t example_agg_shard_bound (
+    const int64_t lo,
+    const uint64_t span,
+    const uint32_t i,
+    const uint32_t n
+)
+{
+
+    uint64_t width = span / n;
+    uint64_t rest = span % n;
+
+    if (0 == span) {
+        width = UINT64_MAX / n;
+        rest = UINT64_MAX % n + 1;
+        if (n == rest) {
+            width++;
+            rest = 0;
+        }
+    }
+
+    return (int64_t)((uint64_t)lo + width * i + (i < rest ? i : rest));
+}
+
+
+// example_custom_aggregate_query, split over the pool's readers: the groupid
+// range is cut into one shard per reader (at most shards_max), each runs on
+// its own thread and reader at the same time, and the results are handed to
+// cb in groupid order once all shards are done, like the serial query does.
+// The shards are of equal groupid width, not of equal row count, so skewed
+// group sizes leave some readers idle early.
+//
+// Each shard runs in a read transaction of its own, so the shards don't see
+// one point in time: a write to groups that commits while they run may be in
+// some shards and not in others, and the result is not an aggregate of any
+// one state of the table. Where that matters, run it while nothing writes to
+// groups, or on a copy from example_snapshot. (sqlite3_snapshot_open could
+// pin the readers to one wal snapshot, but it needs SQLITE_ENABLE_SNAPSHOT
+// and doesn't work on memdb.)
+//
+// Each shard's results are kept until the end, that's 24 bytes per group.
+int example_custom_aggregate_query_parallel (
+    struct example_pool_s * pool,
+    uint32_t shards_max,
+    int (*cb)(void * user_data, int64_t aggregate),
+    void * user_data
+)
+{
+
+    int ret = 0;
+    int result = 0;
+    struct example_agg_shard_s shards[EXAMPLE_POOL_READERS_MAX] = {0};
+    uint32_t shards_len = 0;
+    int64_t groupid_min = 0;
+    int64_t groupid_max = 0;
+
+    // the groupid range comes off both ends of groups_groupid
+    uint8_t empty = 0;
+    struct example_s * reader = example_pool_reader_checkout(pool);
+    ret = example_stmt_groups_groupid_range_step(
+        /* example = */ reader,
+        /* groupid_min = */ &groupid_min,
+        /* groupid_min_null = */ &empty,
+        /* groupid_max = */ &groupid_max,
+        /* groupid_max_null = */ NULL
+    );
+    if (1 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_groups_groupid_range_step returned %d", ret);
+        example_pool_reader_checkin(pool, reader);
+        return -1;
+    }
+    example_stmt_release(reader->stmts[EXAMPLE_STMT_GROUPS_GROUPID_RANGE]);
+    example_pool_reader_checkin(pool, reader);
+
+    if (empty) {
+        return 0;
+    }
+
+    // no more shards than readers or groupids
+    shards_len = 0 == pool->readers_len ? 1 : pool->readers_len;
+    if (0 < shards_max && shards_max < shards_len) {
+        shards_len = shards_max;
+    }
+    // 0 for all 2^64 groupids
+    const uint64_t span = (uint64_t)groupid_max - (uint64_t)groupid_min + 1;
+    if (0 < span && span < shards_len) {
+        shards_len = span;
+    }
+
+    for (uint32_t i = 0; i < shards_len; i++) {
+        shards[i].pool = pool;
+        shards[i].groupid_lo = example_agg_shard_bound(groupid_min, span, i, shards_len);
+        shards[i].groupid_hi = shards_len - 1 == i
+            ? groupid_max
+            : example_agg_shard_bound(groupid_min, span, i + 1, shards_len) - 1;
+        shards[i].ret = -1;
+
+        ret = pthread_create(&shards[i].thread, NULL, example_agg_shard_thread, &shards[i]);
+        if (0 != ret) {
+            EXAMPLE_LOG(LOG_ERR, "pthread_create returned %d", ret);
+            shards_len = i;
+            result = -1;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < shards_len; i++) {
+        pthread_join(shards[i].thread, NULL);
+        if (-1 == shards[i].ret) {
+            EXAMPLE_LOG(LOG_ERR, "shard %u of groupids %lld to %lld failed",
+                i, (long long)shards[i].groupid_lo, (long long)shards[i].groupid_hi);
+            result = -1;
+        }
+    }
+
+    // concatenate; shards are cut on groupid so they don't share a group,
+    // but should one be split anyway its partial states merge into one
+    struct example_agg_shard_row_s * pending = NULL;
+    for (uint32_t i = 0; 0 == result && i < shards_len; i++) {
+        for (size_t j = 0; j < shards[i].rows_len; j++) {
+            struct example_agg_shard_row_s * row = &shards[i].rows[j];
+            if (NULL != pending && pending->groupid == row->groupid) {
+                example_agg_f_merge(&pending->agg_f, &row->agg_f);
+                continue;
+            }
+            if (NULL != pending) {
+                ret = cb(user_data, pending->agg_f.aggregate);
+                if (0 != ret) {
+                    result = -1 == ret ? -1 : 1;
+                    break;
+                }
+            }
+            pending = row;
+        }
+    }
+    if (NULL != pending && 0 == result) {
+        ret = cb(user_data, pending->agg_f.aggregate);
+        result = -1 == ret ? -1 : 0;
+    }
+    if (-1 == result) {
+        EXAMPLE_LOG(LOG_ERR, "the parallel aggregate query failed");
+    }
+
+    for (uint32_t i = 0; i < shards_len; i++) {
+        free(shards[i].rows);
+    }
+
+    return -1 == result ? -1 : 0;
+}
+
+
+// Progress handler of the connection running an async request; cancels it
+// when asked to, and otherwise passes the progress on.
+int example_async_progress (
+    void * arg
+)
+{
+
+    struct example_async_req_s * req = arg;
+
+    req->progress_ops += EXAMPLE_ASYNC_PROGRESS_OPS;
+
+    if (atomic_load_explicit(&req->cancel, memory_order_relaxed)) {
+        return 1;
+    }
+
+    if (NULL != req->progress && 0 != req->progress(req->user_data, req->progress_ops)) {
+        atomic_store_explicit(&req->cancel, true, memory_order_relaxed);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Bind params to the parameters of the query, in order. Text and blobs are
+// bound with SQLITE_STATIC, so they have to outlive the query.
+int example_query_bind (
+    struct example_query_s * query,
+    const struct example_column_s * params,
+    const int params_len
+)
+{
+
+    int ret = 0;
+
+    for (int i = 0; i < params_len; i++) {
+        const struct example_column_s * param = &params[i];
+        switch (param->type) {
+            case SQLITE_INTEGER:
+                ret = sqlite3_bind_int64(query->stmt, i + 1, param->value_int);
+                break;
+            case SQLITE_FLOAT:
+                ret = sqlite3_bind_double(query->stmt, i + 1, param->value_double);
+                break;
+            case SQLITE_TEXT:
+                ret = sqlite3_bind_text(query->stmt, i + 1, param->data, param->data_len, SQLITE_STATIC);
+                break;
+            case SQLITE_BLOB:
+                ret = sqlite3_bind_blob(query->stmt, i + 1, param->data, param->data_len, SQLITE_STATIC);
+                break;
+            default:
+                ret = sqlite3_bind_null(query->stmt, i + 1);
+                break;
+        }
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_bind returned %d on parameter %d: %s",
+                ret, i + 1, sqlite3_errmsg(query->example->db));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Run req on example; sets req->ret and req->cancelled.
+void example_async_run (
+    struct example_s * example,
+    struct example_async_req_s * req
+)
+{
+
+    int ret = 0;
+    struct example_query_s query = {0};
+
+    req->ret = -1;
+    req->rows = 0;
+    req->progress_ops = 0;
+
+    if (atomic_load_explicit(&req->cancel, memory_order_relaxed)) {
+        req->cancelled = true;
+        return;
+    }
+
+    ret = NULL != req->sql
+        ? example_query_open_sql(&query, example, req->sql)
+        : example_query_open(&query, example, req->id);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_query_open returned -1");
+        return;
+    }
+
+    ret = example_query_bind(&query, req->params, req->params_len);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_query_bind returned -1");
+        example_query_close(&query);
+        return;
+    }
+
+    sqlite3_progress_handler(example->db, EXAMPLE_ASYNC_PROGRESS_OPS, example_async_progress, req);
+
+    // stepped here rather than with example_query_next, so that a
+    // cancellation isn't logged as an error. stop is what row returned, kept
+    // apart from the step result: SQLITE_ERROR is 1 too.
+    int stop = 0;
+    while (SQLITE_ROW == (ret = sqlite3_step(query.stmt))) {
+        example_query_row_load(&query);
+        req->rows++;
+        if (NULL == req->row) {
+            continue;
+        }
+        stop = req->row(req->user_data, &query.row);
+        if (0 != stop) {
+            break;
+        }
+    }
+
+    sqlite3_progress_handler(example->db, 0, NULL, NULL);
+
+    if (-1 == stop) {
+        EXAMPLE_LOG(LOG_ERR, "row returned -1");
+    } else if (SQLITE_DONE == ret || 1 == stop) {
+        req->ret = 0;
+    } else if (SQLITE_INTERRUPT == ret && atomic_load_explicit(&req->cancel, memory_order_relaxed)) {
+        req->cancelled = true;
+    } else {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+    }
+
+    example_query_close(&query);
+}
+
+
+void example_async_complete (
+    struct example_async_s * async,
+    struct example_async_req_s * req
+)
+{
+
+    if (NULL != req->done) {
+        req->done(req->user_data, req);
+        return;
+    }
+
+    pthread_mutex_lock(&async->lock);
+    req->next = NULL;
+    if (NULL == async->done_tail) {
+        async->done_head = req;
+    } else {
+        async->done_tail->next = req;
+    }
+    async->done_tail = req;
+    pthread_mutex_unlock(&async->lock);
+
+    const uint64_t one = 1;
+    if (sizeof(one) != write(async->eventfd, &one, sizeof(one))) {
+        EXAMPLE_LOG(LOG_ERR, "write to eventfd: %s", strerror(errno));
+    }
+}
+
+
+void * example_async_worker (
+    void * arg
+)
+{
+
+    struct example_async_s * async = arg;
+
+    pthread_mutex_lock(&async->lock);
+    const uint32_t worker = async->workers_started++;
+
+    for (;;) {
+        while (async->running && NULL == async->queue_head) {
+            pthread_cond_wait(&async->cond, &async->lock);
+        }
+        if (NULL == async->queue_head) {
+            break;
+        }
+
+        struct example_async_req_s * req = async->queue_head;
+        async->queue_head = req->next;
+        if (NULL == async->queue_head) {
+            async->queue_tail = NULL;
+        }
+        async->queue_len--;
+
+        // what's still queued on example_async_stop doesn't run
+        if (!async->running) {
+            atomic_store_explicit(&req->cancel, true, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&async->lock);
+
+        struct example_s * example = req->write
+            ? example_pool_writer_checkout(async->pool)
+            : example_pool_reader_checkout(async->pool);
+
+        // from here on example_async_cancel interrupts the connection
+        pthread_mutex_lock(&async->lock);
+        req->example = example;
+        async->current[worker] = req;
+        pthread_mutex_unlock(&async->lock);
+
+        example_async_run(example, req);
+
+        pthread_mutex_lock(&async->lock);
+        req->example = NULL;
+        async->current[worker] = NULL;
+        pthread_mutex_unlock(&async->lock);
+
+        if (req->write) {
+            example_pool_writer_checkin(async->pool, example);
+        } else {
+            example_pool_reader_checkin(async->pool, example);
+        }
+
+        example_async_complete(async, req);
+
+        pthread_mutex_lock(&async->lock);
+    }
+
+    pthread_mutex_unlock(&async->lock);
+
+    return NULL;
+}
+
+
+// Stop the workers: everything still queued completes as cancelled without
+// running, and what's running is cancelled. Waits for the workers to finish;
+// completed requests can still be reaped afterwards. Nothing may be submitted
+// concurrently with this call.
+void example_async_stop (
+    struct example_async_s * async
+)
+{
+
+    if (EXAMPLE_ASYNC_SENTINEL != async->sentinel) {
+        return;
+    }
+
+    pthread_mutex_lock(&async->lock);
+    async->running = false;
+    for (uint32_t i = 0; i < EXAMPLE_ASYNC_WORKERS_MAX; i++) {
+        struct example_async_req_s * req = async->current[i];
+        if (NULL != req) {
+            atomic_store_explicit(&req->cancel, true, memory_order_relaxed);
+            sqlite3_interrupt(req->example->db);
+        }
+    }
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+
+    for (uint32_t i = 0; i < async->workers_len; i++) {
+        pthread_join(async->workers[i], NULL);
+    }
+    async->workers_len = 0;
+
+    pthread_cond_destroy(&async->cond);
+    close(async->eventfd);
+    async->eventfd = -1;
+    async->sentinel = 0;
+}
+
+
+// Start workers_len worker threads running requests on connections from
+// pool; at most queue_cap requests wait for a worker, see
+// example_async_submit.
+int example_async_start (
+    struct example_async_s * async,
+    struct example_pool_s * pool,
+    const uint32_t workers_len,
+    const uint32_t queue_cap
+)
+{
+
+    int ret = 0;
+
+    if (0 == workers_len || EXAMPLE_ASYNC_WORKERS_MAX < workers_len) {
+        EXAMPLE_LOG(LOG_ERR, "workers_len=%u is not within 1 and EXAMPLE_ASYNC_WORKERS_MAX=%d",
+                workers_len, EXAMPLE_ASYNC_WORKERS_MAX);
+        return -1;
+    }
+
+    *async = (struct example_async_s){
+        .pool = pool,
+        .queue_cap = queue_cap,
+        .running = true,
+    };
+
+    async->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == async->eventfd) {
+        EXAMPLE_LOG(LOG_ERR, "eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    ret = pthread_mutex_init(&async->lock, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_mutex_init returned %d", ret);
+        close(async->eventfd);
+        return -1;
+    }
+
+    ret = pthread_cond_init(&async->cond, NULL);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_cond_init returned %d", ret);
+        pthread_mutex_destroy(&async->lock);
+        close(async->eventfd);
+        return -1;
+    }
+
+    async->sentinel = EXAMPLE_ASYNC_SENTINEL;
+
+    for (uint32_t i = 0; i < workers_len; i++) {
+        ret = pthread_create(&async->workers[i], NULL, example_async_worker, async);
+        if (0 != ret) {
+            EXAMPLE_LOG(LOG_ERR, "pthread_create returned %d", ret);
+            example_async_stop(async);
+            return -1;
+        }
+        async->workers_len++;
+    }
+
+    return 0;
+}
+
+
+// Queue req; never blocks. Returns -1 if the queue is full or the workers
+// are stopping, in which case req isn't completed. Otherwise req is
+// completed exactly once, from a worker thread: through req->done if set, or
+// else by putting it on the list example_async_reap takes from and making
+// the eventfd readable.
+int example_async_submit (
+    struct example_async_s * async,
+    struct example_async_req_s * req
+)
+{
+
+    if (EXAMPLE_ASYNC_SENTINEL != async->sentinel) {
+        EXAMPLE_LOG(LOG_ERR, "async is not running");
+        return -1;
+    }
+
+    req->next = NULL;
+    req->example = NULL;
+    req->cancelled = false;
+    req->ret = -1;
+    atomic_init(&req->cancel, false);
+
+    pthread_mutex_lock(&async->lock);
+    if (!async->running || async->queue_cap <= async->queue_len) {
+        pthread_mutex_unlock(&async->lock);
+        return -1;
+    }
+
+    if (NULL == async->queue_tail) {
+        async->queue_head = req;
+    } else {
+        async->queue_tail->next = req;
+    }
+    async->queue_tail = req;
+    async->queue_len++;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+
+    return 0;
+}
+
+
+// Cancel a submitted request which hasn't completed yet: if it's running, its
+// connection is interrupted, and if it's still queued it won't run. It still
+// completes, with ret -1 and cancelled set (unless it finished first).
+void example_async_cancel (
+    struct example_async_s * async,
+    struct example_async_req_s * req
+)
+{
+    pthread_mutex_lock(&async->lock);
+    atomic_store_explicit(&req->cancel, true, memory_order_relaxed);
+    if (NULL != req->example) {
+        sqlite3_interrupt(req->example->db);
+    }
+    pthread_mutex_unlock(&async->lock);
+}
+
+
+// The eventfd which becomes readable when requests without a done callback
+// complete; for epoll.
+int example_async_fd (
+    struct example_async_s * async
+)
+{
+    return async->eventfd;
+}
+
+
+// Take up to reqs_cap completed requests (without a done callback), oldest
+// first; returns how many. Call when the eventfd is readable, until it
+// returns less than reqs_cap.
+uint32_t example_async_reap (
+    struct example_async_s * async,
+    struct example_async_req_s ** reqs,
+    const uint32_t reqs_cap
+)
+{
+
+    uint32_t reqs_len = 0;
+    uint64_t count = 0;
+
+    // reset the eventfd before looking, so nothing completed after this is
+    // missed
+    if (-1 != async->eventfd) {
+        (void)!read(async->eventfd, &count, sizeof(count));
+    }
+
+    pthread_mutex_lock(&async->lock);
+    while (reqs_len < reqs_cap && NULL != async->done_head) {
+        reqs[reqs_len++] = async->done_head;
+        async->done_head = async->done_head->next;
+    }
+    if (NULL == async->done_head) {
+        async->done_tail = NULL;
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    return reqs_len;
+}
+
+
+// Fill the next batch of up to columns->cap rows of state.measured, in primary
+// key order (slot order with the example_hash tables), into columns;
+// columns->len is 0 once the table is done. Each batch
+// is a statement of its own that continues after the last key of the previous
+// one, so no read lock is held between batches, and rows written in between
+// show up if they sort after that key.
+int example_measured_fetch_columns (
+    struct example_s * example,
+    struct example_measured_columns_s * columns
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = example->stmts[EXAMPLE_STMT_MEASURED_SCAN];
+    size_t i = 0;
+
+    columns->len = 0;
+    if (0 == columns->cap) {
+        return 0;
+    }
+
+    if (NULL != example->state_measured) {
+        struct example_hash_s * hash = example->state_measured;
+
+        pthread_rwlock_rdlock(&hash->lock);
+        for (; i < columns->cap && columns->next_slot <= hash->mask; columns->next_slot++) {
+            const struct example_hash_slot_s * s = &hash->slots[columns->next_slot];
+            if (EXAMPLE_HASH_SLOT_USED != s->used) {
+                continue;
+            }
+            memcpy(columns->deviceid[i], s->deviceid, sizeof(columns->deviceid[i]));
+            columns->outputid[i] = s->outputid;
+            columns->state[i] = s->values[EXAMPLE_MEASURED_STATE];
+            columns->level[i] = s->values[EXAMPLE_MEASURED_LEVEL];
+            if (NULL != columns->level_null) {
+                columns->level_null[i] = 0 != (s->nulls & (1 << EXAMPLE_MEASURED_LEVEL));
+            }
+            columns->timestamp[i] = s->values[EXAMPLE_MEASURED_TIMESTAMP];
+            i++;
+        }
+        pthread_rwlock_unlock(&hash->lock);
+
+        columns->len = i;
+        return 0;
+    }
+
+    // before the first batch last_outputid is 0 and the deviceid is '' (or -1
+    // with packed deviceids), which sorts before every deviceid, so that starts
+    // at the first row.
+    ret = 0 == columns->last_deviceid_len
+        ? (example->deviceid_packed
+            ? sqlite3_bind_int64(stmt, 1, -1)
+            : sqlite3_bind_text(stmt, 1, "", 0, SQLITE_STATIC))
+        : example_bind_deviceid(example, stmt, 1, columns->last_deviceid, columns->last_deviceid_len);
+    if (SQLITE_OK != ret) {
+        goto bind_error;
+    }
+    ret = sqlite3_bind_int(stmt, 2, columns->last_outputid);
+    if (SQLITE_OK != ret) {
+        goto bind_error;
+    }
+    ret = sqlite3_bind_int64(stmt, 3, columns->cap);
+    if (SQLITE_OK != ret) {
+        goto bind_error;
+    }
+
+    // the limit is columns->cap, so the statement is done by the time i
+    // reaches it
+    while (1 == (ret = example_stmt_measured_scan_step(
+        /* example = */ example,
+        /* deviceid = */ columns->deviceid[i],
+        /* outputid = */ &columns->outputid[i],
+        /* state = */ &columns->state[i],
+        /* level = */ &columns->level[i],
+        /* level_null = */ NULL == columns->level_null ? NULL : &columns->level_null[i],
+        /* timestamp = */ (int64_t *)&columns->timestamp[i]
+    ))) {
+        i++;
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_measured_scan_step returned -1");
+        return -1;
+    }
+
+    columns->len = i;
+    if (0 < i) {
+        memcpy(columns->last_deviceid, columns->deviceid[i - 1], sizeof(columns->last_deviceid));
+        columns->last_deviceid_len = sizeof(columns->last_deviceid);
+        columns->last_outputid = columns->outputid[i - 1];
+    }
+
+    return 0;
+
+bind_error:
+    EXAMPLE_LOG(LOG_ERR, "sqlite3_bind returned %d: %s",
+        ret, sqlite3_errmsg(example->db));
+    example_stmt_release(stmt);
+    return -1;
+}
+
+
+// Start following the drift set: cb gets every pair that's drifted right now
+// (with drifted = true), and *seq is set to where example_drift_poll picks up
+// from there. Both are read in one transaction, so nothing is missed or seen
+// twice in between.
+int example_drift_subscribe (
+    struct example_s * example,
+    int (*cb)(void * user_data, const char * deviceid, int deviceid_len, int32_t outputid, bool drifted),
+    void * user_data,
+    uint64_t * seq
+)
+{
+
+    int ret = 0;
+    char deviceid[12];
+    int32_t outputid = 0;
+    int64_t feed_seq = 0;
+
+    if (NULL != example->state_measured) {
+        EXAMPLE_LOG(LOG_ERR, "no drift feed with the example_hash state tables");
+        return -1;
+    }
+
+    ret = example_stmt_exec(example, EXAMPLE_STMT_BEGIN_READ);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+        return -1;
+    }
+
+    ret = example_stmt_drift_seq_step(example, &feed_seq);
+    if (1 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_drift_seq_step returned %d", ret);
+        goto rollback;
+    }
+    example_stmt_release(example->stmts[EXAMPLE_STMT_DRIFT_SEQ]);
+    *seq = feed_seq;
+
+    while (1 == (ret = example_stmt_drift_list_step(example, deviceid, &outputid))) {
+        ret = cb(
+            /* user_data = */ user_data,
+            /* deviceid = */ deviceid,
+            /* deviceid_len = */ sizeof(deviceid),
+            /* outputid = */ outputid,
+            /* drifted = */ true
+        );
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "cb returned -1");
+            example_stmt_release(example->stmts[EXAMPLE_STMT_DRIFT_LIST]);
+            goto rollback;
+        }
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_drift_list_step returned -1");
+        goto rollback;
+    }
+
+    ret = example_stmt_exec(example, EXAMPLE_STMT_COMMIT);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+        return -1;
+    }
+
+    return 0;
+
+rollback:
+    (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+    return -1;
+}
+
+
+// Hand the changes to the drift set after *seq to cb, at most limit of them,
+// oldest first; *seq moves past each one cb has taken. Returns the number of
+// changes handed out, or -1 on error.
+int example_drift_poll (
+    struct example_s * example,
+    uint64_t * seq,
+    uint32_t limit,
+    int (*cb)(void * user_data, const char * deviceid, int deviceid_len, int32_t outputid, bool drifted),
+    void * user_data
+)
+{
+
+    int ret = 0;
+    int changes = 0;
+    char deviceid[12];
+    int64_t feed_seq = 0;
+    int32_t outputid = 0;
+    uint8_t drifted = 0;
+
+    if (NULL != example->state_measured) {
+        EXAMPLE_LOG(LOG_ERR, "no drift feed with the example_hash state tables");
+        return -1;
+    }
+
+    ret = example_stmt_drift_poll_bind(example, (int64_t)*seq, limit);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_drift_poll_bind returned -1");
+        return -1;
+    }
+
+    while (1 == (ret = example_stmt_drift_poll_step(example, &feed_seq, deviceid, &outputid, &drifted))) {
+        ret = cb(
+            /* user_data = */ user_data,
+            /* deviceid = */ deviceid,
+            /* deviceid_len = */ sizeof(deviceid),
+            /* outputid = */ outputid,
+            /* drifted = */ drifted
+        );
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "cb returned -1");
+            example_stmt_release(example->stmts[EXAMPLE_STMT_DRIFT_POLL]);
+            return -1;
+        }
+        *seq = feed_seq;
+        changes++;
+    }
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_drift_poll_step returned -1");
+        return -1;
+    }
+
+    return changes;
+}
+
+
+// Drop the feed up to and including seq, i.e. the oldest seq any consumer
+// still has; state.drift itself is left alone.
+int example_drift_trim (
+    struct example_s * example,
+    uint64_t seq
+)
+{
+
+    int ret = 0;
+
+    ret = example_stmt_drift_trim_run(example, (int64_t)seq);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_drift_trim_run returned -1");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// LZ4 block compression; build with EXTRA_CFLAGS=-DEXAMPLE_WITH_LZ4
+// EXTRA_LDLIBS=-llz4. zstd (ZSTD_compressBound/ZSTD_compress) plugs in the
+// same way.
+#ifdef EXAMPLE_WITH_LZ4
+size_t example_compressor_lz4_bound (
+    size_t src_len
+)
+{
+    return LZ4_compressBound(src_len);
+}
+
+
+int example_compressor_lz4_compress (
+    void * user_data,
+    const uint8_t * src,
+    size_t src_len,
+    uint8_t * dst,
+    size_t dst_cap,
+    size_t * dst_len
+)
+{
+
+    int ret = 0;
+
+    ret = LZ4_compress_default((const char *)src, (char *)dst, src_len, dst_cap);
+    if (ret <= 0) {
+        EXAMPLE_LOG(LOG_ERR, "LZ4_compress_default returned %d", ret);
+        return -1;
+    }
+
+    *dst_len = ret;
+
+    return 0;
+    (void)user_data;
+}
+
+
+static const struct example_compressor_s example_compressor_lz4 = {
+    .name = "lz4",
+    .bound = example_compressor_lz4_bound,
+    .compress = example_compressor_lz4_compress,
+    .user_data = NULL
+};
+#endif
+
+
+// Compress one chunk and hand the frame to the sink.
+int example_snapshot_emit (
+    struct example_snapshot_s * snapshot,
+    const uint8_t * chunk,
+    const size_t chunk_len,
+    uint8_t * out,
+    const size_t out_cap
+)
+{
+
+    int ret = 0;
+    size_t out_len = 0;
+
+    if (NULL == snapshot->compressor) {
+        ret = snapshot->sink(snapshot->user_data, chunk, chunk_len);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "sink returned -1");
+            return -1;
+        }
+        snapshot->out_len += chunk_len;
+        return 0;
+    }
+
+    ret = snapshot->compressor->compress(
+        /* user_data = */ snapshot->compressor->user_data,
+        /* src = */ chunk,
+        /* src_len = */ chunk_len,
+        /* dst = */ out + sizeof(struct example_snapshot_frame_s),
+        /* dst_cap = */ out_cap - sizeof(struct example_snapshot_frame_s),
+        /* dst_len = */ &out_len
+    );
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "%s compress returned -1", snapshot->compressor->name);
+        return -1;
+    }
+
+    const uint32_t header[2] = {
+        htole32(chunk_len),
+        htole32(out_len)
+    };
+    memcpy(out, header, sizeof(header));
+    out_len += sizeof(struct example_snapshot_frame_s);
+
+    ret = snapshot->sink(snapshot->user_data, out, out_len);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "sink returned -1");
+        return -1;
+    }
+    snapshot->out_len += out_len;
+
+    return 0;
+}
+
+
+void * example_snapshot_compress_thread (
+    void * arg
+)
+{
+
+    int ret = 0;
+    struct example_snapshot_stage_s * stage = arg;
+
+    for (int slot = 0;; slot ^= 1) {
+        pthread_mutex_lock(&stage->lock);
+        while (!stage->full[slot] && !stage->done) {
+            pthread_cond_wait(&stage->cond, &stage->lock);
+        }
+        if (!stage->full[slot]) {
+            pthread_mutex_unlock(&stage->lock);
+            break;
+        }
+        pthread_mutex_unlock(&stage->lock);
+
+        ret = example_snapshot_emit(stage->snapshot, stage->chunk[slot], stage->chunk_len[slot],
+                stage->out, stage->out_cap);
+
+        pthread_mutex_lock(&stage->lock);
+        stage->full[slot] = false;
+        if (-1 == ret) {
+            stage->failed = true;
+        }
+        pthread_cond_broadcast(&stage->cond);
+        pthread_mutex_unlock(&stage->lock);
+
+        if (-1 == ret) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Stream a database image which is already in memory to the sink, chunk by
+// chunk.
+int example_snapshot_image (
+    struct example_snapshot_s * snapshot,
+    const uint8_t * image,
+    const sqlite3_int64 image_len,
+    const int64_t page_size
+)
+{
+
+    int ret = 0;
+    const uint32_t chunk_pages = (0 == snapshot->chunk_pages) ? EXAMPLE_SNAPSHOT_CHUNK_PAGES : snapshot->chunk_pages;
+    const size_t chunk_cap = chunk_pages * page_size;
+    size_t out_cap = 0;
+    uint8_t * out = NULL;
+
+    snapshot->raw_len = image_len;
+
+    if (NULL != snapshot->compressor) {
+        out_cap = sizeof(struct example_snapshot_frame_s) + snapshot->compressor->bound(chunk_cap);
+        out = sqlite3_malloc64(out_cap);
+        if (NULL == out) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_malloc64 returned NULL");
+            return -1;
+        }
+    }
+
+    for (sqlite3_int64 offset = 0; offset < image_len; offset += chunk_cap) {
+        const size_t len = ((size_t)(image_len - offset) < chunk_cap) ? (size_t)(image_len - offset) : chunk_cap;
+        ret = example_snapshot_emit(snapshot, image + offset, len, out, out_cap);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_snapshot_emit returned -1");
+            sqlite3_free(out);
+            return -1;
+        }
+    }
+
+    sqlite3_free(out);
+
+    return 0;
+}
+
+
+// Stream the pages of a file-backed database through the compressor, reading
+// them straight from the database file. The caller holds a read transaction.
+int example_snapshot_file (
+    struct example_s * example,
+    const char * const schema,
+    struct example_snapshot_s * snapshot,
+    const int64_t page_count,
+    const int64_t page_size
+)
+{
+
+    int ret = 0;
+    sqlite3_file * file = NULL;
+    pthread_t thread;
+    const uint32_t chunk_pages = (0 == snapshot->chunk_pages) ? EXAMPLE_SNAPSHOT_CHUNK_PAGES : snapshot->chunk_pages;
+    const size_t chunk_cap = chunk_pages * page_size;
+    struct example_snapshot_stage_s stage = {
+        .snapshot = snapshot,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    };
+
+    ret = sqlite3_file_control(example->db, schema, SQLITE_FCNTL_FILE_POINTER, &file);
+    if (SQLITE_OK != ret || NULL == file || NULL == file->pMethods) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_file_control returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    stage.chunk[0] = sqlite3_malloc64(chunk_cap);
+    stage.chunk[1] = sqlite3_malloc64(chunk_cap);
+    if (NULL != snapshot->compressor) {
+        stage.out_cap = sizeof(struct example_snapshot_frame_s) + snapshot->compressor->bound(chunk_cap);
+        stage.out = sqlite3_malloc64(stage.out_cap);
+    }
+    if (NULL == stage.chunk[0] || NULL == stage.chunk[1] ||
+        (NULL != snapshot->compressor && NULL == stage.out))
+    {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_malloc64 returned NULL");
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = pthread_create(&thread, NULL, example_snapshot_compress_thread, &stage);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_create returned %d", ret);
+        ret = -1;
+        goto cleanup;
+    }
+
+    int slot = 0;
+    for (int64_t page = 0; page < page_count; page += chunk_pages, slot ^= 1) {
+        const int64_t pages = (page_count - page < chunk_pages) ? page_count - page : chunk_pages;
+
+        // wait for the compressor to finish with this slot
+        pthread_mutex_lock(&stage.lock);
+        while (stage.full[slot] && !stage.failed) {
+            pthread_cond_wait(&stage.cond, &stage.lock);
+        }
+        const bool failed = stage.failed;
+        pthread_mutex_unlock(&stage.lock);
+        if (failed) {
+            break;
+        }
+
+        ret = file->pMethods->xRead(file, stage.chunk[slot], pages * page_size, page * page_size);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "xRead returned %d at page %lld",
+                    ret, (long long)page);
+            pthread_mutex_lock(&stage.lock);
+            stage.failed = true;
+            pthread_mutex_unlock(&stage.lock);
+            break;
+        }
+
+        pthread_mutex_lock(&stage.lock);
+        stage.chunk_len[slot] = pages * page_size;
+        stage.full[slot] = true;
+        pthread_cond_broadcast(&stage.cond);
+        pthread_mutex_unlock(&stage.lock);
+    }
+
+    pthread_mutex_lock(&stage.lock);
+    stage.done = true;
+    pthread_cond_broadcast(&stage.cond);
+    pthread_mutex_unlock(&stage.lock);
+
+    pthread_join(thread, NULL);
+
+    ret = stage.failed ? -1 : 0;
+
+cleanup:
+    sqlite3_free(stage.chunk[0]);
+    sqlite3_free(stage.chunk[1]);
+    sqlite3_free(stage.out);
+    return ret;
+}
+
+
+// Stream a snapshot of a database (usually "main") to snapshot->sink in
+// fixed-size chunks, so that memory use is bounded by the chunk size no
+// matter how large the database is.
+//
+// For an in-memory (memdb) database the image is already contiguous in
+// memory; sqlite3_serialize with SQLITE_SERIALIZE_NOCOPY hands out a pointer
+// to it and the chunks are taken from there without copying. For a
+// file-backed database the pages are read from the database file inside a read
+// transaction, with compression running on a second thread while the next
+// chunk is read. Anything else (a :memory: or temp database) has no file, and
+// is copied out with sqlite3_serialize first.
+//
+// Reading the file directly is only consistent if everything is in the
+// database file, so in wal mode the wal is checkpointed first. This assumes
+// that example is the only writer, so nothing lands in the wal between the
+// checkpoint and the read transaction; the wal size is checked once the
+// read transaction is open and the snapshot fails otherwise.
+int example_snapshot (
+    struct example_s * example,
+    const char * const schema,
+    struct example_snapshot_s * snapshot
+)
+{
+
+    int ret = 0;
+    char sql[128];
+    char journal_mode[16];
+    int64_t page_count = 0;
+    int64_t page_size = 0;
+    uint8_t * image = NULL;
+    sqlite3_int64 image_len = 0;
+    const char * filename = sqlite3_db_filename(example->db, schema);
+
+    snapshot->raw_len = 0;
+    snapshot->out_len = 0;
+
+    sqlite3_snprintf(sizeof(sql), sql, "\"%w\".journal_mode", schema);
+    ret = example_pragma_get(example, sql, NULL, journal_mode, sizeof(journal_mode));
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        return -1;
+    }
+
+    if (0 == strcmp(journal_mode, "wal")) {
+        sqlite3_snprintf(sizeof(sql), sql, "\"%w\".wal_checkpoint(truncate)", schema);
+        ret = example_pragma_get(example, sql, &page_count, NULL, 0);
+        if (-1 == ret || 0 != page_count) {
+            EXAMPLE_LOG(LOG_ERR, "wal checkpoint failed or was blocked");
+            return -1;
+        }
+    }
+
+    // hold a read transaction for the duration of the snapshot, so that no
+    // other connection can change the database under us.
+    ret = example_stmt_exec(example, EXAMPLE_STMT_BEGIN_READ);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+        return -1;
+    }
+
+    // page_count reads the database, which is what actually starts the read
+    // transaction.
+    sqlite3_snprintf(sizeof(sql), sql, "\"%w\".page_count", schema);
+    ret = example_pragma_get(example, sql, &page_count, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        goto rollback;
+    }
+
+    sqlite3_snprintf(sizeof(sql), sql, "\"%w\".page_size", schema);
+    ret = example_pragma_get(example, sql, &page_size, NULL, 0);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pragma_get returned -1");
+        goto rollback;
+    }
+
+    snapshot->raw_len = page_count * page_size;
+
+    image = sqlite3_serialize(
+        /* db = */ example->db,
+        /* schema = */ schema,
+        /* db_len = */ &image_len,
+        /* flags = */ SQLITE_SERIALIZE_NOCOPY
+    );
+
+    if (NULL != image) {
+        // zero-copy path; the compressor works on the image directly
+        ret = example_snapshot_image(snapshot, image, image_len, page_size);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_snapshot_image returned -1");
+            goto rollback;
+        }
+    }
+    else if (NULL == filename || '\0' == filename[0]) {
+        // a :memory: or temp database, no file to read the pages from;
+        // sqlite3_serialize copies them out of the pager instead
+        image = sqlite3_serialize(example->db, schema, &image_len, 0);
+        if (NULL == image) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_serialize returned NULL");
+            goto rollback;
+        }
+        ret = example_snapshot_image(snapshot, image, image_len, page_size);
+        sqlite3_free(image);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_snapshot_image returned -1");
+            goto rollback;
+        }
+    }
+    else {
+        if (0 == strcmp(journal_mode, "wal")) {
+            sqlite3_file * wal = NULL;
+            sqlite3_int64 wal_len = 0;
+            ret = sqlite3_file_control(example->db, schema, SQLITE_FCNTL_JOURNAL_POINTER, &wal);
+            if (SQLITE_OK == ret && NULL != wal && NULL != wal->pMethods) {
+                ret = wal->pMethods->xFileSize(wal, &wal_len);
+                if (SQLITE_OK != ret || 0 != wal_len) {
+                    EXAMPLE_LOG(LOG_ERR, "the wal was written to after the checkpoint");
+                    goto rollback;
+                }
+            }
+        }
+
+        ret = example_snapshot_file(example, schema, snapshot, page_count, page_size);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_snapshot_file returned -1");
+            goto rollback;
+        }
+    }
+
+    ret = example_stmt_exec(example, EXAMPLE_STMT_COMMIT);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stmt_exec returned -1");
+        return -1;
+    }
+
+    return 0;
+
+rollback:
+    (void)example_stmt_exec(example, EXAMPLE_STMT_ROLLBACK);
+    return -1;
+}
+
+
+int example_serialize_sink (
+    void * user_data,
+    const uint8_t * buf,
+    size_t len
+)
+{
+    // compress (buf, len) using something
+
+    // send (buf, len) somewhere
+
     return 0;
+    (void)user_data;
+    (void)buf;
+    (void)len;
 }
 
 
-int example_init_schema_migration (
+int example_serialize (
     struct example_s * example
 )
 {
 
     int ret = 0;
-    sqlite3_stmt * stmt = NULL;
-
-    // time to do schema migrations; find out which version we're running right now.
-    ret = sqlite3_prepare_v3(
-        /* db = */ example->db,
-        /* sql = */ "pragma user_version;",
-        /* sql_len = */ strlen("pragma user_version;"),
-        /* flags = */ SQLITE_PREPARE_NORMALIZE,
-        /* &stmt = */ &stmt,
-        /* &sql_end = */ NULL
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_prepare_v2 returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
-        return -1;
-    }
 
+    struct example_snapshot_s snapshot = {
+        .compressor = NULL,
+        .sink = example_serialize_sink,
+        .user_data = NULL,
+        .chunk_pages = 0
+    };
 
-    ret = sqlite3_step(stmt);
-    if (SQLITE_ROW != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_step returned %d: %s",
-                __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    ret = example_snapshot(example, "main", &snapshot);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_snapshot returned -1");
         return -1;
     }
 
+    printf("db_len=%llu\n", (unsigned long long)snapshot.raw_len);
 
-    const int sqlite3_user_version = sqlite3_column_int(stmt, 0);
+    return 0;
+}
 
 
-    // Ok, we have the version, let's destroy the sqlite3 stmt and work on the
-    // schema resolution
-    ret = sqlite3_finalize(stmt);
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_finalize returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+// The state schema and the cached statements were set up for the deviceid
+// mode of the database example_init opened, so a snapshot has to be in the
+// same one, unless it's empty (user_version 0). pragma user_version and
+// application_id are big endian at offsets 60 and 68 of the header. Returns
+// -1 if the snapshot doesn't fit.
+int example_restore_deviceid_check (
+    const struct example_s * example,
+    const uint8_t * buf,
+    const size_t len
+)
+{
+
+    if (len < EXAMPLE_RESTORE_HEADER_LEN) {
+        EXAMPLE_LOG(LOG_ERR, "snapshot of %zu bytes is too short", len);
         return -1;
     }
 
+    const uint32_t version = (uint32_t)buf[60] << 24 | (uint32_t)buf[61] << 16 | (uint32_t)buf[62] << 8 | buf[63];
+    const uint32_t application_id = (uint32_t)buf[68] << 24 | (uint32_t)buf[69] << 16 | (uint32_t)buf[70] << 8 | buf[71];
 
-    // here you can add a switch-statement or something and patch the schema up
-    // to the most recent version.
-
-
-    // full database schema
-    if (0 == sqlite3_user_version) {
-        syslog(LOG_INFO, "%s:%d:%s: doing full schema migration", __FILE__, __LINE__, __func__);
-
-        ret = example_init_schema_migration_full(example);
-        if (-1 == ret) {
-            syslog(LOG_ERR, "%s:%d:%s: example_init_schema_migration_full returned -1", __FILE__, __LINE__, __func__);
-            return -1;
-        }
-
+    if (0 == version) {
         return 0;
     }
 
-    // current schema version
-    if (1 == sqlite3_user_version) {
-        return 0;
+    if (0 != application_id && EXAMPLE_APPLICATION_ID_PACKED != application_id) {
+        EXAMPLE_LOG(LOG_ERR, "snapshot has unknown application_id %u", application_id);
+        return -1;
     }
 
+    const bool packed = EXAMPLE_APPLICATION_ID_PACKED == application_id;
+    if (packed != example->deviceid_packed) {
+        EXAMPLE_LOG(LOG_ERR, "snapshot has %s deviceids, the database was opened with %s ones",
+            packed ? "packed" : "text", example->deviceid_packed ? "packed" : "text");
+        return -1;
+    }
 
-    // if we reach this point, the sqlite3 schema version is too new for us to
-    // handle; don't touch it!
-    syslog(LOG_ERR, "%s:%d:%s: sqlite3 schema version is too new; giving up", __FILE__, __LINE__, __func__);
-    return -1;
+    return 0;
 }
 
 
-int example_init_schema_memory (
-    struct example_s * example
+// Replace the main database with a snapshot image, e.g. one written by
+// example_snapshot without a compressor. The snapshot has to have the same
+// deviceid mode as the database it replaces, see
+// example_restore_deviceid_check.
+//
+// With EXAMPLE_RESTORE_READONLY, sqlite serves the database straight out of
+// buf without copying it, and buf must stay valid until the database is
+// closed or restored again; a snapshot of a wal database has to be switched
+// to the rollback journal in its header first, which example_restore_file
+// does on its private mapping. Otherwise the image is copied into a buffer owned
+// by sqlite which grows as the database is written to, and the schema is
+// migrated to the current version.
+//
+// The restored database is private to this connection; readers in a pool
+// that share the main database by name will not see it.
+int example_restore (
+    struct example_s * example,
+    const uint8_t * buf,
+    const size_t len,
+    const int flags
 )
 {
 
     int ret = 0;
-    char * err = NULL;
+    uint8_t * image = (uint8_t *)buf;
+    unsigned int deserialize_flags = SQLITE_DESERIALIZE_READONLY;
 
+    // a snapshot of a wal database says so in the file format bytes 18 and 19
+    // of its header; memdb can't do wal, and sqlite won't open it unless
+    // they're back to 1 (rollback journal).
+    const bool wal = EXAMPLE_RESTORE_HEADER_LEN <= len && (2 == buf[18] || 2 == buf[19]);
 
-    // attach in-memory database
-    ret = sqlite3_exec(
-        /* db = */ example->db,
-        /* sql = */ "attach ':memory:' as state;",
-        /* cb = */ NULL,
-        /* user_data = */ NULL,
-        /* err = */ &err
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_exec returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, err);
+    ret = example_restore_deviceid_check(example, buf, len);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_restore_deviceid_check returned -1");
         return -1;
     }
 
+    if (!(flags & EXAMPLE_RESTORE_READONLY)) {
+        image = sqlite3_malloc64(len);
+        if (NULL == image) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3_malloc64 returned NULL");
+            return -1;
+        }
+        memcpy(image, buf, len);
+        deserialize_flags = SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE;
+        if (wal) {
+            image[18] = 1;
+            image[19] = 1;
+        }
+    }
+    else if (wal) {
+        EXAMPLE_LOG(LOG_ERR, "snapshot of a wal database, can't serve it read-only as it is; "
+                "use example_restore_file or restore it writable");
+        return -1;
+    }
 
-    // create schema
-    err = NULL;
-    ret = sqlite3_exec(
+    // sqlite3_deserialize frees image on failure when FREEONCLOSE is set
+    ret = sqlite3_deserialize(
         /* db = */ example->db,
-        /* sql = */ example_memory_schema,
-        /* cb = */ NULL,
-        /* user_data = */ NULL,
-        /* err = */ &err
+        /* schema = */ "main",
+        /* data = */ image,
+        /* data_len = */ len,
+        /* buf_len = */ len,
+        /* flags = */ deserialize_flags
     );
     if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_exec returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, err);
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_deserialize returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    if (flags & EXAMPLE_RESTORE_READONLY) {
+        return 0;
+    }
+
+    // a new image, the online step has to set up again
+    example->migration_online_started = 0;
+
+    ret = example_init_schema_migration(example);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init_schema_migration returned -1");
         return -1;
     }
-    
 
     return 0;
 }
 
 
-int example_init_custom_agg_function (
-    struct example_s * example
+// Restore from a snapshot file. With EXAMPLE_RESTORE_READONLY the file is
+// mapped and served from the page cache as it is, so startup costs one mmap
+// no matter how large the snapshot is.
+int example_restore_file (
+    struct example_s * example,
+    const char * const path,
+    const int flags
 )
 {
 
     int ret = 0;
+    int fd = -1;
+    struct stat st = {0};
+    void * map = NULL;
 
-    ret = sqlite3_create_function_v2(
-        /* db = */ example->db,
-        /* function_name = */ "example_agg_f",
-        /* num_args = */ 3,
-        /* flags = */ SQLITE_UTF8 | SQLITE_DETERMINISTIC,
-        /* user_data = */ example,
-        /* func = */ NULL,
-        /* step = */ example_agg_f_step,
-        /* final = */ example_agg_f_final,
-        /* destroy = */ NULL
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_create_function_v2 returned %d: %s"
-                , __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd) {
+        EXAMPLE_LOG(LOG_ERR, "open %s: %s", path, strerror(errno));
         return -1;
     }
 
-    return 0;
-}
+    ret = fstat(fd, &st);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "fstat: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
 
+    if (0 == st.st_size) {
+        EXAMPLE_LOG(LOG_ERR, "%s is empty", path);
+        close(fd);
+        return -1;
+    }
 
-int example_init_custom_now_monotonic_function (
-    struct example_s * example
-)
-{
+    // private, so that the header of a wal snapshot can be patched without
+    // touching the file; only that page is copied.
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+        EXAMPLE_LOG(LOG_ERR, "mmap: %s", strerror(errno));
+        return -1;
+    }
 
-    int ret = 0;
+    uint8_t * header = map;
+    if (EXAMPLE_RESTORE_HEADER_LEN <= st.st_size && (2 == header[18] || 2 == header[19])) {
+        header[18] = 1;
+        header[19] = 1;
+    }
 
-    ret = sqlite3_create_function_v2(
-        /* db = */ example->db,
-        /* function_name = */ "now_monotonic",
-        /* num_args = */ 0,
-        /* flags = */ SQLITE_UTF8 | SQLITE_DETERMINISTIC,
-        /* user_data = */ example,
-        /* func = */ example_now_monotonic,
-        /* step = */ NULL,
-        /* final = */ NULL,
-        /* destroy = */ NULL
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_create_function_v2 returned %d: %s"
-                , __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    // a writable restore copies the image; the mapping is only needed for
+    // the duration of the copy.
+    if (!(flags & EXAMPLE_RESTORE_READONLY)) {
+        ret = example_restore(example, map, st.st_size, flags);
+        munmap(map, st.st_size);
+        return ret;
+    }
+
+    ret = example_restore(example, map, st.st_size, flags);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_restore returned -1");
+        munmap(map, st.st_size);
         return -1;
     }
 
+    // the previous mapping, if any, is no longer used by sqlite
+    if (NULL != example->restore_map) {
+        munmap(example->restore_map, example->restore_map_len);
+    }
+    example->restore_map = map;
+    example->restore_map_len = st.st_size;
+
     return 0;
 }
 
 
-int example_init (
-    struct example_s * example
+// Tables the session extension tracks.
+static const char * const example_session_tables[] = {
+    "devices",
+    "outputs",
+    "groups"
+};
+
+
+int example_session_create (
+    struct example_session_s * session
 )
 {
 
     int ret = 0;
-    char * err = NULL;
+    int enable = 1;
 
-    ret = sqlite3_initialize();
+    ret = sqlite3session_create(session->example->db, "main", &session->session);
     if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_initialize returned %d", __FILE__, __LINE__, __func__, ret);
+        EXAMPLE_LOG(LOG_ERR, "sqlite3session_create returned %d: %s",
+            ret, sqlite3_errmsg(session->example->db));
         return -1;
     }
 
-
-    // open database, create it if it doesn't exist
-    // useful flags: SQLITE_OPEN_READONLY, SQLITE_OPEN_READWRITE, SQLITE_OPEN_CREATE, SQLITE_OPEN_MEMORY
-    ret = sqlite3_open_v2(
-        /* path = */ "db.sqlite",
-        /* db = */ &example->db,
-        /* flags = */ SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MEMORY,
-        /* vfs = */ NULL
-    );
+    // keep a running total of the changeset size for
+    // sqlite3session_changeset_size
+    ret = sqlite3session_object_config(session->session, SQLITE_SESSION_OBJCONFIG_SIZE, &enable);
     if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_open_v2 returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+        EXAMPLE_LOG(LOG_ERR, "sqlite3session_object_config returned %d", ret);
+        sqlite3session_delete(session->session);
+        session->session = NULL;
         return -1;
     }
 
-
-    // enable foreign keys
-    ret = sqlite3_exec(
-        /* db = */ example->db,
-        /* sql = */ "pragma foreign_keys=1;",
-        /* cb = */ NULL,
-        /* user_data = */ NULL,
-        /* err = */ &err
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_exec returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, err);
-        return -1;
+    for (size_t i = 0; i < sizeof(example_session_tables) / sizeof(example_session_tables[0]); i++) {
+        ret = sqlite3session_attach(session->session, example_session_tables[i]);
+        if (SQLITE_OK != ret) {
+            EXAMPLE_LOG(LOG_ERR, "sqlite3session_attach returned %d on %s",
+                ret, example_session_tables[i]);
+            sqlite3session_delete(session->session);
+            session->session = NULL;
+            return -1;
+        }
     }
 
+    return 0;
+}
 
-    // migrate schema to current schema version
-    ret = example_init_schema_migration(example);
-    if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_init_schema_migration returned -1", __FILE__, __LINE__, __func__);
-        return -1;
-    }
 
+// Start recording changes made through example (the writer connection).
+// interval_s is in seconds, size_threshold in bytes; 0 disables either.
+int example_session_start (
+    struct example_session_s * session,
+    struct example_s * example,
+    const bool patchset,
+    const int64_t size_threshold,
+    const uint32_t interval_s,
+    int (*sink)(void * user_data, const void * changeset, int changeset_len),
+    void * user_data
+)
+{
+
+    int ret = 0;
+
+    session->example = example;
+    session->patchset = patchset;
+    session->size_threshold = size_threshold;
+    session->interval = (uint64_t)interval_s << 32;
+    session->sink = sink;
+    session->user_data = user_data;
 
-    // attach in-memory database on top and set up schemas
-    ret = example_init_schema_memory(example);
+    ret = example_monotonic_now(example->clock_id, &session->last_flush);
     if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_init_schema_memory returned -1", __FILE__, __LINE__, __func__);
+        EXAMPLE_LOG(LOG_ERR, "example_monotonic_now returned -1");
         return -1;
     }
 
-
-
-    // create custom aggregate function
-    ret = example_init_custom_agg_function(example);
+    ret = example_session_create(session);
     if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_init_custom_agg_function returned -1", __FILE__, __LINE__, __func__);
+        EXAMPLE_LOG(LOG_ERR, "example_session_create returned -1");
         return -1;
     }
 
+    session->sentinel = EXAMPLE_SESSION_SENTINEL;
 
     return 0;
 }
 
 
-
-int example_device_new (
-    struct example_s * example,
-    const char * const deviceid,
-    const uint32_t deviceid_len
+// Hand everything recorded so far to the sink and start over with an empty
+// session. There's no way to clear a session, so it's replaced with a fresh
+// one; the caller has to hold the writer, or changes made in between are
+// lost.
+int example_session_flush (
+    struct example_session_s * session
 )
 {
 
     int ret = 0;
-    sqlite3_stmt * stmt = NULL;
+    int changeset_len = 0;
+    void * changeset = NULL;
 
-
-    // prepare statement
-    ret = sqlite3_prepare_v3(
-        /* db = */ example->db,
-        /* sql = */ "insert into devices(deviceid) values (?);",
-        /* sql_len = */ strlen("insert into devices(deviceid) values (?);"),
-        /* flags = */ SQLITE_PREPARE_NORMALIZE,
-        /* &stmt = */ &stmt,
-        /* &sql_end = */ NULL
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_prepare_v2 returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    ret = example_monotonic_now(session->example->clock_id, &session->last_flush);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_monotonic_now returned -1");
         return -1;
     }
 
+    if (sqlite3session_isempty(session->session)) {
+        return 0;
+    }
 
-    // bind deviceid
-    ret = sqlite3_bind_text(
-        /* stmt = */ stmt,
-        /* index = */ 1,
-        /* text = */ deviceid,
-        /* text_len = */ deviceid_len,
-        /* destructor = */ SQLITE_STATIC
-    );
-    if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_bind_text returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    ret = session->patchset
+        ? sqlite3session_patchset(session->session, &changeset_len, &changeset)
+        : sqlite3session_changeset(session->session, &changeset_len, &changeset);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3session_changeset returned %d", ret);
         return -1;
-
     }
 
-
-    // execute query
-    ret = sqlite3_step(stmt);
-    if (SQLITE_DONE != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_step returned %d: %s",
-                __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
-        return -1;
+    if (0 < changeset_len) {
+        ret = session->sink(session->user_data, changeset, changeset_len);
+        if (-1 == ret) {
+            // keep the session around so that the changes can be retried
+            EXAMPLE_LOG(LOG_ERR, "sink returned -1");
+            sqlite3_free(changeset);
+            return -1;
+        }
     }
+    sqlite3_free(changeset);
 
+    sqlite3session_delete(session->session);
+    session->session = NULL;
 
-    // cleanup
-    ret = sqlite3_finalize(stmt);
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_finalize returned %d: %s",
-            __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    ret = example_session_create(session);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_session_create returned -1");
         return -1;
     }
 
-
     return 0;
 }
 
 
-int example_custom_aggregate_query (
-    struct example_s * example
+// Flush if the changes have grown past the size threshold or the interval
+// has passed; call this periodically, e.g. after each write batch.
+int example_session_poll (
+    struct example_session_s * session
 )
 {
 
     int ret = 0;
-    sqlite3_stmt * stmt;
-    
-    ret = sqlite3_prepare_v3(
-        /* db = */ example->db,
-        /* sql = */ "select example_agg_f(deviceid, outputid, groupid) from groups group by groups.groupid",
-        /* sql_len = */ strlen("select example_agg_f(deviceid, outputid, groupid) from groups group by groups.groupid"),
-        /* flags = */ SQLITE_PREPARE_NORMALIZE,
-        /* &stmt = */ &stmt,
-        /* &sql_end = */ NULL
-    );
-    if (SQLITE_OK != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_prepare_v3 returned %d: %s",
-                __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
+    uint64_t now = 0;
+
+    if (0 != session->size_threshold &&
+        session->size_threshold <= sqlite3session_changeset_size(session->session))
+    {
+        return example_session_flush(session);
+    }
+
+    ret = example_monotonic_now(session->example->clock_id, &now);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_monotonic_now returned -1");
         return -1;
     }
 
+    if (0 != session->interval && session->interval <= now - session->last_flush) {
+        return example_session_flush(session);
+    }
+
+    return 0;
+}
 
-    for (int i = 0; i < EXAMPLE_MAX_QUERY_LOOP_STEPS; i++) {
-        ret = sqlite3_step(stmt);
-        if (SQLITE_DONE == ret) {
-            break;
-        }
-        if (SQLITE_ROW != ret) {
-            syslog(LOG_ERR, "%s:%d:%s: sqlite3_step returned %d: %s",
-                    __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
-            return -1;
-        }
 
-        const struct example_agg_f_s * res = sqlite3_column_blob(stmt, 0);
-        syslog(LOG_INFO, "%s:%d:%s: res->aggregate=%d", __FILE__, __LINE__, __func__, res->aggregate);
+// Stop recording; anything recorded since the last flush is discarded.
+void example_session_stop (
+    struct example_session_s * session
+)
+{
+    if (EXAMPLE_SESSION_SENTINEL != session->sentinel) {
+        return;
     }
-    if (SQLITE_DONE != ret) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_step returned %d: %s",
-                __FILE__, __LINE__, __func__, ret, sqlite3_errmsg(example->db));
-        return -1;
+
+    sqlite3session_delete(session->session);
+    session->session = NULL;
+    session->sentinel = 0;
+}
+
+
+// conflict handler for example_changeset_apply; the changeset comes from the
+// primary, so its version of a row wins.
+int example_changeset_conflict (
+    void * user_data,
+    int conflict,
+    sqlite3_changeset_iter * iter
+)
+{
+
+    struct example_changeset_apply_s * apply = user_data;
+
+    switch (conflict) {
+        // the row is there but doesn't look the way the primary had it, or
+        // an insert hit an existing primary key: take the primary's version
+        case SQLITE_CHANGESET_DATA:
+        case SQLITE_CHANGESET_CONFLICT:
+            apply->replaced += 1;
+            return SQLITE_CHANGESET_REPLACE;
+
+        // updating or deleting a row that isn't there; nothing to do
+        case SQLITE_CHANGESET_NOTFOUND:
+            apply->omitted += 1;
+            return SQLITE_CHANGESET_OMIT;
+
+        // check constraints or foreign keys fail; the replica has diverged
+        // from the primary and needs a full snapshot
+        case SQLITE_CHANGESET_CONSTRAINT:
+        case SQLITE_CHANGESET_FOREIGN_KEY:
+        default:
+            apply->aborted += 1;
+            return SQLITE_CHANGESET_ABORT;
     }
 
-    return 0;
+    (void)iter;
 }
 
 
-int example_serialize (
-    struct example_s * example
+// Apply a changeset or patchset produced by example_session_flush on a
+// replica. All of it is applied, or none of it.
+int example_changeset_apply (
+    struct example_s * example,
+    const void * changeset,
+    const int changeset_len,
+    struct example_changeset_apply_s * apply
 )
 {
 
     int ret = 0;
 
-    uint8_t * db;
-    sqlite3_int64 db_len = 0;
+    apply->replaced = 0;
+    apply->omitted = 0;
+    apply->aborted = 0;
 
-    db = sqlite3_serialize(
+    ret = sqlite3changeset_apply_v2(
         /* db = */ example->db,
-        /* schema = */ "main",
-        /* db_len = */ &db_len,
+        /* changeset_len = */ changeset_len,
+        /* changeset = */ (void *)changeset,
+        /* filter = */ NULL,
+        /* conflict = */ example_changeset_conflict,
+        /* user_data = */ apply,
+        /* rebase = */ NULL,
+        /* rebase_len = */ NULL,
         /* flags = */ 0
     );
-    if (-1 == db_len) {
-        syslog(LOG_ERR, "%s:%d:%s: sqlite3_serialize returned -1", __FILE__, __LINE__, __func__);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3changeset_apply_v2 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
         return -1;
     }
 
-    printf("db_len=%lld\n", db_len);
-
-    // compress (db, db_len) using something
+    return 0;
+}
 
-    // send (db, db_len) somewhere
 
+// left out by drivers which include this file, e.g. src/example_bench.c
+#ifndef EXAMPLE_NO_MAIN
+int example_main_aggregate_count (
+    void * user_data,
+    int64_t aggregate
+)
+{
+    uint64_t * aggregates = user_data;
+    (*aggregates)++;
     return 0;
+    (void)aggregate;
 }
 
 
@@ -615,9 +9823,23 @@ int main (
 
     openlog("example", LOG_CONS | LOG_PID, LOG_USER);
 
-    ret = example_init(&example);
+    // flushes the logger on any return from main
+    ret = example_log_start(/* poll_interval_us = */ 10000);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_log_start returned -1");
+        return -1;
+    }
+    atexit(example_log_stop);
+
+    ret = example_global_init(&example_global_config_default);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_global_init returned -1");
+        return -1;
+    }
+
+    ret = example_init(&example, &example_config_default);
     if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_init returned -1", __FILE__, __LINE__, __func__);
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
         return -1;
     }
 
@@ -627,26 +9849,39 @@ int main (
         /* deviceid_len = */ 12
     );
     if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_device_new returned -1", __FILE__, __LINE__, __func__);
+        EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
         return -1;
     }
 
-    ret = example_custom_aggregate_query(&example);
+    uint64_t aggregates = 0;
+    ret = example_custom_aggregate_query(&example, example_main_aggregate_count, &aggregates);
     if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_custom_aggregate_query returned -1", __FILE__, __LINE__, __func__);
+        EXAMPLE_LOG(LOG_ERR, "example_custom_aggregate_query returned -1");
         return -1;
     }
 
 
+    EXAMPLE_LOG(LOG_INFO, "%llu aggregates", (unsigned long long)aggregates);
+
+
     ret = example_serialize(&example);
     if (-1 == ret) {
-        syslog(LOG_ERR, "%s:%d:%s: example_serialize returned -1", __FILE__, __LINE__, __func__);
+        EXAMPLE_LOG(LOG_ERR, "example_serialize returned -1");
         return -1;
     }
 
-    syslog(LOG_INFO, "%s:%d:%s: ok", __FILE__, __LINE__, __func__);
+    EXAMPLE_LOG(LOG_INFO, "ok");
+
+    example_deinit(&example);
+
+    ret = example_global_deinit();
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_global_deinit returned -1");
+        return -1;
+    }
 
     return 0;
     (void)argc;
     (void)argv;
 }
+#endif
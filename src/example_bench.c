@@ -0,0 +1,532 @@
+// Benchmark driver for `make bench`: runs every workload against fresh
+// in-memory databases and prints one JSON object with the results on stdout,
+// for tracking regressions between releases. Errors go to syslog and stderr.
+//
+//   ./example_bench [groups ...]
+//
+// groups are the sizes of the groups table for the aggregate query, 1000,
+// 100000 and 10000000 by default.
+
+#define EXAMPLE_NO_MAIN
+#include "example.c"
+
+#include <sys/resource.h>
+
+// rows for the device_new, bulk insert and upsert workloads
+#define EXAMPLE_BENCH_ROWS 100000
+
+// outputs per device, and group rows per groupid, in the aggregate dataset
+#define EXAMPLE_BENCH_OUTPUTS_PER_DEVICE 8
+#define EXAMPLE_BENCH_ROWS_PER_GROUP 4
+
+// rows per call to the batch insert functions when building datasets
+#define EXAMPLE_BENCH_CHUNK 65536
+
+// runs of the aggregate query per size; the median is reported
+#define EXAMPLE_BENCH_AGGREGATE_RUNS 5
+
+
+// One workload result; ops is what ops_per_sec counts, e.g. rows.
+struct example_bench_result_s {
+    const char * name;
+    uint64_t n;
+    uint64_t ops;
+    double seconds;
+    double seconds_min;
+    uint64_t bytes;
+    long peak_rss_kib;
+};
+
+
+double example_bench_now (
+    void
+)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+long example_bench_peak_rss_kib (
+    void
+)
+{
+    struct rusage usage;
+    if (0 != getrusage(RUSAGE_SELF, &usage)) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+
+void example_bench_print (
+    const struct example_bench_result_s * result,
+    bool last
+)
+{
+    printf("    {\"name\": \"%s\", \"n\": %llu, \"seconds\": %.6f, ",
+        result->name, (unsigned long long)result->n, result->seconds);
+    if (0 < result->seconds_min) {
+        printf("\"seconds_min\": %.6f, ", result->seconds_min);
+    }
+    if (0 < result->ops) {
+        printf("\"ops_per_sec\": %.0f, ", result->ops / result->seconds);
+    }
+    if (0 < result->bytes) {
+        printf("\"bytes\": %llu, ", (unsigned long long)result->bytes);
+    }
+    printf("\"peak_rss_kib\": %ld}%s\n", result->peak_rss_kib, last ? "" : ",");
+}
+
+
+// Each workload gets a database of its own, named after it so that nothing
+// is shared with the previous one.
+int example_bench_open (
+    struct example_s * example,
+    const char * name
+)
+{
+
+    int ret = 0;
+    char path[128];
+    char state_path[128];
+    struct example_config_s config = example_config_default;
+
+    snprintf(path, sizeof(path), "file:/bench-%s.sqlite?vfs=memdb", name);
+    snprintf(state_path, sizeof(state_path), "file:/bench-%s-state?vfs=memdb", name);
+    config.path = path;
+    config.state_path = state_path;
+
+    memset(example, 0, sizeof(*example));
+
+    ret = example_init(example, &config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void example_bench_deviceid (
+    uint64_t i,
+    char deviceid[13]
+)
+{
+    snprintf(deviceid, 13, "%012llx", (unsigned long long)i);
+}
+
+
+// example_device_new, one autocommit transaction per device
+int example_bench_device_new (
+    struct example_bench_result_s * result
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    char deviceid[13];
+
+    ret = example_bench_open(&example, "device_new");
+    if (-1 == ret) {
+        return -1;
+    }
+
+    const double start = example_bench_now();
+    for (uint64_t i = 0; i < EXAMPLE_BENCH_ROWS; i++) {
+        example_bench_deviceid(i, deviceid);
+        ret = example_device_new(&example, deviceid, 12);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
+            example_deinit(&example);
+            return -1;
+        }
+    }
+    result->seconds = example_bench_now() - start;
+
+    result->name = "device_new";
+    result->n = EXAMPLE_BENCH_ROWS;
+    result->ops = EXAMPLE_BENCH_ROWS;
+    result->peak_rss_kib = example_bench_peak_rss_kib();
+
+    example_deinit(&example);
+
+    return 0;
+}
+
+
+// Insert devices [first, first + n) and their outputs, and with groups one
+// group row per output, EXAMPLE_BENCH_ROWS_PER_GROUP outputs per groupid;
+// in chunks of EXAMPLE_BENCH_CHUNK rows.
+int example_bench_load (
+    struct example_s * example,
+    uint64_t devices_len,
+    bool groups,
+    bool fk_deferred
+)
+{
+
+    int ret = 0;
+    char (*ids)[13] = NULL;
+    struct example_device_s * devices = NULL;
+    struct example_output_s * outputs = NULL;
+    struct example_group_s * group_rows = NULL;
+    struct example_batch_s batch = {.batch_size = 0, .fk_deferred = fk_deferred};
+    const uint64_t chunk_devices = EXAMPLE_BENCH_CHUNK / EXAMPLE_BENCH_OUTPUTS_PER_DEVICE;
+
+    ids = calloc(chunk_devices, sizeof(ids[0]));
+    devices = calloc(chunk_devices, sizeof(devices[0]));
+    outputs = calloc(EXAMPLE_BENCH_CHUNK, sizeof(outputs[0]));
+    group_rows = calloc(EXAMPLE_BENCH_CHUNK, sizeof(group_rows[0]));
+    if (NULL == ids || NULL == devices || NULL == outputs || NULL == group_rows) {
+        EXAMPLE_LOG(LOG_ERR, "calloc: %s", strerror(errno));
+        ret = -1;
+        goto cleanup;
+    }
+
+    for (uint64_t first = 0; first < devices_len; first += chunk_devices) {
+        const uint32_t n = (devices_len - first < chunk_devices) ? devices_len - first : chunk_devices;
+        uint32_t outputs_len = 0;
+
+        for (uint32_t i = 0; i < n; i++) {
+            example_bench_deviceid(first + i, ids[i]);
+            devices[i] = (struct example_device_s){.deviceid = ids[i], .deviceid_len = 12};
+            for (int j = 0; j < EXAMPLE_BENCH_OUTPUTS_PER_DEVICE; j++) {
+                const uint64_t row = (first + i) * EXAMPLE_BENCH_OUTPUTS_PER_DEVICE + j;
+                outputs[outputs_len] = (struct example_output_s){
+                    .deviceid = ids[i], .deviceid_len = 12, .outputid = j
+                };
+                group_rows[outputs_len] = (struct example_group_s){
+                    .deviceid = ids[i], .deviceid_len = 12, .outputid = j,
+                    .groupid = row / EXAMPLE_BENCH_ROWS_PER_GROUP
+                };
+                outputs_len++;
+            }
+        }
+
+        ret = example_devices_insert_batch(example, devices, n, &batch);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_devices_insert_batch returned -1");
+            goto cleanup;
+        }
+
+        ret = example_outputs_insert_batch(example, outputs, outputs_len, &batch);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_outputs_insert_batch returned -1");
+            goto cleanup;
+        }
+
+        if (groups) {
+            ret = example_groups_insert_batch(example, group_rows, outputs_len, &batch);
+            if (-1 == ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_groups_insert_batch returned -1");
+                goto cleanup;
+            }
+        }
+    }
+
+cleanup:
+    free(ids);
+    free(devices);
+    free(outputs);
+    free(group_rows);
+    return ret;
+}
+
+
+// devices and outputs through the batch insert functions, with foreign keys
+// checked per row or deferred to the end of each batch
+int example_bench_bulk_insert (
+    struct example_bench_result_s * result,
+    bool fk_deferred
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    const uint64_t devices_len = EXAMPLE_BENCH_ROWS / EXAMPLE_BENCH_OUTPUTS_PER_DEVICE;
+
+    result->name = fk_deferred ? "bulk_insert_fk_deferred" : "bulk_insert";
+
+    ret = example_bench_open(&example, result->name);
+    if (-1 == ret) {
+        return -1;
+    }
+
+    const double start = example_bench_now();
+    ret = example_bench_load(&example, devices_len, false, fk_deferred);
+    result->seconds = example_bench_now() - start;
+    if (-1 == ret) {
+        example_deinit(&example);
+        return -1;
+    }
+
+    result->n = devices_len * (1 + EXAMPLE_BENCH_OUTPUTS_PER_DEVICE);
+    result->ops = result->n;
+    result->peak_rss_kib = example_bench_peak_rss_kib();
+
+    example_deinit(&example);
+
+    return 0;
+}
+
+
+// example_measured_upsert, EXAMPLE_WRITER_BATCH_MAX per transaction like the
+// writer thread: once inserting all keys, then updating them all.
+int example_bench_upsert (
+    struct example_bench_result_s * result,
+    bool skip_unchanged
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    char deviceid[13];
+    const uint64_t rounds = 2;
+
+    result->name = skip_unchanged ? "measured_upsert_skip_unchanged" : "measured_upsert";
+
+    ret = example_bench_open(&example, result->name);
+    if (-1 == ret) {
+        return -1;
+    }
+
+    const double start = example_bench_now();
+    for (uint64_t round = 0; round < rounds; round++) {
+        for (uint64_t i = 0; i < EXAMPLE_BENCH_ROWS; i++) {
+            if (0 == i % EXAMPLE_WRITER_BATCH_MAX) {
+                ret = example_stmt_exec(&example, EXAMPLE_STMT_BEGIN);
+                if (-1 == ret) {
+                    goto error;
+                }
+            }
+
+            const int32_t level = (i + round) % 100;
+            example_bench_deviceid(i / EXAMPLE_BENCH_OUTPUTS_PER_DEVICE, deviceid);
+            ret = example_measured_upsert(
+                /* example = */ &example,
+                /* deviceid = */ deviceid,
+                /* deviceid_len = */ 12,
+                /* outputid = */ i % EXAMPLE_BENCH_OUTPUTS_PER_DEVICE,
+                /* state = */ i & 1,
+                /* level = */ &level,
+                /* timestamp = */ i + 1,
+                /* skip_unchanged = */ skip_unchanged
+            );
+            if (0 != ret) {
+                EXAMPLE_LOG(LOG_ERR, "example_measured_upsert returned %d", ret);
+                (void)example_stmt_exec(&example, EXAMPLE_STMT_ROLLBACK);
+                goto error;
+            }
+
+            if (EXAMPLE_WRITER_BATCH_MAX - 1 == i % EXAMPLE_WRITER_BATCH_MAX || EXAMPLE_BENCH_ROWS - 1 == i) {
+                ret = example_stmt_exec(&example, EXAMPLE_STMT_COMMIT);
+                if (-1 == ret) {
+                    goto error;
+                }
+            }
+        }
+    }
+    result->seconds = example_bench_now() - start;
+
+    result->n = EXAMPLE_BENCH_ROWS;
+    result->ops = rounds * EXAMPLE_BENCH_ROWS;
+    result->peak_rss_kib = example_bench_peak_rss_kib();
+
+    example_deinit(&example);
+
+    return 0;
+
+error:
+    example_deinit(&example);
+    return -1;
+}
+
+
+int example_bench_aggregate_count (
+    void * user_data,
+    int64_t aggregate
+)
+{
+    uint64_t * aggregates = user_data;
+    (*aggregates)++;
+    return 0;
+    (void)aggregate;
+}
+
+
+int example_bench_snapshot_sink (
+    void * user_data,
+    const uint8_t * buf,
+    size_t len
+)
+{
+    return 0;
+    (void)user_data;
+    (void)buf;
+    (void)len;
+}
+
+
+int example_bench_double_cmp (
+    const void * a,
+    const void * b
+)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+// example_custom_aggregate_query over a groups table of groups_len rows, and
+// then a snapshot of the database (what example_serialize does, without its
+// printf) since the dataset is there anyway.
+int example_bench_aggregate (
+    struct example_bench_result_s * aggregate,
+    struct example_bench_result_s * serialize,
+    uint64_t groups_len
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    char name[64];
+    double runs[EXAMPLE_BENCH_AGGREGATE_RUNS];
+    const int runs_len = 1000000 < groups_len ? 1 : EXAMPLE_BENCH_AGGREGATE_RUNS;
+    uint64_t aggregates = 0;
+
+    snprintf(name, sizeof(name), "aggregate-%llu", (unsigned long long)groups_len);
+
+    ret = example_bench_open(&example, name);
+    if (-1 == ret) {
+        return -1;
+    }
+
+    const uint64_t devices_len = (groups_len + EXAMPLE_BENCH_OUTPUTS_PER_DEVICE - 1) / EXAMPLE_BENCH_OUTPUTS_PER_DEVICE;
+    ret = example_bench_load(&example, devices_len, true, false);
+    if (-1 == ret) {
+        example_deinit(&example);
+        return -1;
+    }
+
+    for (int i = 0; i < runs_len; i++) {
+        aggregates = 0;
+        const double start = example_bench_now();
+        ret = example_custom_aggregate_query(&example, example_bench_aggregate_count, &aggregates);
+        runs[i] = example_bench_now() - start;
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_custom_aggregate_query returned -1");
+            example_deinit(&example);
+            return -1;
+        }
+    }
+    qsort(runs, runs_len, sizeof(runs[0]), example_bench_double_cmp);
+
+    aggregate->name = "aggregate_query";
+    aggregate->n = devices_len * EXAMPLE_BENCH_OUTPUTS_PER_DEVICE;
+    aggregate->ops = aggregate->n;
+    aggregate->seconds = runs[runs_len / 2];
+    aggregate->seconds_min = runs[0];
+    aggregate->peak_rss_kib = example_bench_peak_rss_kib();
+
+    struct example_snapshot_s snapshot = {
+        .compressor = NULL,
+        .sink = example_bench_snapshot_sink,
+        .user_data = NULL,
+        .chunk_pages = 0
+    };
+
+    const double start = example_bench_now();
+    ret = example_snapshot(&example, "main", &snapshot);
+    serialize->seconds = example_bench_now() - start;
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_snapshot returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    serialize->name = "serialize";
+    serialize->n = aggregate->n;
+    serialize->bytes = snapshot.raw_len;
+    serialize->peak_rss_kib = example_bench_peak_rss_kib();
+
+    example_deinit(&example);
+
+    return 0;
+}
+
+
+int main (
+    int argc,
+    char const* argv[]
+)
+{
+
+    int ret = 0;
+    uint64_t sizes[16] = {1000, 100000, 10000000};
+    int sizes_len = 3;
+    struct example_bench_result_s results[8 + 2 * 16] = {0};
+    int results_len = 0;
+
+    openlog("example_bench", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    // the 10M groups dataset doesn't fit into the default 1GiB a memdb
+    // database may grow to; has to come before sqlite3_initialize.
+    ret = sqlite3_config(SQLITE_CONFIG_MEMDB_MAXSIZE, (sqlite3_int64)16 << 30);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_config returned %d", ret);
+        return 1;
+    }
+
+    if (1 < argc) {
+        sizes_len = 0;
+        for (int i = 1; i < argc && sizes_len < 16; i++) {
+            sizes[sizes_len++] = strtoull(argv[i], NULL, 10);
+        }
+    }
+
+    ret = example_bench_device_new(&results[results_len++]);
+    if (-1 == ret) {
+        return 1;
+    }
+
+    ret = example_bench_bulk_insert(&results[results_len++], false);
+    if (-1 == ret) {
+        return 1;
+    }
+
+    ret = example_bench_bulk_insert(&results[results_len++], true);
+    if (-1 == ret) {
+        return 1;
+    }
+
+    ret = example_bench_upsert(&results[results_len++], false);
+    if (-1 == ret) {
+        return 1;
+    }
+
+    ret = example_bench_upsert(&results[results_len++], true);
+    if (-1 == ret) {
+        return 1;
+    }
+
+    for (int i = 0; i < sizes_len; i++) {
+        ret = example_bench_aggregate(&results[results_len], &results[results_len + 1], sizes[i]);
+        if (-1 == ret) {
+            return 1;
+        }
+        results_len += 2;
+    }
+
+    printf("{\n  \"sqlite_version\": \"%s\",\n  \"results\": [\n", sqlite3_libversion());
+    for (int i = 0; i < results_len; i++) {
+        example_bench_print(&results[i], results_len - 1 == i);
+    }
+    printf("  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,1418 @@
+// Regression checks for `make check`: each check runs against databases of
+// its own, and logs what went wrong to syslog and stderr. Exits non-zero if
+// any of them failed. Checks of things that are supposed to fail leave the
+// errors those log on stderr too.
+//
+//   ./example_check [name ...]
+//
+// runs only the checks with the given names.
+
+#define EXAMPLE_NO_MAIN
+#include "example.c"
+
+#include <poll.h>
+
+
+struct example_check_s {
+    const char * name;
+    int (*run)(void);
+};
+
+
+// A sink for example_snapshot which keeps the image in memory.
+struct example_check_image_s {
+    uint8_t * buf;
+    size_t len;
+    size_t cap;
+};
+
+
+int example_check_image_sink (
+    void * user_data,
+    const uint8_t * buf,
+    size_t len
+)
+{
+    struct example_check_image_s * image = user_data;
+
+    if (image->cap < image->len + len) {
+        const size_t cap = 2 * (image->len + len);
+        uint8_t * grown = realloc(image->buf, cap);
+        if (NULL == grown) {
+            EXAMPLE_LOG(LOG_ERR, "realloc: %s", strerror(errno));
+            return -1;
+        }
+        image->buf = grown;
+        image->cap = cap;
+    }
+
+    memcpy(image->buf + image->len, buf, len);
+    image->len += len;
+
+    return 0;
+}
+
+
+int example_check_open (
+    struct example_s * example,
+    const char * path,
+    const char * state_path
+)
+{
+
+    int ret = 0;
+    struct example_config_s config = example_config_default;
+
+    config.path = path;
+    config.state_path = state_path;
+
+    memset(example, 0, sizeof(*example));
+
+    ret = example_init(example, &config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(example);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int64_t example_check_count (
+    struct example_s * example,
+    const char * sql
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = NULL;
+    int64_t count = -1;
+
+    ret = sqlite3_prepare_v2(example->db, sql, -1, &stmt, NULL);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v2 returned %d: %s",
+                ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    if (SQLITE_ROW == sqlite3_step(stmt)) {
+        count = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    return count;
+}
+
+
+// A snapshot of a database without a file behind it (:memory:, or "" for a
+// temp database) is copied out with sqlite3_serialize, and restores into the
+// same rows.
+int example_check_snapshot_memory (
+    void
+)
+{
+
+    int ret = 0;
+    const char * const paths[] = {":memory:", ""};
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        struct example_s example;
+        struct example_s restored;
+        struct example_check_image_s image = {0};
+        struct example_snapshot_s snapshot = {
+            .sink = example_check_image_sink,
+            .user_data = &image,
+            .chunk_pages = 2
+        };
+
+        ret = example_check_open(&example, paths[i], "file:/check-snapshot-state?vfs=memdb");
+        if (-1 == ret) {
+            return -1;
+        }
+
+        ret = example_device_new(&example, "000000000001", 12);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
+            example_deinit(&example);
+            return -1;
+        }
+
+        ret = example_snapshot(&example, "main", &snapshot);
+        example_deinit(&example);
+        if (-1 == ret || 0 == image.len || image.len != snapshot.raw_len) {
+            EXAMPLE_LOG(LOG_ERR, "snapshot of \"%s\" failed, %zu of %llu bytes",
+                    paths[i], image.len, (unsigned long long)snapshot.raw_len);
+            free(image.buf);
+            return -1;
+        }
+
+        ret = example_check_open(&restored, "file:/check-snapshot-restored?vfs=memdb",
+                "file:/check-snapshot-restored-state?vfs=memdb");
+        if (-1 == ret) {
+            free(image.buf);
+            return -1;
+        }
+
+        ret = example_restore(&restored, image.buf, image.len, 0);
+        free(image.buf);
+        if (-1 == ret || 1 != example_check_count(&restored, "select count(*) from devices")) {
+            EXAMPLE_LOG(LOG_ERR, "restore of the \"%s\" snapshot failed", paths[i]);
+            example_deinit(&restored);
+            return -1;
+        }
+
+        example_deinit(&restored);
+    }
+
+    return 0;
+}
+
+
+// A snapshot of a wal database keeps the wal bytes in its header, which
+// example_restore and example_restore_file have to undo for memdb; restores
+// it writable from memory, and from a file both ways.
+int example_check_restore_wal (
+    void
+)
+{
+
+    int ret = 0;
+    char dir[] = "/tmp/example_check.XXXXXX";
+    char path[64];
+    char snapshot_path[64];
+    struct example_s example;
+    struct example_check_image_s image = {0};
+    struct example_snapshot_s snapshot = {
+        .sink = example_check_image_sink,
+        .user_data = &image
+    };
+    char journal_mode[16];
+
+    if (NULL == mkdtemp(dir)) {
+        EXAMPLE_LOG(LOG_ERR, "mkdtemp: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/db.sqlite", dir);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot.sqlite", dir);
+
+    ret = example_check_open(&example, path, "file:/check-wal-state?vfs=memdb");
+    if (-1 == ret) {
+        goto cleanup;
+    }
+
+    ret = example_pragma_get(&example, "journal_mode", NULL, journal_mode, sizeof(journal_mode));
+    if (-1 == ret || 0 != strcmp(journal_mode, "wal")) {
+        EXAMPLE_LOG(LOG_ERR, "journal_mode is %s, not wal", journal_mode);
+        example_deinit(&example);
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = example_device_new(&example, "000000000001", 12);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
+        example_deinit(&example);
+        goto cleanup;
+    }
+
+    ret = example_snapshot(&example, "main", &snapshot);
+    example_deinit(&example);
+    if (-1 == ret || image.len < EXAMPLE_RESTORE_HEADER_LEN || 2 != image.buf[18]) {
+        EXAMPLE_LOG(LOG_ERR, "no snapshot with a wal header");
+        ret = -1;
+        goto cleanup;
+    }
+
+    FILE * file = fopen(snapshot_path, "w");
+    if (NULL == file || image.len != fwrite(image.buf, 1, image.len, file) || 0 != fclose(file)) {
+        EXAMPLE_LOG(LOG_ERR, "writing %s failed", snapshot_path);
+        ret = -1;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        struct example_s restored;
+
+        ret = example_check_open(&restored, "file:/check-wal-restored?vfs=memdb",
+                "file:/check-wal-restored-state?vfs=memdb");
+        if (-1 == ret) {
+            goto cleanup;
+        }
+
+        switch (i) {
+            case 0: ret = example_restore(&restored, image.buf, image.len, 0); break;
+            case 1: ret = example_restore_file(&restored, snapshot_path, 0); break;
+            case 2: ret = example_restore_file(&restored, snapshot_path, EXAMPLE_RESTORE_READONLY); break;
+        }
+        if (-1 == ret || 1 != example_check_count(&restored, "select count(*) from devices")) {
+            EXAMPLE_LOG(LOG_ERR, "restore %d of the wal snapshot failed", i);
+            example_deinit(&restored);
+            ret = -1;
+            goto cleanup;
+        }
+
+        example_deinit(&restored);
+    }
+
+    // the file itself is left as it was
+    file = fopen(snapshot_path, "r");
+    uint8_t header[EXAMPLE_RESTORE_HEADER_LEN] = {0};
+    if (NULL == file || 1 != fread(header, sizeof(header), 1, file) || 2 != header[18]) {
+        EXAMPLE_LOG(LOG_ERR, "the header of %s was changed", snapshot_path);
+        ret = -1;
+    }
+    if (NULL != file) {
+        fclose(file);
+    }
+
+cleanup:
+    free(image.buf);
+    unlink(snapshot_path);
+    unlink(path);
+    strncat(path, "-wal", sizeof(path) - strlen(path) - 1);
+    unlink(path);
+    path[strlen(path) - 4] = '\0';
+    strncat(path, "-shm", sizeof(path) - strlen(path) - 1);
+    unlink(path);
+    rmdir(dir);
+    return ret;
+}
+
+
+// example_query_fetch with a buf too small for the next row says how large
+// it has to be, and still has the row for the next call.
+int example_check_query_fetch_small (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    struct example_query_s query;
+    struct example_row_s rows[4];
+    char buf[64];
+    size_t rows_len = 0;
+    size_t buf_needed = 0;
+
+    ret = example_check_open(&example, "file:/check-fetch?vfs=memdb", "file:/check-fetch-state?vfs=memdb");
+    if (-1 == ret) {
+        return -1;
+    }
+
+    ret = example_query_open_sql(&query, &example,
+            "select 'abcdefghijklmnopqrstuvwxyz' union all select 'x' order by 1");
+    if (-1 == ret) {
+        example_deinit(&example);
+        return -1;
+    }
+
+    // one byte short of the 26 characters and their nul
+    ret = example_query_fetch(&query, rows, 4, buf, 26, &rows_len, &buf_needed);
+    if (1 != ret || 0 != rows_len || 27 != buf_needed) {
+        EXAMPLE_LOG(LOG_ERR, "fetch into a small buf returned %d, %zu rows, needs %zu",
+                ret, rows_len, buf_needed);
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = example_query_fetch(&query, rows, 4, buf, sizeof(buf), &rows_len, &buf_needed);
+    if (0 != ret || 2 != rows_len
+        || 0 != strcmp(rows[0].columns[0].data, "abcdefghijklmnopqrstuvwxyz")
+        || 0 != strcmp(rows[1].columns[0].data, "x"))
+    {
+        EXAMPLE_LOG(LOG_ERR, "fetch after the small buf returned %d, %zu rows", ret, rows_len);
+        ret = -1;
+        goto cleanup;
+    }
+
+cleanup:
+    example_query_close(&query);
+    example_deinit(&example);
+    return ret;
+}
+
+
+int example_check_exec (
+    struct example_s * example,
+    const char * sql
+)
+{
+
+    int ret = 0;
+    char * err = NULL;
+
+    ret = sqlite3_exec(example->db, sql, NULL, NULL, &err);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_DEBUG, "sqlite3_exec returned %d: %s", ret, err);
+        sqlite3_free(err);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// The example_hash tables take the timestamp default of state.measured, and
+// undo the writes of a failed statement, a rollback and a rollback to a
+// savepoint.
+int example_check_hash_vtab (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    struct example_config_s config = example_config_default;
+
+    config.path = "file:/check-hash?vfs=memdb";
+    config.state_path = "file:/check-hash-state?vfs=memdb";
+    config.state_hash_capacity = 64;
+
+    memset(&example, 0, sizeof(example));
+    ret = example_init(&example, &config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    struct {
+        const char * sql;
+        int ret;
+        const char * count;
+        int64_t rows;
+    } steps[] = {
+        {"insert into state.measured(deviceid, outputid, state) values ('000000000001', 1, 1)", 0,
+            "select count(*) from state.measured where timestamp > 0", 1},
+        // the second row fails not null on state
+        {"insert into state.measured(deviceid, outputid, timestamp, state) "
+            "values ('000000000002', 1, 1, 1), ('000000000003', 1, 1, null)", -1,
+            "select count(*) from state.measured", 1},
+        {"update state.measured set state = 0, timestamp = null", -1,
+            "select count(*) from state.measured where state = 1 and timestamp > 0", 1},
+        {"begin; insert into state.measured(deviceid, outputid, state) values ('000000000004', 1, 1)", 0,
+            "select count(*) from state.measured", 2},
+        {"insert or replace into state.measured(deviceid, outputid, timestamp, state) "
+            "values ('000000000004', 1, 5, 0), ('000000000005', 1, 1, null)", -1,
+            "select count(*) from state.measured where deviceid = '000000000004' and state = 1", 1},
+        {"savepoint a; delete from state.measured; rollback to a; release a", 0,
+            "select count(*) from state.measured", 2},
+        {"update state.measured set deviceid = '000000000006' where deviceid = '000000000001'", 0,
+            "select count(*) from state.measured where deviceid = '000000000006'", 1},
+        {"rollback", 0,
+            "select count(*) from state.measured where deviceid = '000000000001'", 1},
+        {"select 1", 0,
+            "select count(*) from state.measured", 1},
+    };
+
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        ret = example_check_exec(&example, steps[i].sql);
+        const int64_t rows = example_check_count(&example, steps[i].count);
+        if (steps[i].ret != ret || steps[i].rows != rows) {
+            EXAMPLE_LOG(LOG_ERR, "\"%s\" returned %d and left %lld rows, expected %d and %lld",
+                    steps[i].sql, ret, (long long)rows, steps[i].ret, (long long)steps[i].rows);
+            example_deinit(&example);
+            return -1;
+        }
+    }
+
+    example_deinit(&example);
+
+    return 0;
+}
+
+
+// A snapshot with packed deviceids doesn't restore into a database opened with
+// text ones, and an existing packed database doesn't open with
+// state_hash_capacity even though the config doesn't ask for packed ones.
+int example_check_deviceid_mode (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s packed;
+    struct example_s text;
+    struct example_s hash;
+    struct example_check_image_s image = {0};
+    struct example_snapshot_s snapshot = {
+        .sink = example_check_image_sink,
+        .user_data = &image
+    };
+    struct example_config_s config = example_config_default;
+
+    config.path = "file:/check-packed?vfs=memdb";
+    config.state_path = "file:/check-packed-state?vfs=memdb";
+    config.deviceid_packed = true;
+
+    memset(&packed, 0, sizeof(packed));
+    ret = example_init(&packed, &config);
+    if (-1 == ret || !packed.deviceid_packed) {
+        EXAMPLE_LOG(LOG_ERR, "example_init of a packed database failed");
+        example_deinit(&packed);
+        return -1;
+    }
+
+    ret = example_device_new(&packed, "00000000000a", 12);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
+        example_deinit(&packed);
+        return -1;
+    }
+
+    ret = example_snapshot(&packed, "main", &snapshot);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_snapshot returned -1");
+        example_deinit(&packed);
+        free(image.buf);
+        return -1;
+    }
+
+    // same database, opened while the first connection keeps it alive
+    config.deviceid_packed = false;
+    config.state_path = "file:/check-packed-hash-state?vfs=memdb";
+    config.state_hash_capacity = 64;
+    memset(&hash, 0, sizeof(hash));
+    ret = example_init(&hash, &config);
+    example_deinit(&hash);
+    example_deinit(&packed);
+    if (-1 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "a packed database opened with state_hash_capacity");
+        free(image.buf);
+        return -1;
+    }
+
+    ret = example_check_open(&text, "file:/check-text?vfs=memdb", "file:/check-text-state?vfs=memdb");
+    if (-1 == ret) {
+        free(image.buf);
+        return -1;
+    }
+
+    ret = example_device_new(&text, "000000000001", 12);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
+        example_deinit(&text);
+        free(image.buf);
+        return -1;
+    }
+
+    ret = example_restore(&text, image.buf, image.len, 0);
+    free(image.buf);
+    if (-1 != ret || text.deviceid_packed
+        || 1 != example_check_count(&text, "select count(*) from devices where deviceid = '000000000001'"))
+    {
+        EXAMPLE_LOG(LOG_ERR, "a packed snapshot restored into a text database");
+        example_deinit(&text);
+        return -1;
+    }
+
+    example_deinit(&text);
+
+    return 0;
+}
+
+
+// With config->instrument, even statements that run for well under a
+// millisecond are timed to the nanosecond, rather than all landing in bucket 0.
+int example_check_latency (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    struct example_stats_s stats;
+    struct example_config_s config = example_config_default;
+    char deviceid[13];
+
+    config.path = "file:/check-latency?vfs=memdb";
+    config.state_path = "file:/check-latency-state?vfs=memdb";
+    config.instrument = true;
+
+    memset(&example, 0, sizeof(example));
+    ret = example_init(&example, &config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(deviceid, sizeof(deviceid), "%012x", i);
+        ret = example_device_new(&example, deviceid, 12);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_device_new returned -1");
+            example_deinit(&example);
+            return -1;
+        }
+    }
+
+    ret = example_stats_get(&example, &stats, false);
+    example_deinit(&example);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_stats_get returned -1");
+        return -1;
+    }
+
+    const struct example_histogram_s * latency = &stats.stmts[EXAMPLE_STMT_DEVICE_NEW].latency;
+    if (100 != latency->count || 0 != latency->buckets[0] || 0 == latency->sum_ns) {
+        EXAMPLE_LOG(LOG_ERR, "%llu samples, %llu of them in bucket 0, %llu ns in all",
+                (unsigned long long)latency->count, (unsigned long long)latency->buckets[0],
+                (unsigned long long)latency->sum_ns);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// set by the threads of example_check_log_ring
+static _Atomic int example_check_log_ring_failed = 0;
+
+
+// Runs after the logger's key destructor, since that key was created first.
+void example_check_log_ring_exit (
+    void * arg
+)
+{
+    // frees the ring of this thread, which is dead by now
+    example_log_drain();
+
+    EXAMPLE_LOG(LOG_INFO, "logged after the ring was let go of");
+    if (NULL != example_log_ring) {
+        atomic_store(&example_check_log_ring_failed, 1);
+    }
+    (void)arg;
+}
+
+
+void * example_check_log_ring_thread (
+    void * arg
+)
+{
+    pthread_key_t * key = arg;
+
+    EXAMPLE_LOG(LOG_INFO, "logged from a thread");
+    if (NULL == example_log_ring || 0 != (uintptr_t)example_log_ring % 64) {
+        atomic_store(&example_check_log_ring_failed, 1);
+    }
+
+    pthread_setspecific(*key, key);
+
+    return NULL;
+}
+
+
+// A thread's log ring is aligned for its head and tail, and once the thread
+// exits, logging from the rest of its teardown doesn't touch the ring the
+// logger thread frees.
+int example_check_log_ring (
+    void
+)
+{
+
+    int ret = 0;
+    pthread_t thread;
+    pthread_key_t key;
+
+    ret = example_log_start(/* poll_interval_us = */ 1000);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_log_start returned -1");
+        return -1;
+    }
+
+    // the logger's key exists once something has logged
+    EXAMPLE_LOG(LOG_INFO, "logged from the main thread");
+
+    ret = pthread_key_create(&key, example_check_log_ring_exit);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_key_create returned %d", ret);
+        example_log_stop();
+        return -1;
+    }
+
+    ret = pthread_create(&thread, NULL, example_check_log_ring_thread, &key);
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "pthread_create returned %d", ret);
+        pthread_key_delete(key);
+        example_log_stop();
+        return -1;
+    }
+    pthread_join(thread, NULL);
+
+    pthread_key_delete(key);
+    example_log_stop();
+
+    if (atomic_load(&example_check_log_ring_failed)) {
+        EXAMPLE_LOG(LOG_ERR, "the thread's ring was misaligned or still attached on exit");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int example_check_aggregate_count (
+    void * user_data,
+    int64_t aggregate
+)
+{
+    (*(uint64_t *)user_data)++;
+    return 0;
+    (void)aggregate;
+}
+
+
+// The parallel aggregate cuts even the widest groupid ranges into shards that
+// cover every group once, and finds as many groups as the serial query.
+int example_check_aggregate_parallel_wide (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_pool_s pool;
+    struct example_config_s config = example_config_default;
+    const char * const groupids[] = {
+        // all 2^64 groupids
+        "-9223372036854775807 - 1), (-1), (0), (9223372036854775807",
+        // 2^63 + 1 of them; span * i overflowed from the third shard on
+        "-4611686018427387904), (1), (2), (4611686018427387904",
+    };
+
+    config.path = "file:/check-aggregate?vfs=memdb";
+    config.state_path = "file:/check-aggregate-state?vfs=memdb";
+
+    for (size_t i = 0; i < sizeof(groupids) / sizeof(groupids[0]); i++) {
+        char sql[512];
+        uint64_t serial = 0;
+        uint64_t parallel = 0;
+
+        memset(&pool, 0, sizeof(pool));
+        ret = example_pool_init(&pool, &config, 4);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pool_init returned -1");
+            return -1;
+        }
+
+        snprintf(sql, sizeof(sql),
+            "insert into devices values ('000000000001');"
+            "insert into outputs values ('000000000001', 1);"
+            "insert into groups select '000000000001', 1, column1 from (values (%s));",
+            groupids[i]);
+        ret = example_check_exec(&pool.writer, sql);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "inserting groupids %s failed", groupids[i]);
+            example_pool_deinit(&pool);
+            return -1;
+        }
+
+        ret = example_custom_aggregate_query(&pool.writer, example_check_aggregate_count, &serial);
+        if (-1 != ret) {
+            ret = example_custom_aggregate_query_parallel(&pool, 0, example_check_aggregate_count, &parallel);
+        }
+        example_pool_deinit(&pool);
+        if (-1 == ret || 4 != serial || serial != parallel) {
+            EXAMPLE_LOG(LOG_ERR, "groupids %s: %llu groups serially, %llu in parallel",
+                groupids[i], (unsigned long long)serial, (unsigned long long)parallel);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int example_check_async_stop_row (
+    void * user_data,
+    const struct example_row_s * row
+)
+{
+    return 1;
+    (void)user_data;
+    (void)row;
+}
+
+
+// A statement that fails with SQLITE_ERROR, which is 1 like a row callback
+// stopping early, completes with -1; a callback stopping early with 0.
+int example_check_async_errors (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_pool_s pool;
+    struct example_async_s async;
+    struct example_config_s config = example_config_default;
+    struct example_async_req_s reqs[] = {
+        // integer overflow
+        {.sql = "select abs(-9223372036854775807 - 1)"},
+        {.sql = "select 1 union all select 2", .row = example_check_async_stop_row},
+        {.sql = "select 1"},
+    };
+    const int expected[] = {-1, 0, 0};
+    const uint32_t reqs_len = sizeof(reqs) / sizeof(reqs[0]);
+
+    config.path = "file:/check-async?vfs=memdb";
+    config.state_path = "file:/check-async-state?vfs=memdb";
+
+    memset(&pool, 0, sizeof(pool));
+    ret = example_pool_init(&pool, &config, 2);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_pool_init returned -1");
+        return -1;
+    }
+
+    ret = example_async_start(&async, &pool, 2, 16);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_async_start returned -1");
+        example_pool_deinit(&pool);
+        return -1;
+    }
+
+    for (uint32_t i = 0; 0 == ret && i < reqs_len; i++) {
+        ret = example_async_submit(&async, &reqs[i]);
+    }
+
+    uint32_t done = 0;
+    while (0 == ret && done < reqs_len) {
+        struct pollfd pfd = {.fd = example_async_fd(&async), .events = POLLIN};
+        struct example_async_req_s * reaped[4];
+        if (1 != poll(&pfd, 1, 5000)) {
+            EXAMPLE_LOG(LOG_ERR, "no requests completed within 5s");
+            ret = -1;
+            break;
+        }
+        done += example_async_reap(&async, reaped, 4);
+    }
+
+    example_async_stop(&async);
+    example_pool_deinit(&pool);
+
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "running the requests failed");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < reqs_len; i++) {
+        if (expected[i] != reqs[i].ret) {
+            EXAMPLE_LOG(LOG_ERR, "\"%s\" completed with %d, expected %d",
+                reqs[i].sql, reqs[i].ret, expected[i]);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+// measured_rows_max is kept by every upsert, and eviction (the cap, or
+// example_measured_trim above state_trim_size) and expiry leave the drift feed
+// alone; deleting rows in SQL still reconciles them.
+int example_check_measured_cap (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    struct example_config_s config = example_config_default;
+    char deviceid[13];
+    bool done = false;
+
+    config.path = "file:/check-cap?vfs=memdb";
+    config.state_path = "file:/check-cap-state?vfs=memdb";
+    config.measured_rows_max = 4;
+    config.state_trim_size = 1;
+
+    memset(&example, 0, sizeof(example));
+    ret = example_init(&example, &config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    ret = example_check_exec(&example,
+        "insert into state.setpoint(deviceid, outputid, setstate) "
+            "select printf('%012d', column1), 1, 1 from (values (1), (2), (3), (4), (5), (6))");
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_check_exec returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    // all of them drift, the oldest two get evicted on the way
+    for (int i = 1; 0 == ret && i <= 6; i++) {
+        snprintf(deviceid, sizeof(deviceid), "%012d", i);
+        ret = example_measured_upsert(
+            /* example = */ &example,
+            /* deviceid = */ deviceid,
+            /* deviceid_len = */ 12,
+            /* outputid = */ 1,
+            /* state = */ false,
+            /* level = */ NULL,
+            /* timestamp = */ (uint64_t)i << 32,
+            /* skip_unchanged = */ false
+        );
+    }
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_upsert returned %d", ret);
+        example_deinit(&example);
+        return -1;
+    }
+
+    ret = example_measured_trim(&example, 2, &done);
+    if (2 != ret || !done) {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_trim returned %d, expected 2", ret);
+        example_deinit(&example);
+        return -1;
+    }
+
+    struct {
+        const char * sql;
+        int64_t count;
+    } checks[] = {
+        {"select count(*) from state.measured where deviceid > '000000000004'", 2},
+        {"select rows from state.measured_rows", 2},
+        {"select count(*) from state.drift", 6},
+        {"select count(*) from state.drift_feed where drifted", 6},
+        {"select count(*) from state.drift_feed where not drifted", 0},
+    };
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        const int64_t count = example_check_count(&example, checks[i].sql);
+        if (checks[i].count != count) {
+            EXAMPLE_LOG(LOG_ERR, "\"%s\" is %lld, expected %lld",
+                checks[i].sql, (long long)count, (long long)checks[i].count);
+            example_deinit(&example);
+            return -1;
+        }
+    }
+
+    // expiry is as quiet as eviction; the rows are from the first seconds of
+    // the clock, long gone with a ttl of 0
+    ret = example_measured_expire(&example, 0, 16, &done);
+    if (2 != ret || !done
+        || 0 != example_check_count(&example, "select rows from state.measured_rows")
+        || 0 != example_check_count(&example, "select count(*) from state.drift_feed where not drifted"))
+    {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_expire returned %d, and wrote to the drift feed", ret);
+        example_deinit(&example);
+        return -1;
+    }
+
+    ret = 0;
+    for (int i = 5; 0 == ret && i <= 6; i++) {
+        snprintf(deviceid, sizeof(deviceid), "%012d", i);
+        ret = example_measured_upsert(
+            /* example = */ &example,
+            /* deviceid = */ deviceid,
+            /* deviceid_len = */ 12,
+            /* outputid = */ 1,
+            /* state = */ false,
+            /* level = */ NULL,
+            /* timestamp = */ (uint64_t)i << 32,
+            /* skip_unchanged = */ false
+        );
+    }
+    if (0 != ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_measured_upsert returned %d", ret);
+        example_deinit(&example);
+        return -1;
+    }
+
+    ret = example_check_exec(&example, "delete from state.measured");
+    if (-1 == ret
+        || 2 != example_check_count(&example, "select count(*) from state.drift_feed where not drifted")
+        || 0 != example_check_count(&example, "select rows from state.measured_rows"))
+    {
+        EXAMPLE_LOG(LOG_ERR, "deleting state.measured didn't reconcile the drift");
+        example_deinit(&example);
+        return -1;
+    }
+
+    example_deinit(&example);
+
+    return 0;
+}
+
+
+// Deleting through sql leaves tombstones, which the inserts clear out of the
+// way again; without that the table fills up with them. A window of 48 rows,
+// the oldest deleted for each new one, the way eviction goes.
+int example_check_hash_vtab_tombstones (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    struct example_config_s config = example_config_default;
+    char sql[256];
+
+    config.path = "file:/check-tombstones?vfs=memdb";
+    config.state_path = "file:/check-tombstones-state?vfs=memdb";
+    config.state_hash_capacity = 64;
+
+    memset(&example, 0, sizeof(example));
+    ret = example_init(&example, &config);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    for (int i = 0; 0 == ret && i < 1024; i++) {
+        snprintf(sql, sizeof(sql),
+            "insert into state.measured(deviceid, outputid, state) values ('%012d', 1, 1);"
+            "delete from state.measured where deviceid = '%012d';", i, i - 48);
+        ret = example_check_exec(&example, sql);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "insert and delete %d failed", i);
+        }
+    }
+
+    example_deinit(&example);
+
+    return ret;
+}
+
+
+// The query plan of sql has a line containing expect, and no temp b-tree,
+// i.e. nothing sorted at run time. The plan is logged at LOG_DEBUG.
+int example_check_query_plan (
+    struct example_s * example,
+    const char * sql,
+    const char * expect
+)
+{
+
+    int ret = 0;
+    sqlite3_stmt * stmt = NULL;
+    char * explain = NULL;
+    bool found = false;
+    bool temp_btree = false;
+
+    explain = sqlite3_mprintf("explain query plan %s", sql);
+    if (NULL == explain) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_mprintf returned NULL");
+        return -1;
+    }
+
+    ret = sqlite3_prepare_v2(example->db, explain, -1, &stmt, NULL);
+    sqlite3_free(explain);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_prepare_v2 returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    // columns are id, parent, notused, detail
+    while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+        const char * detail = (const char *)sqlite3_column_text(stmt, 3);
+        EXAMPLE_LOG(LOG_DEBUG, "%s: %s", sql, detail);
+        if (NULL == detail) {
+            continue;
+        }
+        found = found || NULL != strstr(detail, expect);
+        temp_btree = temp_btree || NULL != strstr(detail, "TEMP B-TREE");
+    }
+    sqlite3_finalize(stmt);
+    if (SQLITE_DONE != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_step returned %d: %s",
+            ret, sqlite3_errmsg(example->db));
+        return -1;
+    }
+
+    if (!found || temp_btree) {
+        EXAMPLE_LOG(LOG_ERR, "the plan of \"%s\" %s", sql,
+            temp_btree ? "uses a temp b-tree" : "doesn't have the expected step");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Regression check for the query plans. Before groups_groupid, the plan for
+// the aggregate query was
+//   SCAN groups
+//   USE TEMP B-TREE FOR GROUP BY
+// and by groupid a full scan.
+int example_check_query_plans (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    const struct {
+        const char * sql;
+        const char * expect;
+    } plans[] = {
+        {example_stmts[EXAMPLE_STMT_CUSTOM_AGGREGATE_QUERY].sql,
+            "SCAN groups USING COVERING INDEX groups_groupid"},
+        {"select deviceid, outputid from groups where groupid = ?",
+            "SEARCH groups USING COVERING INDEX groups_groupid (groupid=?)"},
+        {example_stmts[EXAMPLE_STMT_CUSTOM_AGGREGATE_SHARD].sql,
+            "SEARCH groups USING COVERING INDEX groups_groupid (groupid>? AND groupid<?)"},
+        {example_stmts[EXAMPLE_STMT_MEASURED_SCAN].sql,
+            "SEARCH state.measured USING PRIMARY KEY ((deviceid,outputid)>(?,?))"},
+        // the subquery, already in timestamp order
+        {example_stmts[EXAMPLE_STMT_MEASURED_EXPIRE].sql,
+            "SEARCH state.measured USING COVERING INDEX measured_timestamp (timestamp<?)"},
+    };
+
+    ret = example_check_open(&example, "file:/check-plans?vfs=memdb", "file:/check-plans-state?vfs=memdb");
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_check_open returned -1");
+        return -1;
+    }
+
+    for (size_t i = 0; 0 == ret && i < sizeof(plans) / sizeof(plans[0]); i++) {
+        ret = example_check_query_plan(&example, plans[i].sql, plans[i].expect);
+    }
+
+    example_deinit(&example);
+
+    return ret;
+}
+
+
+// A version 1 database of 100 groups rows, which migration 2 copies 7 rows at
+// a time while rows are written to groups on both sides of its cursor.
+int example_check_schema_migrate_online (
+    const bool packed
+)
+{
+
+    int ret = 0;
+    int more = 0;
+    int chunks = 0;
+    int64_t version = 0;
+    char * err = NULL;
+    sqlite3 * db = NULL;
+    struct example_s example;
+    struct example_config_s config = example_config_default;
+    const char * const path = packed ? "file:/check-migrate-packed?vfs=memdb" : "file:/check-migrate?vfs=memdb";
+    char * sql = NULL;
+
+    // the raw connection keeps the memdb database alive until example_init has it
+    ret = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_open_v2 returned %d", ret);
+        sqlite3_close(db);
+        return -1;
+    }
+
+    sql = sqlite3_mprintf(
+        "%s"
+        "pragma user_version = 1;"
+        "with recursive n(i) as (values (1) union all select i + 1 from n where i < 4) "
+            "insert into devices select %s from n;"
+        "with recursive n(i) as (values (0) union all select i + 1 from n where i < 4) "
+            "insert into outputs select deviceid, i from devices, n;"
+        "with recursive n(i) as (values (0) union all select i + 1 from n where i < 4) "
+            "insert into groups select deviceid, outputid, i from outputs, n;",
+        packed ? example_schema_full_packed : example_schema_full,
+        packed ? "i" : "printf('%012d', i)");
+    if (NULL == sql) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_mprintf returned NULL");
+        sqlite3_close(db);
+        return -1;
+    }
+
+    ret = sqlite3_exec(db, sql, NULL, NULL, &err);
+    sqlite3_free(sql);
+    if (SQLITE_OK != ret) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_exec returned %d: %s", ret, err);
+        sqlite3_free(err);
+        sqlite3_close(db);
+        return -1;
+    }
+
+    config.path = path;
+    config.state_path = packed ? "file:/check-migrate-packed-state?vfs=memdb" : "file:/check-migrate-state?vfs=memdb";
+    config.deviceid_packed = packed;
+
+    memset(&example, 0, sizeof(example));
+    ret = example_init(&example, &config);
+    sqlite3_close(db);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+        example_deinit(&example);
+        return -1;
+    }
+
+    // example_init leaves the online step pending on an existing database
+    ret = example_pragma_get(&example, "user_version", &version, NULL, 0);
+    if (-1 == ret || 1 != version
+        || 1 != example_check_count(&example, "select count(*) from sqlite_master where name = 'groups_v2'"))
+    {
+        EXAMPLE_LOG(LOG_ERR, "example_init didn't leave migration 2 pending");
+        example_deinit(&example);
+        return -1;
+    }
+
+    more = example_schema_migrate(&example, 7);
+    chunks++;
+
+    // (1, 0, 100) and (1, 0, 0) are behind the cursor now, the others ahead
+    sql = sqlite3_mprintf(
+        "insert into groups values (%s, 0, 100);"
+        "insert into groups values (%s, 0, 100);"
+        "delete from groups where deviceid = %s and outputid = 0 and groupid = 0;"
+        "delete from groups where deviceid = %s and outputid = 2 and groupid = 2;"
+        "update groups set groupid = 200 where deviceid = %s and outputid = 0 and groupid = 0;",
+        packed ? "1" : "'000000000001'",
+        packed ? "4" : "'000000000004'",
+        packed ? "1" : "'000000000001'",
+        packed ? "3" : "'000000000003'",
+        packed ? "2" : "'000000000002'");
+    if (NULL == sql) {
+        EXAMPLE_LOG(LOG_ERR, "sqlite3_mprintf returned NULL");
+        example_deinit(&example);
+        return -1;
+    }
+
+    ret = example_check_exec(&example, sql);
+    sqlite3_free(sql);
+    if (-1 == ret || 1 != more) {
+        EXAMPLE_LOG(LOG_ERR, "the first chunk of migration 2 failed");
+        example_deinit(&example);
+        return -1;
+    }
+
+    while (1 == more) {
+        more = example_schema_migrate(&example, 7);
+        chunks++;
+    }
+
+    ret = example_pragma_get(&example, "user_version", &version, NULL, 0);
+    if (0 != more || -1 == ret || 2 != version || chunks < 100 / 7) {
+        EXAMPLE_LOG(LOG_ERR, "migration 2 ended with %d at version %lld after %d chunks",
+            more, (long long)version, chunks);
+        example_deinit(&example);
+        return -1;
+    }
+
+    if (100 != example_check_count(&example, "select count(*) from groups")
+        || 2 != example_check_count(&example, "select count(*) from groups where groupid = 100")
+        || 1 != example_check_count(&example, "select count(*) from groups where groupid = 200")
+        || 18 != example_check_count(&example, "select count(*) from groups where outputid = 0 and groupid < 5")
+        || 19 != example_check_count(&example, "select count(*) from groups where outputid = 2")
+        || 0 != example_check_count(&example, "select count(*) from sqlite_master where name like 'groups_v2%'"))
+    {
+        EXAMPLE_LOG(LOG_ERR, "groups doesn't have the rows written during migration 2");
+        example_deinit(&example);
+        return -1;
+    }
+
+    ret = example_check_query_plan(&example, "select deviceid, outputid from groups where groupid = ?",
+        "SEARCH groups USING COVERING INDEX groups_groupid (groupid=?)");
+
+    example_deinit(&example);
+
+    return ret;
+}
+
+
+// Migration 2 is an online step, see example_schema_migration_2_chunk; with
+// text and packed deviceids, which start the copy from different keys.
+int example_check_schema_migrate (
+    void
+)
+{
+
+    int ret = 0;
+
+    ret = example_check_schema_migrate_online(false);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_check_schema_migrate_online returned -1 with text deviceids");
+        return -1;
+    }
+
+    ret = example_check_schema_migrate_online(true);
+    if (-1 == ret) {
+        EXAMPLE_LOG(LOG_ERR, "example_check_schema_migrate_online returned -1 with packed deviceids");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// A deviceid which doesn't bind is rejected with its row like one which fails
+// the check constraint, and the rows after it are still looked at.
+int example_check_insert_batch_rejects (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_s example;
+    struct example_config_s config = example_config_default;
+    struct example_batch_reject_s rejects[4];
+    struct example_batch_s batch = {
+        .rejects = rejects,
+        .rejects_cap = 4
+    };
+    const struct example_device_s devices[] = {
+        {"000000000001", 12},
+        {"bad", 3},
+        {"000000000003", 12},
+        {"bad", 3},
+    };
+
+    for (int packed = 0; packed < 2; packed++) {
+        config.path = packed ? "file:/check-rejects-packed?vfs=memdb" : "file:/check-rejects?vfs=memdb";
+        config.state_path = packed ? "file:/check-rejects-packed-state?vfs=memdb" : "file:/check-rejects-state?vfs=memdb";
+        config.deviceid_packed = packed;
+
+        memset(&example, 0, sizeof(example));
+        ret = example_init(&example, &config);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_init returned -1");
+            example_deinit(&example);
+            return -1;
+        }
+
+        const int errcode = packed ? SQLITE_MISMATCH : SQLITE_CONSTRAINT_CHECK;
+        ret = example_devices_insert_batch(&example, devices, 4, &batch);
+        if (-1 != ret || 2 != batch.rejects_len || 0 != batch.committed
+            || 1 != rejects[0].row || errcode != rejects[0].errcode
+            || 3 != rejects[1].row || errcode != rejects[1].errcode
+            || 0 != example_check_count(&example, "select count(*) from devices"))
+        {
+            EXAMPLE_LOG(LOG_ERR, "%s deviceids: %u rows rejected, the first row %u with %d",
+                packed ? "packed" : "text", batch.rejects_len, rejects[0].row, rejects[0].errcode);
+            example_deinit(&example);
+            return -1;
+        }
+
+        example_deinit(&example);
+    }
+
+    return 0;
+}
+
+
+// set up by example_check_writer_rejects, too large for the stack
+static struct example_writer_s example_check_writer;
+
+// The writer counts a measurement whose key can't be bound as rejected, and
+// applies the rest of the batch: a deviceid which doesn't pack, and a negative
+// outputid in an example_hash table.
+int example_check_writer_rejects (
+    void
+)
+{
+
+    int ret = 0;
+    struct example_pool_s pool;
+    struct example_config_s config = example_config_default;
+
+    for (int hash = 0; hash < 2; hash++) {
+        config.path = hash ? "file:/check-writer-hash?vfs=memdb" : "file:/check-writer-packed?vfs=memdb";
+        config.state_path = hash ? "file:/check-writer-hash-state?vfs=memdb" : "file:/check-writer-packed-state?vfs=memdb";
+        config.deviceid_packed = !hash;
+        config.state_hash_capacity = hash ? 64 : 0;
+
+        memset(&pool, 0, sizeof(pool));
+        ret = example_pool_init(&pool, &config, 1);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_pool_init returned -1");
+            return -1;
+        }
+
+        ret = example_writer_start(&example_check_writer, &pool, 1000, false);
+        if (-1 == ret) {
+            EXAMPLE_LOG(LOG_ERR, "example_writer_start returned -1");
+            example_pool_deinit(&pool);
+            return -1;
+        }
+
+        for (int i = 0; 0 == ret && i < 10; i++) {
+            struct example_measurement_s measurement = {
+                .outputid = 1,
+                .state = true,
+                .level_null = true
+            };
+            char deviceid[13];
+            snprintf(deviceid, sizeof(deviceid), "%012d", i);
+            memcpy(measurement.deviceid, 4 == i && !hash ? "ABCDEFABCDEF" : deviceid, 12);
+            if (4 == i && hash) {
+                measurement.outputid = -1;
+            }
+            ret = example_writer_push(&example_check_writer, &measurement);
+        }
+
+        (void)example_writer_stop(&example_check_writer);
+        example_pool_deinit(&pool);
+
+        const uint64_t applied = atomic_load(&example_check_writer.applied);
+        const uint64_t rejected = atomic_load(&example_check_writer.rejected);
+        const uint64_t failed = atomic_load(&example_check_writer.failed);
+        if (-1 == ret || 9 != applied || 1 != rejected || 0 != failed) {
+            EXAMPLE_LOG(LOG_ERR, "%s: applied=%llu rejected=%llu failed=%llu",
+                hash ? "hash" : "packed",
+                (unsigned long long)applied, (unsigned long long)rejected, (unsigned long long)failed);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static const struct example_check_s example_checks[] = {
+    {"snapshot_memory", example_check_snapshot_memory},
+    {"restore_wal", example_check_restore_wal},
+    {"query_fetch_small", example_check_query_fetch_small},
+    {"hash_vtab", example_check_hash_vtab},
+    {"hash_vtab_tombstones", example_check_hash_vtab_tombstones},
+    {"deviceid_mode", example_check_deviceid_mode},
+    {"latency", example_check_latency},
+    {"log_ring", example_check_log_ring},
+    {"aggregate_parallel_wide", example_check_aggregate_parallel_wide},
+    {"async_errors", example_check_async_errors},
+    {"measured_cap", example_check_measured_cap},
+    {"query_plan", example_check_query_plans},
+    {"schema_migrate", example_check_schema_migrate},
+    {"insert_batch_rejects", example_check_insert_batch_rejects},
+    {"writer_rejects", example_check_writer_rejects},
+};
+
+
+int main (
+    int argc,
+    char const* argv[]
+)
+{
+
+    int ret = 0;
+    int failed = 0;
+
+    openlog("example_check", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    for (size_t i = 0; i < sizeof(example_checks) / sizeof(example_checks[0]); i++) {
+        bool selected = 1 == argc;
+        for (int j = 1; j < argc; j++) {
+            selected |= 0 == strcmp(argv[j], example_checks[i].name);
+        }
+        if (!selected) {
+            continue;
+        }
+
+        ret = example_checks[i].run();
+        printf("%s %s\n", -1 == ret ? "FAIL" : "ok  ", example_checks[i].name);
+        if (-1 == ret) {
+            failed++;
+        }
+    }
+
+    return 0 == failed ? 0 : 1;
+}